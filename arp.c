@@ -13,9 +13,23 @@
 // Last Revision:   May 17, 2011
 // Revision ID:     3
 // -------------------------------------------------------
-// Functions:       arp_get_map()
+// Functions:       list_remove()
+//                  list_insert()
+//                  cache_find()
+//                  cache_free()
+//                  cache_flush()
+//                  cache_new()
+//                  arp_request()
+//                  arp_resolve()
+//                  arp_next_hop()
+//                  arp_get_mac()
+//                  arp_send()
+//                  cache_set()
 //                  cache_add()
+//                  arp_snoop()
+//                  arp_solicited()
 //                  arp_parse()
+//                  arp_retry()
 //                  arp_tick()
 //                  arp_init()
 // -------------------------------------------------------
@@ -31,9 +45,12 @@
 // ----------------
 // protocol timming
 // ----------------
-#define CACHE_TIME_ARP                  120
-#define TIMEOUT_ARP                     5000
-#define TICK_ARP                        10000
+#define TICK_ARP                        250     // timer period (ms)
+#define LIFE_ARP                        4800    // entry life time (ticks, 20 min)
+#define REFRESH_ARP                     240     // refresh hot entries this long before expiry (ticks, 1 min)
+#define RETRY_ARP                       1       // first request retry (ticks)
+#define SWEEP_ARP                       240     // resolved entries aged this often (ticks, 1 min)
+#define MAX_RETRIES_ARP                 4       // requests sent before giving up
 
 // -----------
 // ARP opcodes
@@ -41,17 +58,310 @@
 #define ARP_REQUEST                     0x0100
 #define ARP_REPLY                       0x0200
 
-// ---------
-// ARP cache
-// ---------
-typedef struct {
-    IPV4 ip_address;
-    MACADDR mac_address;
-    BYTE time;
-} ARP_CACHE_ENTRY;
-ARP_CACHE_ENTRY arp_cache[MAX_CACHE_ARP];
+// -----------------
+// cache entry state
+// -----------------
+#define ARP_FREE                        0
+#define ARP_INCOMPLETE                  1       // request sent, waiting reply
+#define ARP_RESOLVED                    2
+
+#define ARP_HASH(ip)                    (((ip)->b[3] ^ (ip)->b[2]) & (ARP_HASH_SIZE - 1))
+#define EXPIRED(t)                      ((UInt16)(arp_clock - (t)) < 0x8000)
+
+// --------------------------
+// state of the current stack
+// --------------------------
+#define arp_cache                       (hermes->arp.cache)
+#define arp_hash                        (hermes->arp.hash)
+#define arp_free                        (hermes->arp.list_free)
+#define arp_pending                     (hermes->arp.list_pending)
+#define arp_lru                         (hermes->arp.list_lru)
+#define arp_clock                       (hermes->arp.clock)
+#define arp_due                         (hermes->arp.due)
+#define arp_sweep                       (hermes->arp.sweep)
 
 #define ARP(xxx)		((ARP_HDR *)(xxx))
+#define IPH(xxx)		((IP_HDR *)(xxx))
+
+// ------------------------------------------------
+// Function:        list_remove()
+// ------------------------------------------------
+// Input:           List
+//                  Entry index
+// Output:          -
+// ------------------------------------------------
+// Description:     Unlinks an entry from a list
+// ------------------------------------------------
+static void list_remove(ARP_LIST *l, ARP_INDEX i)
+{
+    ARP_CACHE_ENTRY *a;
+
+    a = &arp_cache[i];
+    if(a->prev != ARP_NONE) arp_cache[a->prev].next = a->next;
+    else l->head = a->next;
+    if(a->next != ARP_NONE) arp_cache[a->next].prev = a->prev;
+    else l->tail = a->prev;
+    a->prev = ARP_NONE;
+    a->next = ARP_NONE;
+}
+
+// ------------------------------------------------
+// Function:        list_insert()
+// ------------------------------------------------
+// Input:           List
+//                  Entry index
+// Output:          -
+// ------------------------------------------------
+// Description:     Links an entry at the head of
+//                  a list
+// ------------------------------------------------
+static void list_insert(ARP_LIST *l, ARP_INDEX i)
+{
+    ARP_CACHE_ENTRY *a;
+
+    a = &arp_cache[i];
+    a->prev = ARP_NONE;
+    a->next = l->head;
+    if(l->head != ARP_NONE) arp_cache[l->head].prev = i;
+    else l->tail = i;
+    l->head = i;
+}
+
+// ------------------------------------------------
+// Function:        cache_find()
+// ------------------------------------------------
+// Input:           IP to find
+// Output:          Cache entry index or ARP_NONE
+// ------------------------------------------------
+// Description:     Searchs the hash table for an
+//                  IP
+// ------------------------------------------------
+static ARP_INDEX cache_find(IPV4 *ip)
+{
+    ARP_INDEX i;
+
+    i = arp_hash[ARP_HASH(ip)];
+    while(i != ARP_NONE) {
+        if(arp_cache[i].ip_address.d == ip->d) break;
+        i = arp_cache[i].hash;
+    }
+    return i;
+}
+
+// ------------------------------------------------
+// Function:        cache_flush()
+// ------------------------------------------------
+// Input:           Cache entry
+//                  TRUE to send the packets
+// Output:          -
+// ------------------------------------------------
+// Description:     Sends (or drops) the packets
+//                  waiting for an entry
+// ------------------------------------------------
+static void cache_flush(ARP_CACHE_ENTRY *a, BOOL send)
+{
+    BYTE i;
+
+    for(i=0; i<ARP_QUEUE; i++) {
+        if(a->queue[i] == NULL) continue;
+        if(send) {
+            LAT_MARK(a->queue[i], LAT_TX_ARP);
+            eth_send(a->queue[i], ETH_PROT_IP);
+        }
+        release_buffer(a->queue[i]);
+        a->queue[i] = NULL;
+    }
+}
+
+// ------------------------------------------------
+// Function:        cache_free()
+// ------------------------------------------------
+// Input:           Entry index
+// Output:          -
+// ------------------------------------------------
+// Description:     Removes an entry from the hash
+//                  table and its list, dropping
+//                  its waiting packets
+// ------------------------------------------------
+static void cache_free(ARP_INDEX i)
+{
+    ARP_CACHE_ENTRY *a;
+    ARP_INDEX *p;
+
+    a = &arp_cache[i];
+
+    // --------------------------
+    // remove from the hash chain
+    // --------------------------
+    p = &arp_hash[ARP_HASH(&a->ip_address)];
+    while(*p != i) p = &arp_cache[*p].hash;
+    *p = a->hash;
+
+    list_remove((a->state == ARP_RESOLVED)? &arp_lru: &arp_pending, i);
+    cache_flush(a, FALSE);
+    a->state = ARP_FREE;
+    list_insert(&arp_free, i);
+}
+
+// ------------------------------------------------
+// Function:        cache_new()
+// ------------------------------------------------
+// Input:           IP address
+// Output:          Cache entry index
+// ------------------------------------------------
+// Description:     Allocates an entry for a new
+//                  pending IP, evicting the least
+//                  recently used one if the cache
+//                  is full
+// ------------------------------------------------
+static ARP_INDEX cache_new(IPV4 *ip)
+{
+    ARP_CACHE_ENTRY *a;
+    ARP_INDEX i;
+    BYTE h;
+
+    if(arp_free.head == ARP_NONE) {
+        if(arp_lru.tail != ARP_NONE) cache_free(arp_lru.tail);
+        else cache_free(arp_pending.tail);          // only pending entries, drop the oldest
+    }
+
+    i = arp_free.head;
+    list_remove(&arp_free, i);
+
+    a = &arp_cache[i];
+    a->ip_address.d = ip->d;
+    a->state = ARP_INCOMPLETE;
+    a->confirmed = FALSE;
+    a->retry = 0;
+    a->time = arp_clock;
+    list_insert(&arp_pending, i);
+
+    h = ARP_HASH(ip);
+    a->hash = arp_hash[h];
+    arp_hash[h] = i;
+    return i;
+}
+
+// ------------------------------------------------
+// Function:        arp_request()
+// ------------------------------------------------
+// Input:           IP to find
+// Output:          -
+// ------------------------------------------------
+// Description:     Broadcasts an ARP request
+// ------------------------------------------------
+static void arp_request(IPV4 *ip)
+{
+    PPBUF buf;
+
+    buf = quota_buffer(sizeof(ARP_HDR), INTERFACE_ETH, QUOTA_CONTROL);
+    if(buf == NULL) return;
+    STAT_INC(arp.out_requests);
+
+    ARP(BUF_DATA(buf))->opcode = ARP_REQUEST;
+    ARP(BUF_DATA(buf))->hardware = 0x0100;
+    ARP(BUF_DATA(buf))->protocol = 0x0008;
+    ARP(BUF_DATA(buf))->hw_size = 6;
+    ARP(BUF_DATA(buf))->pr_size = 4;
+    os_copy((BYTE *)&mac_local,
+            (BYTE *)&ARP(BUF_DATA(buf))->orig_hw_address,
+            sizeof(MACADDR));
+    os_set((BYTE *)&ARP(BUF_DATA(buf))->dest_hw_address,
+            0xff, sizeof(MACADDR));
+    ARP(BUF_DATA(buf))->orig_ip_address.d = ip_local[INTERFACE_ETH].d;
+    ARP(BUF_DATA(buf))->dest_ip_address.d = ip->d;
+    buf->size = sizeof(ARP_HDR);
+
+    eth_send(buf, ETH_PROT_ARP);
+    release_buffer(buf);
+}
+
+
+// ------------------------------------------------
+// Function:        arp_resolve()
+// ------------------------------------------------
+// Input:           IP to find
+// Output:          Cache entry
+// ------------------------------------------------
+// Description:     Returns the entry of an IP,
+//                  starting its resolution if it
+//                  is not known yet. Resolved
+//                  entries are moved to the head
+//                  of the LRU list and refreshed
+//                  before they expire
+// ------------------------------------------------
+static ARP_CACHE_ENTRY *arp_resolve(IPV4 *ip)
+{
+    ARP_CACHE_ENTRY *a;
+    ARP_INDEX i;
+
+    i = cache_find(ip);
+    if(i == ARP_NONE) {
+        // ------------------------------
+        // unknown address, send a request
+        // ------------------------------
+        i = cache_new(ip);
+        a = &arp_cache[i];
+        a->retry = 1;
+        a->time = arp_clock + RETRY_ARP;
+        arp_request(ip);
+        return a;
+    }
+
+    a = &arp_cache[i];
+    if(a->state != ARP_RESOLVED) return a;          // request already sent
+
+    if(EXPIRED(a->time)) {
+        // -------------------------------------
+        // entry expired, resolve it from scratch
+        // -------------------------------------
+        list_remove(&arp_lru, i);
+        list_insert(&arp_pending, i);
+        a->state = ARP_INCOMPLETE;
+        a->retry = 1;
+        a->time = arp_clock + RETRY_ARP;
+        arp_request(ip);
+        return a;
+    }
+
+    // ----------------------------
+    // hot entry, most recently used
+    // ----------------------------
+    if(arp_lru.head != i) {
+        list_remove(&arp_lru, i);
+        list_insert(&arp_lru, i);
+    }
+
+    // ---------------------------------------------
+    // close to expiry: refresh it in the background
+    // while it is still used
+    // ---------------------------------------------
+    if((a->retry < MAX_RETRIES_ARP) &&
+       ((UInt16)(a->time - arp_clock) < (REFRESH_ARP >> a->retry))) {
+        a->retry++;
+        arp_request(ip);
+    }
+    return a;
+}
+
+// ------------------------------------------------
+// Function:        arp_next_hop()
+// ------------------------------------------------
+// Input:           Destination IP
+//                  Next hop to fill in
+// Output:          -
+// ------------------------------------------------
+// Description:     Address to be resolved for a
+//                  destination: itself if on-link,
+//                  its gateway otherwise
+// ------------------------------------------------
+static void arp_next_hop(IPV4 *ip, IPV4 *hop)
+{
+    BYTE i;
+
+    i = INTERFACE_ETH;
+    if(!route_lookup(ip, &i, hop)) hop->d = ip->d;
+}
 
 // ------------------------------------------------
 // Function:        arp_get_mac()
@@ -60,70 +370,109 @@ ARP_CACHE_ENTRY arp_cache[MAX_CACHE_ARP];
 //                  MAC to fill in
 // Output:          TRUE if succesful
 // ------------------------------------------------
-// Description:     Find the mac address for a
-//                  given IP
+// Description:     Find the mac address frames
+//                  for a given IP are sent to (its
+//                  own or its gateway). Never
+//                  blocks: unknown addresses are
+//                  requested and FALSE is returned
 // ------------------------------------------------
 BOOL arp_get_mac(IPV4 *ip, MACADDR *mac)
 {
-    BYTE i;
-    PPBUF buf;
+    ARP_CACHE_ENTRY *a;
+    IPV4 hop;
 
     if(ip->d == 0xffffffff) {                               // broadcast IP address
         os_set((BYTE *)mac, 0xff, sizeof(MACADDR));         // broadcast MAC address
         return TRUE;
     }
 
-    // --------------------------
-    // search for IP in the cache
-    // --------------------------
-    for(i=0; i<MAX_CACHE_ARP; i++) {
-        if(arp_cache[i].ip_address.d == ip->d) {
-            os_copy((BYTE *)&arp_cache[i].mac_address,
-                    (BYTE *)mac,
-                    sizeof(MACADDR));
-            return TRUE;
-        }
+    arp_next_hop(ip, &hop);
+    a = arp_resolve(&hop);
+    if(a->state != ARP_RESOLVED) return FALSE;
+
+    os_copy((BYTE *)&a->mac_address,
+            (BYTE *)mac,
+            sizeof(MACADDR));
+    return TRUE;
+}	
+
+// ------------------------------------------------
+// Function:        arp_send()
+// ------------------------------------------------
+// Input:           IP message buffer
+// Output:          -
+// ------------------------------------------------
+// Description:     Sends an IP message through
+//                  ethernet, queueing it while the
+//                  destination is being resolved
+// ------------------------------------------------
+void arp_send(PPBUF pbuf)
+{
+    ARP_CACHE_ENTRY *a;
+    IPV4 hop;
+    BYTE i;
+
+    if(IPH(BUF_START(pbuf))->dest.d == 0xffffffff) {
+        eth_send(pbuf, ETH_PROT_IP);                        // broadcast, no resolution
+        return;
     }
 
-    // ----------------------------
-    // IP not found, send a request
-    // ----------------------------
-    buf = get_buffer(sizeof(ARP_HDR));
-    if(buf != NULL) {
-        ARP(buf->data)->opcode = ARP_REQUEST;
-        ARP(buf->data)->hardware = 0x0100;
-        ARP(buf->data)->protocol = 0x0008;
-        ARP(buf->data)->hw_size = 6;
-        ARP(buf->data)->pr_size = 4;
-        os_copy((BYTE *)&mac_local,
-                (BYTE *)&ARP(buf->data)->orig_hw_address,
-                sizeof(MACADDR));
-        os_set((BYTE *)&ARP(buf->data)->dest_hw_address,
-                0xff, sizeof(MACADDR));
-        ARP(buf->data)->orig_ip_address.d = ip_local[INTERFACE_ETH].d;
-        ARP(buf->data)->dest_ip_address.d = ip->d;
-        buf->size = sizeof(ARP_HDR);
-
-        eth_send(buf, ETH_PROT_ARP);
-        release_buffer(buf);
-
-        // -----------------------------------------------
-        // waits for an answer, then check the cache again
-        // -----------------------------------------------
-        os_set_timeout(TIMEOUT_ARP);
-        if(os_wait(SIG_ARP)) {
-            for(i=0; i<MAX_CACHE_ARP; i++) {
-                if(arp_cache[i].ip_address.d == ip->d) {
-                    os_copy((BYTE *)&arp_cache[i].mac_address,
-                            (BYTE *)mac, sizeof(MACADDR));
-                    return TRUE;
-                }
-            }
+    arp_next_hop(&IPH(BUF_START(pbuf))->dest, &hop);
+    a = arp_resolve(&hop);
+    if(a->state == ARP_RESOLVED) {
+        eth_send(pbuf, ETH_PROT_IP);
+        return;
+    }
+
+    // ---------------------------------------------
+    // keep a view of the message until the reply;
+    // it shares the sender's storage, which must
+    // not be written until the view is released
+    // ---------------------------------------------
+    for(i=0; i<ARP_QUEUE; i++) {
+        if(a->queue[i] == NULL) {
+            a->queue[i] = clone_buffer(pbuf);
+            if(a->queue[i] == NULL) STAT_INC(arp.queue_drops);
+            return;
         }
     }
 
-    return FALSE;                                           // failed
-}	
+    // --------------------------
+    // queue full, message dropped
+    // --------------------------
+    STAT_INC(arp.queue_drops);
+}
+
+// ------------------------------------------------
+// Function:        cache_set()
+// ------------------------------------------------
+// Input:           Entry index
+//                  MAC address
+//                  TRUE if confirmed
+// Output:          -
+// ------------------------------------------------
+// Description:     Updates cache information and
+//                  sends the packets waiting for
+//                  the address
+// ------------------------------------------------
+static void cache_set(ARP_INDEX i, MACADDR *mac, BOOL confirmed)
+{
+    ARP_CACHE_ENTRY *a;
+
+    a = &arp_cache[i];
+    os_copy((BYTE *)mac,
+            (BYTE *)&a->mac_address,
+            sizeof(MACADDR));
+    if(a->state != ARP_RESOLVED) {
+        list_remove(&arp_pending, i);
+        list_insert(&arp_lru, i);
+        a->state = ARP_RESOLVED;
+    }
+    a->confirmed = confirmed;
+    a->retry = 0;
+    a->time = arp_clock + LIFE_ARP;
+    cache_flush(a, TRUE);
+}
 
 // ------------------------------------------------
 // Function:        cache_add()
@@ -131,46 +480,104 @@ BOOL arp_get_mac(IPV4 *ip, MACADDR *mac)
 // Input:           IP address, MAC address pair
 // Output:          -
 // ------------------------------------------------
-// Description:     Updates cache information
+// Description:     Stores a confirmed address pair
 // ------------------------------------------------
 void cache_add(IPV4 *ip, MACADDR *mac)
 {
-    BYTE i, n, m;
+    ARP_INDEX i;
 
-    // ----------------------
-    // search for IP in cache
-    // ----------------------
-    for(i=0; i<MAX_CACHE_ARP; i++) {
-        if(arp_cache[i].ip_address.d == ip->d)
-            break;
+    i = cache_find(ip);
+    if(i == ARP_NONE) i = cache_new(ip);
+    cache_set(i, mac, TRUE);
+}	
+
+// ------------------------------------------------
+// Function:        arp_snoop()
+// ------------------------------------------------
+// Input:           IP address, MAC address pair
+// Output:          -
+// ------------------------------------------------
+// Description:     Learns an address pair seen in
+//                  received traffic (requests for
+//                  any address, unsolicited replies,
+//                  source of IP frames). Ethernet
+//                  drivers call it for every IP
+//                  frame accepted, with the IP
+//                  source and ethernet source
+//                  addresses, holding
+//                  HERMES_LOCK(). Depending on
+//                  ARP_SNOOP, confirmed entries are
+//                  never replaced nor evicted
+// ------------------------------------------------
+void arp_snoop(IPV4 *ip, MACADDR *mac)
+{
+#if ARP_SNOOP
+    ARP_CACHE_ENTRY *a;
+    ARP_INDEX i;
+    BYTE j;
+
+    // -----------------------------------
+    // only unicast neighbors on the subnet
+    // -----------------------------------
+    if(ip->d == 0) return;
+    if(ip->d == 0xffffffff) return;
+    if(ip->d == ip_local[INTERFACE_ETH].d) return;
+    if((ip->d ^ ip_local[INTERFACE_ETH].d) & ip_mask[INTERFACE_ETH].d) return;
+    if(mac->b[0] & 0x01) return;                            // multicast MAC
+
+    i = cache_find(ip);
+    if(i == ARP_NONE) {
+        // -------------------------------------------
+        // new neighbor: take a free entry or evict an
+        // unconfirmed one, never a confirmed entry
+        // -------------------------------------------
+        if(arp_free.head == ARP_NONE) {
+            if(arp_lru.tail == ARP_NONE) return;
+#if ARP_SNOOP < ARP_SNOOP_TRUST
+            if(arp_cache[arp_lru.tail].confirmed) return;
+#endif
+        }
+        i = cache_new(ip);
+        cache_set(i, mac, FALSE);
+        return;
     }
 
-    if(i >= MAX_CACHE_ARP) {
-        // ------------------------------
-        // new IP, find an empty position
-        // ------------------------------
-        m = 0xff;
-        n = 0;
-        for(i=0; i<MAX_CACHE_ARP; i++) {
-            if(arp_cache[i].time <= m) {
-                m = arp_cache[i].time;
-                n = i;
-            }
-            if(m == 0) break;
+    a = &arp_cache[i];
+    if((a->state == ARP_RESOLVED) && a->confirmed) {
+        for(j=0; j<sizeof(MACADDR); j++)
+            if(mac->b[j] != a->mac_address.b[j]) break;
+        if(j == sizeof(MACADDR)) {
+            a->time = arp_clock + LIFE_ARP;                 // same address, still alive
+            a->retry = 0;
+            return;
         }
+#if ARP_SNOOP < ARP_SNOOP_TRUST
+        return;                                             // possible spoofing, keep it
+#endif
     }
-	
-    if(i >= MAX_CACHE_ARP)
-        i = n;                                              // cache full, overwrite the oldest entry
-
-    // ------------
-    // update entry
-    // ------------
-    arp_cache[i].ip_address.d = ip->d;
-    os_copy((BYTE *)mac,
-            (BYTE *)&arp_cache[i].mac_address,
-            sizeof(MACADDR));
-}	
+    cache_set(i, mac, (a->state == ARP_RESOLVED) && a->confirmed);
+#endif
+}
+
+// ------------------------------------------------
+// Function:        arp_solicited()
+// ------------------------------------------------
+// Input:           IP address
+// Output:          TRUE if we are resolving it
+// ------------------------------------------------
+// Description:     Checks if a reply answers one
+//                  of our requests
+// ------------------------------------------------
+static BOOL arp_solicited(IPV4 *ip)
+{
+    ARP_INDEX i;
+
+    i = cache_find(ip);
+    if(i == ARP_NONE) return FALSE;
+    if(arp_cache[i].state == ARP_INCOMPLETE) return TRUE;
+    if(arp_cache[i].retry) return TRUE;                     // refresh request sent
+    return FALSE;
+}
 
 // ------------------------------------------------
 // Function:        arp_parse()
@@ -182,67 +589,129 @@ void cache_add(IPV4 *ip, MACADDR *mac)
 // ------------------------------------------------
 void arp_parse(PPBUF pbuf)
 {
-    switch(ARP(pbuf->data)->opcode) {
+    switch(ARP(BUF_DATA(pbuf))->opcode) {
         case ARP_REQUEST:
-            if(ARP(pbuf->data)->dest_ip_address.d == ip_local[INTERFACE_ETH].d) {
-                // -----------------------
-                // query for local address
-                // -----------------------
-                cache_add(&ARP(pbuf->data)->orig_ip_address,
-                          &ARP(pbuf->data)->orig_hw_address);
+            STAT_INC(arp.in_requests);
+            if(ARP(BUF_DATA(pbuf))->dest_ip_address.d == ip_local[INTERFACE_ETH].d) {
+                // ------------------------------------------
+                // query for local address: the sender is not
+                // confirmed by it, so it is only snooped
+                // ------------------------------------------
+                arp_snoop(&ARP(BUF_DATA(pbuf))->orig_ip_address,
+                          &ARP(BUF_DATA(pbuf))->orig_hw_address);
 
                 retain_buffer(pbuf);
-                ARP(pbuf->data)->opcode = ARP_REPLY;
-                os_copy((BYTE *)&ARP(pbuf->data)->orig_hw_address,
-                        (BYTE *)&ARP(pbuf->data)->dest_hw_address,
+                ARP(BUF_DATA(pbuf))->opcode = ARP_REPLY;
+                os_copy((BYTE *)&ARP(BUF_DATA(pbuf))->orig_hw_address,
+                        (BYTE *)&ARP(BUF_DATA(pbuf))->dest_hw_address,
                         sizeof(MACADDR));
-                ARP(pbuf->data)->dest_ip_address.d = ARP(pbuf->data)->orig_ip_address.d;
+                ARP(BUF_DATA(pbuf))->dest_ip_address.d = ARP(BUF_DATA(pbuf))->orig_ip_address.d;
 
                 os_copy((BYTE *)&mac_local,
-                        (BYTE *)&ARP(pbuf->data)->orig_hw_address,
+                        (BYTE *)&ARP(BUF_DATA(pbuf))->orig_hw_address,
                         sizeof(MACADDR));
-                ARP(pbuf->data)->orig_ip_address.d = ip_local[INTERFACE_ETH].d;
+                ARP(BUF_DATA(pbuf))->orig_ip_address.d = ip_local[INTERFACE_ETH].d;
 
                 eth_send(pbuf, ETH_PROT_ARP);
                 release_buffer(pbuf);
+                STAT_INC(arp.out_replies);
+            } else {
+                // ------------------------------------------
+                // query for another host or gratuitous ARP
+                // ------------------------------------------
+                arp_snoop(&ARP(BUF_DATA(pbuf))->orig_ip_address,
+                          &ARP(BUF_DATA(pbuf))->orig_hw_address);
             }
             break;
 
         case ARP_REPLY:
-            cache_add(&ARP(pbuf->data)->orig_ip_address,
-                      &ARP(pbuf->data)->orig_hw_address);
-            os_signal(SIG_ARP);
+            STAT_INC(arp.in_replies);
+            if(arp_solicited(&ARP(BUF_DATA(pbuf))->orig_ip_address)) {
+                cache_add(&ARP(BUF_DATA(pbuf))->orig_ip_address,
+                          &ARP(BUF_DATA(pbuf))->orig_hw_address);
+            } else {
+                // ----------------------------------
+                // unsolicited (or gratuitous) reply
+                // ----------------------------------
+                arp_snoop(&ARP(BUF_DATA(pbuf))->orig_ip_address,
+                          &ARP(BUF_DATA(pbuf))->orig_hw_address);
+            }
             break;
     }
 }
 
+
 // ------------------------------------------------
-// Function:        arp_tick()
+// Function:        arp_retry()
 // ------------------------------------------------
 // Input:           -
 // Output:          -
 // ------------------------------------------------
-// Description:     Callback timming function
-//                  Updates the cache timming info
+// Description:     Called by the hermes thread:
+//                  repeats unanswered requests with
+//                  exponential backoff, giving up
+//                  (and dropping the waiting
+//                  packets) after MAX_RETRIES_ARP.
+//                  Drops the resolved entries past
+//                  their life time, so no one stays
+//                  unchecked until the clock wraps
 // ------------------------------------------------
-void arp_tick(void)
+void arp_retry(void)
 {
     ARP_CACHE_ENTRY *a;
-    BYTE i;
+    ARP_INDEX i, n;
 
-    a = arp_cache;
-    for(i=0; i<MAX_CACHE_ARP; i++) {
-        if(a->time) {
-            a->time--;
-            if(a->time == 0) {
-                // -------------
-                // entry timeout
-                // -------------
-                os_set((BYTE *)a, 0xff, sizeof(ARP_CACHE_ENTRY));
-                a->time = 0;
-            }
+    if(arp_sweep) {
+        arp_sweep = FALSE;
+        for(i=arp_lru.head; i!=ARP_NONE; i=n) {
+            n = arp_cache[i].next;
+            if(EXPIRED(arp_cache[i].time)) cache_free(i);
+        }
+    }
+
+    if(!arp_due) return;
+    arp_due = FALSE;
+
+    for(i=arp_pending.head; i!=ARP_NONE; i=n) {
+        a = &arp_cache[i];
+        n = a->next;
+        if(!EXPIRED(a->time)) continue;
+
+        if(a->retry >= MAX_RETRIES_ARP) {
+            STAT_INC(arp.resolve_fails);
+            cache_free(i);                                  // resolution failed
+            continue;
         }
-        a++;
+
+        a->time = arp_clock + (RETRY_ARP << a->retry);      // backoff
+        a->retry++;
+        arp_request(&a->ip_address);
+    }
+}
+
+// ------------------------------------------------
+// Function:        arp_tick()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Callback timming function
+//                  Advances the cache clock and
+//                  schedules request retries;
+//                  resolved entries expire when
+//                  they are looked up, and are
+//                  aged every SWEEP_ARP ticks
+// ------------------------------------------------
+void arp_tick(void)
+{
+    arp_clock++;
+    if(((arp_clock % SWEEP_ARP) == 0) && (arp_lru.head != ARP_NONE)) {
+        arp_sweep = TRUE;
+        os_signal(SIG_MESSAGE);                             // aged from hermes thread
+    }
+    if(arp_pending.head != ARP_NONE) {
+        arp_due = TRUE;
+        os_signal(SIG_MESSAGE);                             // retry from hermes thread
     }
 
     os_set_timer(TMR_ARP, TICK_ARP, CB_ARP);
@@ -258,12 +727,20 @@ void arp_tick(void)
 // ------------------------------------------------
 void arp_init(void)
 {
-    BYTE i;
+    ARP_INDEX i;
 
-    for(i=0; i<MAX_CACHE_ARP; i++) {
-        os_set((BYTE *)&arp_cache[i], 0xff, sizeof(ARP_CACHE_ENTRY));
-        arp_cache[i].time = 0;
-    }
+    os_set((BYTE *)arp_cache, 0, sizeof(arp_cache));
+    os_set((BYTE *)arp_hash, 0xff, sizeof(arp_hash));
+    arp_free.head = ARP_NONE;
+    arp_free.tail = ARP_NONE;
+    arp_pending = arp_free;
+    arp_lru = arp_free;
+    for(i=0; i<MAX_CACHE_ARP; i++)
+        list_insert(&arp_free, i);
+
+    arp_clock = 0;
+    arp_due = FALSE;
+    arp_sweep = FALSE;
 
     os_set_callback(CB_ARP, arp_tick);
     os_set_timer(TMR_ARP, TICK_ARP, CB_ARP);
@@ -1,5 +1,55 @@
+// -------------
+// entry indexes
+// -------------
+#if MAX_CACHE_ARP < 255
+typedef BYTE ARP_INDEX;
+#define ARP_NONE                        0xff
+#else
+typedef UInt16 ARP_INDEX;
+#define ARP_NONE                        0xffff
+#endif
+
+// ---------------------------------------------
+// ARP cache: entries are indexed by a hash of
+// the IP and kept in one of three lists: free,
+// pending (incomplete) or resolved, the later
+// ordered from the most to the least recently
+// used
+// ---------------------------------------------
+typedef struct {
+    IPV4 ip_address;
+    MACADDR mac_address;
+    BYTE state;
+    BYTE confirmed;                             // TRUE if learnt from our own resolution
+    BYTE retry;                                 // requests already sent
+    UInt16 time;                                // expiry (resolved) or next request (pending)
+    ARP_INDEX hash;                             // next entry in the hash bucket
+    ARP_INDEX prev;                             // list links
+    ARP_INDEX next;
+    PPBUF queue[ARP_QUEUE];                     // packets waiting for resolution
+} ARP_CACHE_ENTRY;
+
+typedef struct {
+    ARP_INDEX head;
+    ARP_INDEX tail;
+} ARP_LIST;
+
+typedef struct {
+    ARP_CACHE_ENTRY cache[MAX_CACHE_ARP];
+    ARP_INDEX hash[ARP_HASH_SIZE];
+    ARP_LIST list_free;
+    ARP_LIST list_pending;
+    ARP_LIST list_lru;
+    volatile UInt16 clock;                      // time base (TICK_ARP units)
+    volatile BOOL due;                          // retries pending
+    volatile BOOL sweep;                        // resolved entries to age
+} ARP_STATE;
+
 BOOL arp_get_mac(IPV4 *ip, MACADDR *mac);
-void insere_mac(IPV4 *ip, MACADDR *mac);
-void trata_mens_arp(PPBUF pbuf);
+void arp_send(PPBUF pbuf);
+void arp_snoop(IPV4 *ip, MACADDR *mac);
+void arp_retry(void);
+void cache_add(IPV4 *ip, MACADDR *mac);
+void arp_parse(PPBUF pbuf);
 void arp_tick(void);
-void arp_inicia(void);
+void arp_init(void);
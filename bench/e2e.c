@@ -0,0 +1,568 @@
+// -------------------------------------------------------
+// File:            E2E.C
+// Project:         Hermes
+// Description:     End to end benchmarks: two stacks on a
+//                  virtual wire, TCP bulk transfer,
+//                  request/response latency, connection
+//                  setup and UDP packet rate (hosted build)
+// Author:          Bruno Abrantes Basseto
+//                  bruno.basseto@uol.com.br
+// Target CPU:      x86 / ARM hosts
+// Compiler:        GCC
+// -------------------------------------------------------
+// Usage:           e2e [-f json|csv] [-s name] [-n count]
+//                      [-z size] [-l ms] [-j ms] [-w bps]
+//                      [-p ppm] [-r pps] [-v]
+// -------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "defs.h"
+#include "net.h"
+#include "cronos.h"
+#include "hermes.h"
+#include "wire.h"
+
+#define THRD_SERVER                     10
+#define TCP_PORT_BULK                   5001
+#define TCP_PORT_RR                     5002
+#define TCP_PORT_CONNECT                5003
+#define UDP_PORT_RATE                   5004
+#define SOCKET_BENCH                    0
+#define SOCKET_CONNECT                  1
+
+typedef struct {
+    UInt32 ops;                                 // completed operations
+    UInt32 failed;
+    unsigned long long bytes;                   // application payload
+    unsigned long long wall;                    // ns
+    UInt32 stack;                               // executive clock (ms)
+    unsigned long long offer_wall;              // ns spent offering ops + failed, 0 if all of wall
+    UInt32 offer_stack;                         // the same on the executive clock (ms)
+    UInt32 *lat;                                // per operation latency (ns)
+    UInt32 samples;
+} RESULT;
+
+typedef struct {
+    char *name;
+    char *unit;                                 // what one operation is
+    void (*server)(void);
+    void (*client)(RESULT *r);
+} SCENARIO;
+
+static HERMES_STACK client_stack, server_stack;
+static WIRE wire;
+static IPV4 server_ip;
+static BYTE payload[1500];
+static UInt32 count;                            // operations per scenario
+static UInt16 size;                             // request and datagram size
+static UInt32 rate;                             // offered UDP load (pps), 0 one datagram in flight
+static UInt32 patience;                         // ms before a datagram in flight is lost
+static volatile UInt32 served;                  // server side progress
+static volatile BOOL server_done;
+static volatile BOOL server_ready;              // about to listen
+static BOOL virtual_clock;
+
+// ------------------------------------------------
+// Function:        now_ns()
+// ------------------------------------------------
+// Input:           -
+// Output:          Monotonic time (ns)
+// ------------------------------------------------
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// ------------------------------------------------
+// Function:        sample_ns()
+// ------------------------------------------------
+// Input:           -
+// Output:          Time of latency samples (ns)
+// ------------------------------------------------
+// Description:     The executive clock when it is
+//                  virtual, as the link delays only
+//                  exist there (1 ms resolution)
+// ------------------------------------------------
+static unsigned long long sample_ns(void)
+{
+    if(virtual_clock) return (unsigned long long)os_clock() * 1000000ULL;
+    return now_ns();
+}
+
+// ------------------------------------------------
+// Function:        tcp_wait_read()
+// ------------------------------------------------
+// Input:           Socket ID
+// Output:          Received segment or NULL once
+//                  the connection is gone
+// ------------------------------------------------
+// Description:     tcp_read() also returns on
+//                  signals left by the handshake,
+//                  so it is retried while the
+//                  connection stands
+// ------------------------------------------------
+static PPBUF tcp_wait_read(BYTE n)
+{
+    PPBUF p;
+
+    while(tcp_is_open(n) && os_not_terminated()) {
+        p = tcp_read(n);
+        if(p != NULL) return p;
+    }
+    return NULL;
+}
+
+// ------------------------------------------------
+// Function:        tcp_write()
+// ------------------------------------------------
+// Input:           Socket ID, data, size
+// Output:          TRUE if acknowledged
+// ------------------------------------------------
+// Description:     Sends a block, one segment at a
+//                  time as the stack does
+// ------------------------------------------------
+static BOOL tcp_write(BYTE n, BYTE *p, UInt16 size)
+{
+    PPBUF b;
+    UInt16 k;
+    BOOL res;
+
+    while(size) {
+        b = tcp_new(n);
+        if(b == NULL) return FALSE;
+        k = tcp_mss(n);
+        if(k > size) k = size;
+        write_buf(b, p, k);
+        res = tcp_send(n, b);
+        release_buffer(b);
+        if(!res) return FALSE;
+        p += k;
+        size -= k;
+    }
+    return TRUE;
+}
+
+// ---------------------------------------------------
+// Servers, running on a thread of the server stack
+// ---------------------------------------------------
+
+static void server_sink(void)
+{
+    PPBUF p;
+
+    if(tcp_listen(SOCKET_BENCH, TCP_PORT_BULK)) {
+        while((p = tcp_wait_read(SOCKET_BENCH)) != NULL) {
+            served += buffer_size(p);
+            release_buffer(p);
+        }
+    }
+    server_done = TRUE;
+}
+
+static void server_echo(void)
+{
+    PPBUF p;
+    UInt16 n;
+
+    if(tcp_listen(SOCKET_BENCH, TCP_PORT_RR)) {
+        while((p = tcp_wait_read(SOCKET_BENCH)) != NULL) {
+            n = buffer_size(p);
+            release_buffer(p);
+            if(!tcp_write(SOCKET_BENCH, payload, n)) break;
+            served++;
+        }
+    }
+    server_done = TRUE;
+}
+
+static void server_accept(void)
+{
+    PPBUF p;
+
+    while(os_not_terminated() && (served < count)) {
+        // --------------------------------------------
+        // the flag is seen before any SYN is parsed, as
+        // this thread keeps the processor until it
+        // waits in tcp_listen()
+        // --------------------------------------------
+        server_ready = TRUE;
+        if(!tcp_listen(SOCKET_CONNECT, TCP_PORT_CONNECT)) continue;
+        server_ready = FALSE;
+        served++;
+        while((p = tcp_wait_read(SOCKET_CONNECT)) != NULL) {   // until the client closes
+            release_buffer(p);
+            tcp_write(SOCKET_CONNECT, payload, 1);
+        }
+    }
+    server_done = TRUE;
+}
+
+static void server_count(void)
+{
+    PPBUF p;
+
+    // ---------------------------------------------
+    // the socket holds a single datagram: it is
+    // emptied on every wake up, what comes while it
+    // is full is dropped by the stack
+    // ---------------------------------------------
+    while(os_not_terminated() && !server_done) {
+        os_set_timeout(100);
+        if(!udp_listen(SOCKET_BENCH, UDP_PORT_RATE)) continue;
+        while((p = udp_read(SOCKET_BENCH)) != NULL) {
+            served++;
+            release_buffer(p);
+        }
+    }
+    udp_close(SOCKET_BENCH);
+}
+
+// ---------------------------------------------------
+// Clients, running on the main thread, client stack
+// ---------------------------------------------------
+
+static void client_bulk(RESULT *r)
+{
+    BYTE n;
+
+    if(!tcp_open(SOCKET_BENCH, tcp_get_port(), server_ip, TCP_PORT_BULK, INTERFACE_ETH)) {
+        r->failed = count;
+        return;
+    }
+    n = tcp_mss(SOCKET_BENCH);
+    for(r->ops=0; r->ops<count; r->ops++) {
+        if(!tcp_write(SOCKET_BENCH, payload, n)) break;
+        r->bytes += n;
+    }
+    r->failed = count - r->ops;
+    tcp_close(SOCKET_BENCH);
+}
+
+static void client_rr(RESULT *r)
+{
+    unsigned long long t;
+    PPBUF p;
+
+    if(!tcp_open(SOCKET_BENCH, tcp_get_port(), server_ip, TCP_PORT_RR, INTERFACE_ETH)) {
+        r->failed = count;
+        return;
+    }
+    for(r->ops=0; r->ops<count; r->ops++) {
+        t = sample_ns();
+        if(!tcp_write(SOCKET_BENCH, payload, size)) break;
+        p = tcp_wait_read(SOCKET_BENCH);
+        if(p == NULL) break;
+        release_buffer(p);
+        r->lat[r->samples++] = (UInt32)(sample_ns() - t);
+        r->bytes += 2 * size;
+    }
+    r->failed = count - r->ops;
+    tcp_close(SOCKET_BENCH);
+}
+
+static void client_connect(RESULT *r)
+{
+    unsigned long long t;
+    PPBUF p;
+    UInt32 i;
+
+    for(i=0; i<count; i++) {
+        while(!server_ready) os_sleep(0);
+        t = sample_ns();
+        if(!tcp_open(SOCKET_CONNECT, tcp_get_port(), server_ip, TCP_PORT_CONNECT, INTERFACE_ETH)) {
+            r->failed++;
+            continue;
+        }
+        r->lat[r->samples++] = (UInt32)(sample_ns() - t);
+
+        // ------------------------------------------
+        // one byte each way before closing, so the
+        // server has left tcp_listen() when the FIN
+        // comes
+        // ------------------------------------------
+        p = NULL;
+        if(tcp_write(SOCKET_CONNECT, payload, 1)) p = tcp_wait_read(SOCKET_CONNECT);
+        if(p != NULL) {
+            release_buffer(p);
+            r->bytes += 2;
+            r->ops++;
+        } else r->failed++;
+        tcp_close(SOCKET_CONNECT);
+    }
+}
+
+// ------------------------------------------------
+// Function:        udp_wait()
+// ------------------------------------------------
+// Input:           Datagrams sent, lost so far
+// Output:          Datagrams lost
+// ------------------------------------------------
+// Description:     Waits for the server to read
+//                  every datagram sent, the one in
+//                  flight is given up for lost
+//                  after patience
+// ------------------------------------------------
+static UInt32 udp_wait(UInt32 sent, UInt32 lost)
+{
+    UInt32 since;
+
+    since = os_clock();
+    while((served + lost < sent) && ((os_clock() - since) < patience))
+        os_sleep(virtual_clock? 1: 0);                          // a virtual clock moves once all wait
+    if(served + lost < sent) lost++;
+    return lost;
+}
+
+static void client_udp(RESULT *r)
+{
+    unsigned long long t;
+    PPBUF p;
+    UInt32 last, start, lost;
+
+    udp_open(SOCKET_BENCH, udp_get_port(), server_ip, UDP_PORT_RATE, INTERFACE_ETH);
+    t = now_ns();
+    start = os_clock();
+    lost = 0;
+    for(r->ops=0; r->ops<count; ) {
+        if(rate) {
+            // --------------------------------
+            // open loop: paced at the offered
+            // rate, whatever the server takes
+            // --------------------------------
+            while((os_clock() - start) < (UInt32)((unsigned long long)r->ops * 1000 / rate))
+                os_sleep(1);
+        } else {
+            // ---------------------------------------
+            // closed loop: the server socket holds one
+            // datagram, so the next one waits for the
+            // previous to be read or given up for lost
+            // ---------------------------------------
+            lost = udp_wait(r->ops, lost);
+        }
+        p = udp_new(SOCKET_BENCH);
+        if(p == NULL) {
+            os_sleep(0);                                        // buffers still queued
+            continue;
+        }
+        write_buf(p, payload, size);
+        udp_send(p);
+        release_buffer(p);
+        r->ops++;
+    }
+    r->offer_wall = now_ns() - t;
+    r->offer_stack = os_clock() - start;
+    udp_close(SOCKET_BENCH);
+
+    // ----------------------------------------
+    // wait for the last datagram, or until the
+    // wire drains when the load was offered;
+    // what did not make it to the server is lost
+    // ----------------------------------------
+    if(!rate) udp_wait(r->ops, lost);
+    else do {
+        last = served;
+        os_sleep(20);
+    } while(served != last);
+    r->bytes = (unsigned long long)served * size;
+    r->failed = r->ops - served;
+    r->ops = served;
+    server_done = TRUE;
+}
+
+static SCENARIO scenarios[] = {
+    {"tcp_bulk",        "seg",  server_sink,    client_bulk},
+    {"tcp_rr",          "rr",   server_echo,    client_rr},
+    {"tcp_connect",     "conn", server_accept,  client_connect},
+    {"udp_rate",        "pkt",  server_count,   client_udp},
+};
+
+// ------------------------------------------------
+// Function:        compare()
+// ------------------------------------------------
+// Input:           Latency samples
+// Output:          Order
+// ------------------------------------------------
+static int compare(const void *a, const void *b)
+{
+    UInt32 x, y;
+
+    x = *(UInt32 *)a;
+    y = *(UInt32 *)b;
+    return (x > y) - (x < y);
+}
+
+// ------------------------------------------------
+// Function:        percentile()
+// ------------------------------------------------
+// Input:           Sorted result, fraction
+// Output:          Latency (us), 0 if no samples
+// ------------------------------------------------
+static double percentile(RESULT *r, double f)
+{
+    UInt32 i;
+
+    if(r->samples == 0) return 0;
+    i = (UInt32)(f * r->samples);
+    if(i >= r->samples) i = r->samples - 1;
+    return r->lat[i] / 1e3;
+}
+
+// ------------------------------------------------
+// Function:        run()
+// ------------------------------------------------
+// Input:           Scenario, result to fill in
+// Output:          -
+// ------------------------------------------------
+// Description:     Starts the server side on the
+//                  server stack, gives it time to
+//                  listen, then runs the client on
+//                  this thread. A ping first
+//                  resolves the server address, so
+//                  ARP is not timed
+// ------------------------------------------------
+static void run(SCENARIO *s, RESULT *r)
+{
+    unsigned long long t;
+    UInt32 c;
+
+    memset(r, 0, sizeof(RESULT));
+    r->lat = (UInt32 *)malloc(count * sizeof(UInt32));
+    served = 0;
+    server_done = FALSE;
+    server_ready = FALSE;
+
+    hermes_select(&server_stack);
+    os_start(THRD_SERVER, s->server, 0);
+    hermes_select(&client_stack);
+#ifdef _ICMP
+    ping(server_ip, INTERFACE_ETH);
+#endif
+    os_sleep(10);
+
+    c = os_clock();
+    t = now_ns();
+    s->client(r);
+    r->wall = now_ns() - t;
+    r->stack = os_clock() - c;
+
+    while(!server_done) os_sleep(10);
+    qsort(r->lat, r->samples, sizeof(UInt32), compare);
+}
+
+// ------------------------------------------------
+// Function:        setup()
+// ------------------------------------------------
+// Input:           Stack, last address byte, link
+// Output:          -
+// ------------------------------------------------
+static void setup(HERMES_STACK *s, BYTE host, WIRE_LINK *link)
+{
+    hermes_select(s);
+    hermes_init();
+    ip_local[INTERFACE_ETH].d = 0x0000000a | ((UInt32)host << 24);
+    ip_mask[INTERFACE_ETH].d = 0x00ffffff;
+    wire_attach(&wire, link);
+}
+
+int main(int argc, char **argv)
+{
+    WIRE_LINK link;
+    RESULT r;
+    char *format, *only;
+    double secs, stack, offer;
+    int i, first;
+
+    memset(&link, 0, sizeof(link));
+    format = "json";
+    only = NULL;
+    count = 2000;
+    size = 64;
+    virtual_clock = FALSE;
+    for(i=1; i<argc; i++) {
+        if(!strcmp(argv[i], "-f") && (i+1 < argc)) format = argv[++i];
+        else if(!strcmp(argv[i], "-s") && (i+1 < argc)) only = argv[++i];
+        else if(!strcmp(argv[i], "-n") && (i+1 < argc)) count = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-z") && (i+1 < argc)) size = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-l") && (i+1 < argc)) link.latency = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-j") && (i+1 < argc)) link.jitter = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-w") && (i+1 < argc)) link.bandwidth = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-p") && (i+1 < argc)) link.loss = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-r") && (i+1 < argc)) rate = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-v")) virtual_clock = TRUE;
+        else {
+            fprintf(stderr, "usage: %s [-f json|csv] [-s name] [-n count] [-z size] "
+                            "[-l ms] [-j ms] [-w bps] [-p ppm] [-r pps] [-v]\n", argv[0]);
+            return 2;
+        }
+    }
+    if(count < 1) count = 1;
+    if(size < 1) size = 1;
+    if(size > MSS - sizeof(IP_HDR) - sizeof(TCP_HDR)) size = MSS - sizeof(IP_HDR) - sizeof(TCP_HDR);
+    for(i=0; i<sizeof(payload); i++) payload[i] = (BYTE)i;
+    patience = 100 + 2 * (link.latency + link.jitter);
+    if(link.bandwidth) patience += (UInt32)((unsigned long long)(size + 64) * 8 * 1000 / link.bandwidth);
+
+    // ----------------------------------------------
+    // 10.0.0.1 runs the clients on this thread,
+    // 10.0.0.2 the servers; both links shaped alike
+    // ----------------------------------------------
+    os_init(virtual_clock);
+    wire_init(&wire, 1);
+    setup(&server_stack, 2, &link);
+    server_ip = ip_local[INTERFACE_ETH];
+    setup(&client_stack, 1, &link);
+
+    if(!strcmp(format, "csv")) printf("name,unit,ops,failed,wall_ms,stack_ms,ops_per_sec,offered_per_sec,"
+                                      "mbit_per_sec,p50_us,p99_us,p999_us\n");
+    else printf("{\"suite\":\"hermes-e2e\",\"count\":%u,\"size\":%u,\"latency_ms\":%u,\"bandwidth\":%u,"
+                "\"loss_ppm\":%u,\"udp_rate\":%u,\"virtual_clock\":%s,\"results\":[\n", count, size,
+                link.latency, link.bandwidth, link.loss, rate, virtual_clock? "true": "false");
+
+    // -------------------------------------------------
+    // rates and latencies follow the clock that paces
+    // the link: the executive one when virtual (what
+    // the modelled link delivers), the wall one
+    // otherwise (what the host delivers). ops_per_sec
+    // is what was delivered, offered_per_sec what was
+    // tried (ops + failed) while the load was offered
+    // -------------------------------------------------
+    first = 1;
+    for(i=0; i<sizeof(scenarios)/sizeof(SCENARIO); i++) {
+        if(only && !strstr(scenarios[i].name, only)) continue;
+        run(&scenarios[i], &r);
+        secs = r.wall / 1e9;
+        stack = r.stack / 1e3;
+        if(virtual_clock && (stack > 0)) secs = stack;
+        if(secs <= 0) secs = 1e-9;
+        offer = r.offer_wall / 1e9;
+        if(virtual_clock && (r.offer_stack > 0)) offer = r.offer_stack / 1e3;
+        if(offer <= 0) offer = secs;
+        if(!strcmp(format, "csv")) {
+            printf("%s,%s,%u,%u,%.1f,%u,%.0f,%.0f,%.2f,%.1f,%.1f,%.1f\n", scenarios[i].name,
+                   scenarios[i].unit, r.ops, r.failed, r.wall / 1e6, r.stack, r.ops / secs,
+                   (r.ops + r.failed) / offer, r.bytes * 8 / secs / 1e6, percentile(&r, 0.5),
+                   percentile(&r, 0.99), percentile(&r, 0.999));
+        } else {
+            printf("%s  {\"name\":\"%s\",\"unit\":\"%s\",\"ops\":%u,\"failed\":%u,\"wall_ms\":%.1f,"
+                   "\"stack_ms\":%u,\"ops_per_sec\":%.0f,\"offered_per_sec\":%.0f,\"mbit_per_sec\":%.2f,"
+                   "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}", first? "": ",\n", scenarios[i].name,
+                   scenarios[i].unit, r.ops, r.failed, r.wall / 1e6, r.stack, r.ops / secs,
+                   (r.ops + r.failed) / offer, r.bytes * 8 / secs / 1e6, percentile(&r, 0.5),
+                   percentile(&r, 0.99), percentile(&r, 0.999));
+        }
+        fflush(stdout);
+        free(r.lat);
+        first = 0;
+    }
+    if(strcmp(format, "csv")) printf("\n]}\n");
+
+    os_terminate();
+    os_join();
+    return 0;
+}
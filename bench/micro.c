@@ -0,0 +1,708 @@
+// -------------------------------------------------------
+// File:            MICRO.C
+// Project:         Hermes
+// Description:     Microbenchmarks of the buffer,
+//                  checksum, serialization and parse
+//                  paths (hosted build)
+// Author:          Bruno Abrantes Basseto
+//                  bruno.basseto@uol.com.br
+// Target CPU:      x86 / ARM hosts
+// Compiler:        GCC
+// -------------------------------------------------------
+// Usage:           micro [-f json|csv] [-t ms] [-r runs]
+//                        [-b name]
+// -------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "defs.h"
+#include "net.h"
+#include "cronos.h"
+#include "hermes.h"
+#include "checksum.h"
+
+#define LOCAL_IP                        0x0200000a      // 10.0.0.2
+#define PEER_IP                         0x0100000a      // 10.0.0.1
+#define UDP_PORT                        7
+#define TCP_PORT                        80
+#define TCP_ACK                         0x10
+#define ICMP_ECHO                       8
+#define ARP_OP_REQUEST                  0x0100          // network order
+
+typedef struct {
+    char *name;
+    char *unit;                                 // what one operation is
+    UInt32 (*run)(UInt32 n);                    // returns the bytes handled
+} BENCH;
+
+typedef struct {
+    BYTE data[ETH_FRAME_SIZE];
+    UInt16 size;                                // IP datagram or ARP message
+} FRAME;
+
+static HERMES_STACK node;
+static MACADDR peer_mac = {{0x02, 0, 0, 0, 0, 0x01}};
+static FRAME udp_frame[3];                      // 64, 576 and 1500 byte datagrams
+static FRAME tcp_frame;
+static FRAME icmp_frame;
+static FRAME arp_frame;
+static FRAME imix[12];                          // 7:4:1 mix of the UDP sizes
+static BYTE payload[1500];
+static PPBUF chain;
+static volatile UInt32 sink;
+static UInt32 frames_out;
+
+// ------------------------------------------------
+// Function:        now_ns()
+// ------------------------------------------------
+// Input:           -
+// Output:          Monotonic time (ns)
+// ------------------------------------------------
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// ------------------------------------------------
+// Function:        inet_sum()
+// ------------------------------------------------
+// Input:           Data, size
+// Output:          Internet checksum
+// ------------------------------------------------
+static UInt16 inet_sum(BYTE *p, UInt16 n)
+{
+    UInt32 s;
+    UInt16 i;
+
+    s = 0;
+    for(i=0; (i+1)<n; i+=2) s += ((UInt32)p[i] << 8) | p[i+1];
+    if(n & 1) s += (UInt32)p[n-1] << 8;
+    while(s >> 16) s = (s & 0xffff) + (s >> 16);
+    return (UInt16)~s;
+}
+
+// ------------------------------------------------
+// Function:        make_ip()
+// ------------------------------------------------
+// Input:           Frame, protocol, payload size
+// Output:          Payload pointer
+// ------------------------------------------------
+// Description:     Builds an IP header from the
+//                  peer to the node
+// ------------------------------------------------
+static BYTE *make_ip(FRAME *f, BYTE prot, UInt16 size)
+{
+    IP_HDR *h;
+    UInt16 sum;
+
+    memset(f->data, 0, sizeof(f->data));
+    f->size = sizeof(IP_HDR) + size;
+    h = (IP_HDR *)f->data;
+    h->ver_length = 0x45;
+    h->length = HTONS(f->size);
+    h->ttl = 64;
+    h->prot = prot;
+    h->source.d = PEER_IP;
+    h->dest.d = LOCAL_IP;
+    sum = inet_sum(f->data, sizeof(IP_HDR));
+    h->checksum = HTONS(sum);
+    return f->data + sizeof(IP_HDR);
+}
+
+// ------------------------------------------------
+// Function:        make_frames()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Frames of the mixes
+// ------------------------------------------------
+static void make_frames(void)
+{
+    static const UInt16 sizes[3] = {64, 576, 1500};
+    UDP_HDR *u;
+    TCP_HDR *t;
+    ARP_HDR *a;
+    BYTE *p;
+    UInt16 sum;
+    int i;
+
+    for(i=0; i<sizeof(payload); i++) payload[i] = (BYTE)i;
+
+    for(i=0; i<3; i++) {
+        u = (UDP_HDR *)make_ip(&udp_frame[i], IP_PROT_UDP, sizes[i] - sizeof(IP_HDR));
+        u->src_port = HTONS(1000);
+        u->dst_port = HTONS(UDP_PORT);
+        sum = sizes[i] - sizeof(IP_HDR);
+        u->length = HTONS(sum);
+        memcpy((BYTE *)u + sizeof(UDP_HDR), payload, sum - sizeof(UDP_HDR));
+    }
+    for(i=0; i<12; i++) imix[i] = udp_frame[(i < 7)? 0: (i < 11)? 1: 2];
+
+    // -----------------------------------
+    // TCP segment for a port not served:
+    // the lookup and discard path
+    // -----------------------------------
+    t = (TCP_HDR *)make_ip(&tcp_frame, IP_PROT_TCP, sizeof(TCP_HDR) + 512);
+    t->src_port = HTONS(40000);
+    t->dst_port = HTONS(TCP_PORT);
+    t->hlen = (sizeof(TCP_HDR) / 4) << 4;
+    t->flags = TCP_ACK;
+    memcpy((BYTE *)t + sizeof(TCP_HDR), payload, 512);
+
+    // ------------------
+    // ICMP echo, 56 bytes
+    // ------------------
+    p = make_ip(&icmp_frame, IP_PROT_ICMP, 64);
+    p[0] = ICMP_ECHO;
+    memcpy(p + 8, payload, 56);
+    sum = inet_sum(p, 64);
+    p[2] = (BYTE)(sum >> 8);
+    p[3] = (BYTE)sum;
+
+    // -----------------------
+    // ARP request for the node
+    // -----------------------
+    a = (ARP_HDR *)arp_frame.data;
+    a->hardware = 0x0100;
+    a->protocol = 0x0008;
+    a->hw_size = 6;
+    a->pr_size = 4;
+    a->opcode = ARP_OP_REQUEST;
+    a->orig_hw_address = peer_mac;
+    a->orig_ip_address.d = PEER_IP;
+    a->dest_ip_address.d = LOCAL_IP;
+    arp_frame.size = sizeof(ARP_HDR);
+}
+
+// ------------------------------------------------
+// Function:        rx_buffer()
+// ------------------------------------------------
+// Input:           Frame
+// Output:          Buffer as a driver delivers it
+// ------------------------------------------------
+static PPBUF rx_buffer(FRAME *f)
+{
+    PPBUF p;
+
+    p = link_buffer(f->size, INTERFACE_ETH);
+    if(p == NULL) {
+        fprintf(stderr, "buffer pool exhausted\n");
+        exit(1);
+    }
+    os_copy(f->data, BUF_DATA(p), f->size);
+    p->size = f->size;
+    return p;
+}
+
+// ------------------------------------------------
+// Function:        strip_ip()
+// ------------------------------------------------
+// Input:           Buffer
+// Output:          -
+// ------------------------------------------------
+// Description:     Leaves the buffer as parse_ip()
+//                  hands it to the transport layer
+// ------------------------------------------------
+static void strip_ip(PPBUF p)
+{
+    p->offset += sizeof(IP_HDR);
+    p->pos = p->offset;
+    p->size -= sizeof(IP_HDR);
+}
+
+// ------------------------------------------------
+// Function:        drain()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     The application side: takes the
+//                  datagram left in the socket
+// ------------------------------------------------
+static void drain(void)
+{
+    PPBUF p;
+
+    p = udp_read(0);
+    if(p != NULL) release_buffer(p);
+}
+
+// ------------------------------------------------
+// Benchmarks: each runs n operations
+// ------------------------------------------------
+static UInt32 b_get_release_64(UInt32 n)
+{
+    UInt32 i;
+
+    for(i=0; i<n; i++) release_buffer(get_buffer(64));
+    return n * 64;
+}
+
+static UInt32 b_get_release_1500(UInt32 n)
+{
+    UInt32 i;
+
+    for(i=0; i<n; i++) release_buffer(get_buffer(1500));
+    return n * 1500;
+}
+
+static UInt32 b_rx_buffer_576(UInt32 n)
+{
+    UInt32 i;
+
+    for(i=0; i<n; i++) release_buffer(rx_buffer(&udp_frame[1]));
+    return n * udp_frame[1].size;
+}
+
+static UInt32 b_check_update_1500(UInt32 n)
+{
+    UInt32 i;
+    UInt16 j;
+
+    for(i=0; i<n; i++) {
+        check_init();
+        for(j=0; j<1500; j++) check_update(payload[j]);
+        sink += chk_H;
+    }
+    return n * 1500;
+}
+
+static UInt32 b_ip_checksum_20(UInt32 n)
+{
+    UInt32 i;
+
+    for(i=0; i<n; i++) {
+        ip_checksum(udp_frame[0].data, sizeof(IP_HDR));
+        sink += chk_L;
+    }
+    return n * sizeof(IP_HDR);
+}
+
+static UInt32 b_check_buffer_1460(UInt32 n)
+{
+    UInt32 i;
+
+    for(i=0; i<n; i++) {
+        check_init();
+        check_buffer(chain);
+        sink += chk_H;
+    }
+    return n * buffer_size(chain);
+}
+
+static UInt32 b_write_uint16(UInt32 n)
+{
+    PPBUF p;
+    UInt32 i;
+
+    p = get_buffer(1024);
+    for(i=0; i<n; i++) {
+        if((i & 511) == 0) {
+            p->pos = p->offset;
+            p->size = 0;
+        }
+        write_uint16(p, (UInt16)i);
+    }
+    release_buffer(p);
+    return n * 2;
+}
+
+static UInt32 b_write_uint32(UInt32 n)
+{
+    PPBUF p;
+    UInt32 i;
+
+    p = get_buffer(1024);
+    for(i=0; i<n; i++) {
+        if((i & 255) == 0) {
+            p->pos = p->offset;
+            p->size = 0;
+        }
+        write_uint32(p, i);
+    }
+    release_buffer(p);
+    return n * 4;
+}
+
+static UInt32 b_write_string_32(UInt32 n)
+{
+    PPBUF p;
+    UInt32 i;
+
+    p = get_buffer(1024);
+    for(i=0; i<n; i++) {
+        if((i & 31) == 0) {
+            p->pos = p->offset;
+            p->size = 0;
+        }
+        write_string(p, "GET /index.html HTTP/1.0\r\nHost: ");
+    }
+    release_buffer(p);
+    return n * 32;
+}
+
+static UInt32 b_write_buf_512(UInt32 n)
+{
+    PPBUF p;
+    UInt32 i;
+
+    p = get_buffer(1024);
+    for(i=0; i<n; i++) {
+        p->pos = p->offset;
+        p->size = 0;
+        write_buf(p, payload, 512);
+    }
+    release_buffer(p);
+    return n * 512;
+}
+
+static UInt32 b_write_integer(UInt32 n)
+{
+    PPBUF p;
+    UInt32 i;
+
+    p = get_buffer(1024);
+    for(i=0; i<n; i++) {
+        if((i & 63) == 0) {
+            p->pos = p->offset;
+            p->size = 0;
+        }
+        write_integer(p, i, 0);
+    }
+    release_buffer(p);
+    return 0;
+}
+
+static UInt32 b_read_uint16(UInt32 n)
+{
+    PPBUF p;
+    UInt32 i;
+
+    p = get_buffer(1024);
+    write_buf(p, payload, 1024);
+    for(i=0; i<n; i++) {
+        if((i & 511) == 0) p->pos = p->offset;
+        sink += read_uint16(p);
+    }
+    release_buffer(p);
+    return n * 2;
+}
+
+static UInt32 b_read_uint32(UInt32 n)
+{
+    PPBUF p;
+    UInt32 i;
+
+    p = get_buffer(1024);
+    write_buf(p, payload, 1024);
+    for(i=0; i<n; i++) {
+        if((i & 255) == 0) p->pos = p->offset;
+        sink += read_uint32(p);
+    }
+    release_buffer(p);
+    return n * 4;
+}
+
+static UInt32 b_read_buf_512(UInt32 n)
+{
+    BYTE out[512];
+    PPBUF p;
+    UInt32 i;
+
+    p = get_buffer(1024);
+    write_buf(p, payload, 1024);
+    for(i=0; i<n; i++) {
+        p->pos = p->offset;
+        read_buf(p, out, 512);
+        sink += out[i & 511];
+    }
+    release_buffer(p);
+    return n * 512;
+}
+
+static UInt32 b_parse_ip_imix(UInt32 n)
+{
+    PPBUF p;
+    UInt32 i, bytes;
+
+    bytes = 0;
+    for(i=0; i<n; i++) {
+        p = rx_buffer(&imix[i % 12]);
+        bytes += p->size;
+        parse_ip(p);                                        // up to the transport hand off
+        p->rc = 1;
+        release_buffer(p);
+    }
+    return bytes;
+}
+
+static UInt32 b_parse_udp_576(UInt32 n)
+{
+    PPBUF p;
+    UInt32 i;
+
+    for(i=0; i<n; i++) {
+        p = rx_buffer(&udp_frame[1]);
+        strip_ip(p);
+        parse_udp(p);
+        release_buffer(p);
+        drain();
+    }
+    return n * udp_frame[1].size;
+}
+
+static UInt32 b_parse_tcp_discard(UInt32 n)
+{
+    PPBUF p;
+    UInt32 i;
+
+    for(i=0; i<n; i++) {
+        p = rx_buffer(&tcp_frame);
+        strip_ip(p);
+        parse_tcp(p);
+        release_buffer(p);
+    }
+    return n * tcp_frame.size;
+}
+
+static UInt32 b_icmp_parse_echo(UInt32 n)
+{
+    PPBUF p;
+    UInt32 i;
+
+    for(i=0; i<n; i++) {
+        p = rx_buffer(&icmp_frame);
+        strip_ip(p);
+        icmp_parse(p);                                      // answers it
+        release_buffer(p);
+    }
+    return n * icmp_frame.size;
+}
+
+static UInt32 b_arp_parse_request(UInt32 n)
+{
+    PPBUF p;
+    UInt32 i;
+
+    for(i=0; i<n; i++) {
+        p = rx_buffer(&arp_frame);
+        arp_parse(p);                                       // answers it
+        release_buffer(p);
+    }
+    return n * arp_frame.size;
+}
+
+static UInt32 rx_path(FRAME *f, BYTE proto, UInt32 n)
+{
+    PPBUF p;
+    UInt32 i;
+
+    for(i=0; i<n; i++) {
+        p = rx_buffer(f);
+        BUF_PROTOCOL(p) = proto;
+        hermes_parse(p);
+        drain();
+    }
+    return n * f->size;
+}
+
+static UInt32 b_rx_udp_64(UInt32 n)
+{
+    return rx_path(&udp_frame[0], BUFFER_IP, n);
+}
+
+static UInt32 b_rx_udp_1500(UInt32 n)
+{
+    return rx_path(&udp_frame[2], BUFFER_IP, n);
+}
+
+static UInt32 b_rx_udp_imix(UInt32 n)
+{
+    UInt32 i, bytes;
+
+    bytes = 0;
+    for(i=0; i<n; i++) bytes += rx_path(&imix[i % 12], BUFFER_IP, 1);
+    return bytes;
+}
+
+static UInt32 b_rx_icmp_echo(UInt32 n)
+{
+    return rx_path(&icmp_frame, BUFFER_IP, n);
+}
+
+static UInt32 b_rx_arp_request(UInt32 n)
+{
+    return rx_path(&arp_frame, BUFFER_ARP, n);
+}
+
+static BENCH benches[] = {
+    {"get_release_64",      "op",   b_get_release_64},
+    {"get_release_1500",    "op",   b_get_release_1500},
+    {"rx_buffer_576",       "op",   b_rx_buffer_576},
+    {"check_update_1500",   "op",   b_check_update_1500},
+    {"ip_checksum_20",      "op",   b_ip_checksum_20},
+    {"check_buffer_1460",   "op",   b_check_buffer_1460},
+    {"write_uint16",        "op",   b_write_uint16},
+    {"write_uint32",        "op",   b_write_uint32},
+    {"write_string_32",     "op",   b_write_string_32},
+    {"write_buf_512",       "op",   b_write_buf_512},
+    {"write_integer",       "op",   b_write_integer},
+    {"read_uint16",         "op",   b_read_uint16},
+    {"read_uint32",         "op",   b_read_uint32},
+    {"read_buf_512",        "op",   b_read_buf_512},
+    {"parse_ip_imix",       "pkt",  b_parse_ip_imix},
+    {"parse_udp_576",       "pkt",  b_parse_udp_576},
+    {"parse_tcp_discard",   "pkt",  b_parse_tcp_discard},
+    {"icmp_parse_echo",     "pkt",  b_icmp_parse_echo},
+    {"arp_parse_request",   "pkt",  b_arp_parse_request},
+    {"rx_udp_64",           "pkt",  b_rx_udp_64},
+    {"rx_udp_1500",         "pkt",  b_rx_udp_1500},
+    {"rx_udp_imix",         "pkt",  b_rx_udp_imix},
+    {"rx_icmp_echo",        "pkt",  b_rx_icmp_echo},
+    {"rx_arp_request",      "pkt",  b_rx_arp_request},
+};
+
+// ------------------------------------------------
+// Function:        count_frames()
+// ------------------------------------------------
+// Input:           Port, frame, size
+// Output:          -
+// ------------------------------------------------
+// Description:     Link output: answers are only
+//                  counted
+// ------------------------------------------------
+static void count_frames(void *port, BYTE *frame, UInt16 size)
+{
+    frames_out++;
+}
+
+// ------------------------------------------------
+// Function:        measure()
+// ------------------------------------------------
+// Input:           Benchmark
+//                  Target time per run (ms)
+//                  Runs
+//                  Results to fill in
+// Output:          -
+// ------------------------------------------------
+// Description:     Sizes the run to the target time
+//                  and keeps the median of the runs
+// ------------------------------------------------
+static void measure(BENCH *b, UInt32 ms, int runs, UInt32 *iter, double *ns, double *bytes)
+{
+    unsigned long long t0, t;
+    double per[32];
+    double v;
+    UInt32 n, done;
+    int i, j;
+
+    // -----------------------------
+    // calibrate, also warms it up
+    // -----------------------------
+    n = 16;
+    for(;;) {
+        t0 = now_ns();
+        b->run(n);
+        t = now_ns() - t0;
+        if((t >= 10000000ULL) || (n >= (1U << 30))) break;
+        n <<= 1;
+    }
+    n = (UInt32)((double)n * ms * 1e6 / (t? t: 1));
+    if(n < 1) n = 1;
+
+    if(runs > 32) runs = 32;
+    for(i=0; i<runs; i++) {
+        t0 = now_ns();
+        done = b->run(n);
+        t = now_ns() - t0;
+        per[i] = (double)t / n;
+        *bytes = (double)done / n;
+    }
+
+    // ------
+    // median
+    // ------
+    for(i=1; i<runs; i++) {
+        v = per[i];
+        for(j=i; (j>0) && (per[j-1] > v); j--) per[j] = per[j-1];
+        per[j] = v;
+    }
+    *iter = n;
+    *ns = per[runs / 2];
+}
+
+int main(int argc, char **argv)
+{
+    IPV4 ip;
+    char *format, *only;
+    UInt32 ms, iter;
+    double ns, bytes;
+    int runs, i, first;
+
+    format = "json";
+    only = NULL;
+    ms = 200;
+    runs = 5;
+    for(i=1; i<argc; i++) {
+        if(!strcmp(argv[i], "-f") && (i+1 < argc)) format = argv[++i];
+        else if(!strcmp(argv[i], "-t") && (i+1 < argc)) ms = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-r") && (i+1 < argc)) runs = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-b") && (i+1 < argc)) only = argv[++i];
+        else {
+            fprintf(stderr, "usage: %s [-f json|csv] [-t ms] [-r runs] [-b name]\n", argv[0]);
+            return 2;
+        }
+    }
+    if(runs < 1) runs = 1;
+
+    // ------------------------------------------
+    // one stack, the peer already resolved and a
+    // UDP socket bound; the Hermes thread stays
+    // idle as this thread keeps the processor
+    // ------------------------------------------
+    os_init(FALSE);
+    hermes_select(&node);
+    hermes_init();
+    eth_attach(NULL, count_frames, NULL);
+    ip_local[INTERFACE_ETH].d = LOCAL_IP;
+    ip_mask[INTERFACE_ETH].d = 0x00ffffff;
+    ip.d = PEER_IP;
+    cache_add(&ip, &peer_mac);
+    udp_open(0, UDP_PORT, ip, 1000, INTERFACE_ETH);
+    make_frames();
+
+    chain = get_buffer(SEGMENT_SIZE);
+    write_buf(chain, payload, 1460);
+
+    if(!strcmp(format, "csv")) printf("name,unit,iterations,ns_per_op,ops_per_sec,mb_per_sec\n");
+    else printf("{\"suite\":\"hermes-micro\",\"num_buffers\":%d,\"segment_size\":%d,\"results\":[\n",
+                NUM_BUFFERS, SEGMENT_SIZE);
+
+    first = 1;
+    for(i=0; i<sizeof(benches)/sizeof(BENCH); i++) {
+        if(only && !strstr(benches[i].name, only)) continue;
+        measure(&benches[i], ms, runs, &iter, &ns, &bytes);
+        if(!strcmp(format, "csv")) {
+            printf("%s,%s,%u,%.2f,%.0f,%.2f\n", benches[i].name, benches[i].unit, iter,
+                   ns, 1e9 / ns, bytes * 1e3 / ns);
+        } else {
+            printf("%s  {\"name\":\"%s\",\"unit\":\"%s\",\"iterations\":%u,\"ns_per_op\":%.2f,"
+                   "\"ops_per_sec\":%.0f,\"mb_per_sec\":%.2f}", first? "": ",\n",
+                   benches[i].name, benches[i].unit, iter, ns, 1e9 / ns, bytes * 1e3 / ns);
+        }
+        fflush(stdout);
+        first = 0;
+    }
+    if(strcmp(format, "csv")) printf("\n]}\n");
+
+    release_buffer(chain);
+    os_terminate();
+    os_join();
+    return 0;
+}
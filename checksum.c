@@ -15,16 +15,23 @@
 // -------------------------------------------------------
 // Functions:       check_init()
 //                  check_update()
+//                  check_buffer()
+//                  check_add()
+//                  check_block()
 // -------------------------------------------------------
 
+#include <stdlib.h>
 #include "defs.h"
+#include "net.h"
+#include "hermes.h"
+#include "checksum.h"
 
-// -------------------
-// auxiliary variables
-// ------------------- 
-static BOOL byteH;
-BYTE chk_H;							// checksum temp value (most significative)
-BYTE chk_L;							// checksum temp value (least significative)
+// --------------------------------
+// auxiliary variables (per thread)
+// --------------------------------
+static HERMES_TLS BOOL byteH;
+HERMES_TLS BYTE chk_H;					// checksum temp value (most significative)
+HERMES_TLS BYTE chk_L;					// checksum temp value (least significative)
 
 // ------------------------------------------------
 // Function:        check_init()
@@ -88,3 +95,87 @@ void check_update(BYTE v)
         }
     }
 }
+
+// ------------------------------------------------
+// Function:        check_buffer()
+// ------------------------------------------------
+// Input:           Message buffer
+// Output:          -
+// ------------------------------------------------
+// Description:     Initializes the checksum and
+//                  accounts for every segment of
+//                  the chain, padding odd sizes.
+//                  Constant segments with a known
+//                  sum are not read
+// ------------------------------------------------
+void check_buffer(PPBUF pbuf)
+{
+    BYTE *p;
+    UInt16 n;
+
+    check_init();
+    while(pbuf != NULL) {
+        if(pbuf->sum != 0) {
+            check_add(pbuf->sum, pbuf->size);
+        } else {
+            p = BUF_DATA(pbuf);
+            n = pbuf->size;
+            while(n) {
+                check_update(*p);
+                p++;
+                n--;
+            }
+        }
+        pbuf = pbuf->next;
+    }
+    if(!byteH) check_update(0);                 // add a pad to make it even
+}
+
+// ------------------------------------------------
+// Function:        check_add()
+// ------------------------------------------------
+// Input:           Sum of a block (check_block())
+//                  Block size
+// Output:          -
+// ------------------------------------------------
+// Description:     Accounts for a block as if its
+//                  bytes were updated one by one.
+//                  At an odd position the sum goes
+//                  in swapped, an odd size leaves
+//                  the next byte in the other half
+// ------------------------------------------------
+void check_add(UInt16 sum, UInt16 size)
+{
+    check_update(HIGH(sum));
+    check_update(LOW(sum));
+    if(size & 1) byteH = !byteH;
+}
+
+// ------------------------------------------------
+// Function:        check_block()
+// ------------------------------------------------
+// Input:           Block pointer
+//                  Block size
+// Output:          Ones' complement sum
+// ------------------------------------------------
+// Description:     Sums a block on its own, first
+//                  byte most significative, so
+//                  constant data (const_buffer())
+//                  is summed once instead of at
+//                  every send. Leaves the running
+//                  checksum untouched
+// ------------------------------------------------
+UInt16 check_block(const BYTE *p, UInt16 n)
+{
+    UInt32 sum;
+
+    sum = 0;
+    while(n > 1) {
+        sum += WORDOF(p[0], p[1]);
+        p += 2;
+        n -= 2;
+    }
+    if(n) sum += WORDOF(p[0], 0);
+    while(sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return (UInt16)sum;
+}
@@ -1,4 +1,7 @@
-extern BYTE chk_H;				
-extern BYTE chk_L;				
+extern HERMES_TLS BYTE chk_H;
+extern HERMES_TLS BYTE chk_L;
 void check_init(void);
 void check_update(BYTE v);
+void check_buffer(PPBUF pbuf);
+void check_add(UInt16 sum, UInt16 size);
+UInt16 check_block(const BYTE *p, UInt16 n);
@@ -8,6 +8,8 @@ typedef enum {
 #ifdef __PIC32MX__
 #define disable() asm volatile ("di\n");
 #define enable()  asm volatile ("ei\n");
+#define irq_save(s) asm volatile ("di %0\nehb\n" : "=r"(s))	// keeps previous Status
+#define irq_restore(s) do { if((s) & 1) asm volatile ("ei\n"); } while(0)
 #define WORD unsigned int
 #define UInt32 unsigned int
 #define UInt16 unsigned short
@@ -18,6 +20,8 @@ typedef enum {
 #ifdef __C30__
 #define disable() asm volatile("push SR\n"); SR |= 0xe0;
 #define enable() asm volatile ("pop SR\n")
+#define irq_save(s) do { (s) = SR; SR |= 0xe0; } while(0)	// keeps previous IPL
+#define irq_restore(s) SR = (s)
 #define WORD unsigned int
 #define UInt16 unsigned int
 #define UInt32 unsigned long
@@ -25,6 +29,19 @@ typedef enum {
 #define __interrupt __attribute__((interrupt, no_auto_psv))
 #endif
 
+#if !defined(__PIC32MX__) && !defined(__C30__)
+#define _HOSTED								// Linux (or other) hosted build
+#define disable()
+#define enable()
+#define irq_save(s) (s) = 0
+#define irq_restore(s)
+#define WORD unsigned int
+#define UInt32 unsigned int
+#define UInt16 unsigned short
+
+#define __interrupt
+#endif
+
 typedef union {
 	UInt32 d;
 	UInt16 w[2];
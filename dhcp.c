@@ -63,10 +63,11 @@
 #define DHCP(xxx) ((BOOTP_HDR *)xxx)
 #define IPH(xxx) ((IP_HDR *)xxx)
 
-IPV4 ip_tmp;                                        // temp address
-IPV4 ip_dhcp;                                       // DHCP server addres
-_UInt32 xid;
-static BYTE retry;
+// --------------------------
+// state of the current stack
+// --------------------------
+#define ip_tmp                          (hermes->dhcp.tmp)
+#define dhcp_xid                        (hermes->dhcp.xid)
 			
 #define MAX_RETRIES                     10
 #define TIMEOUT_DHCP_DISCOVER           1000
@@ -88,28 +89,28 @@ BOOL dhcp_send(BYTE type, BOOL broadcast)
     buf = udp_new(SOCKET_DHCP);
     if(buf == NULL) return FALSE;
 
-    DHCP(buf->data)->op = 1;                            // BOOTREQUEST
-    DHCP(buf->data)->htype = 1;                         // ETH 10MBPS
-    DHCP(buf->data)->hlen = 6;                          // 6 bytes ETH MAC
-    DHCP(buf->data)->hops = 0;
-    DHCP(buf->data)->xid = xid.d;
-    DHCP(buf->data)->secs = 0;
+    DHCP(BUF_DATA(buf))->op = 1;                        // BOOTREQUEST
+    DHCP(BUF_DATA(buf))->htype = 1;                     // ETH 10MBPS
+    DHCP(BUF_DATA(buf))->hlen = 6;                      // 6 bytes ETH MAC
+    DHCP(BUF_DATA(buf))->hops = 0;
+    DHCP(BUF_DATA(buf))->xid = dhcp_xid.d;
+    DHCP(BUF_DATA(buf))->secs = 0;
 
     if(broadcast) {
-        DHCP(buf->data)->flags = HTONS(0x8000);         // server must broadcast answer
-        DHCP(buf->data)->ci.d = 0;
+        DHCP(BUF_DATA(buf))->flags = HTONS(0x8000);     // server must broadcast answer
+        DHCP(BUF_DATA(buf))->ci.d = 0;
     } else {
-        DHCP(buf->data)->flags = 0;                     // server must send unicast answer
-        DHCP(buf->data)->ci.d = ip_local[INTERFACE_ETH].d;
+        DHCP(BUF_DATA(buf))->flags = 0;                 // server must send unicast answer
+        DHCP(BUF_DATA(buf))->ci.d = ip_local[INTERFACE_ETH].d;
     }
 
-    DHCP(buf->data)->yi.d = 0;
-    DHCP(buf->data)->gi.d = 0;
-    DHCP(buf->data)->si.d = ip_dhcp.d;
+    DHCP(BUF_DATA(buf))->yi.d = 0;
+    DHCP(BUF_DATA(buf))->gi.d = 0;
+    DHCP(BUF_DATA(buf))->si.d = ip_dhcp.d;
 
-    os_set((BYTE *)(&DHCP(buf->data)->chaddr), 0, 16+64+128);
+    os_set((BYTE *)(&DHCP(BUF_DATA(buf))->chaddr), 0, 16+64+128);
     os_copy((BYTE *)&mac_local,
-            (BYTE *)(&DHCP(buf->data)->chaddr),
+            (BYTE *)(&DHCP(BUF_DATA(buf))->chaddr),
             sizeof(MACADDR));
 
     // --------------
@@ -174,15 +175,15 @@ BYTE parse_dhcp(PPBUF pbuf)
     // -----------------
     // check DHCP fields
     // -----------------
-    if(DHCP(pbuf->data)->op != 2) return 0xff;
-    if(DHCP(pbuf->data)->xid != xid.d) return 0xff;
+    if(DHCP(BUF_DATA(pbuf))->op != 2) return 0xff;
+    if(DHCP(BUF_DATA(pbuf))->xid != dhcp_xid.d) return 0xff;
     if(read_uint32(pbuf) != 0x63825363) return 0xff;
 
     // ----------------
     // update temp data
     // ----------------
-    ip_tmp.d = DHCP(pbuf->data)->yi.d;
-    ip_dhcp.d = IPH(pbuf->start)->source.d;
+    ip_tmp.d = DHCP(BUF_DATA(pbuf))->yi.d;
+    ip_dhcp.d = IPH(BUF_START(pbuf))->source.d;
 
     // -------------
     // parse options
@@ -236,6 +237,7 @@ BYTE parse_dhcp(PPBUF pbuf)
 // ------------------------------------------------
 BOOL dhcp_discover(void)
 {
+    BYTE retry;
     BYTE opt;
     PPBUF pbuf;
 
@@ -267,12 +269,13 @@ BOOL dhcp_discover(void)
 // ------------------------------------------------
 BOOL dhcp_req(void)
 {
+    BYTE retry;
     BYTE opt;
     PPBUF pbuf;
 
     retry = 0;
     while(retry < MAX_RETRIES) {
-        if(!dhcp_envia(DHCPREQUEST, TRUE)) return FALSE;
+        if(!dhcp_send(DHCPREQUEST, TRUE)) return FALSE;
         os_set_timeout(TIMEOUT_DHCP_REQUEST);
         if(udp_listen(SOCKET_DHCP, UDP_DHCP_CLI)) {
             pbuf = udp_read(SOCKET_DHCP);
@@ -309,12 +312,13 @@ BOOL dhcp_get_ip(void)
         return FALSE;
 
     ip_local[INTERFACE_ETH].d = 0;
+    route_flush();
     ip_tmp.d = 0;
     ip_dhcp.d = 0xffffffff;
-    xid.b[0] = random();
-    xid.b[1] = random();
-    xid.b[2] = random();
-    xid.b[3] = random();
+    dhcp_xid.b[0] = random();
+    dhcp_xid.b[1] = random();
+    dhcp_xid.b[2] = random();
+    dhcp_xid.b[3] = random();
 
     if(!dhcp_discover()) goto fail;                             // find a DHCP server
 
@@ -325,11 +329,13 @@ BOOL dhcp_get_ip(void)
     if(!dhcp_req()) goto fail;                                  // request an IP address
 
     ip_local[INTERFACE_ETH].d = ip_tmp.d;
+    route_flush();
     udp_close(SOCKET_DHCP);
     return TRUE;
 
 fail:
     ip_local[INTERFACE_ETH].d = 0;
+    route_flush();
     udp_close(SOCKET_DHCP);
     return FALSE;
 }	
@@ -354,7 +360,7 @@ BOOL dhcp_release_ip(void)
         return FALSE;
 
     for(i=0; i<3; i++) {
-        if(!dhcp_envia(DHCPRELEASE, TRUE)) break;
+        if(!dhcp_send(DHCPRELEASE, TRUE)) break;
         os_sleep(100);
     }
 
@@ -362,6 +368,7 @@ BOOL dhcp_release_ip(void)
     ip_local[INTERFACE_ETH].d = 0;
     ip_gateway[INTERFACE_ETH].d = 0;
     ip_mask[INTERFACE_ETH].d = 0;
+    route_flush();
     ip_dhcp.d = 0xffffffff;
     return TRUE;
 }	
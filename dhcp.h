@@ -1,3 +1,9 @@
-extern IPV4 ip_dhcp;								// endereo IP do servidor DHCP
+typedef struct {
+    IPV4 tmp;                                   // temp address
+    IPV4 server;                                // endereo IP do servidor DHCP
+    _UInt32 xid;                                // transaction ID
+} DHCP_STATE;
+
+#define ip_dhcp                         (hermes->dhcp.server)
 BOOL dhcp_get_ip(void);
 BOOL dhcp_release_ip(void);
@@ -18,6 +18,7 @@
 //                  parse_dns()
 //                  dns_inicia()
 //                  dns_get_ip()
+//                  dns_get_ip_nb()
 // -------------------------------------------------------
 
 #include <stdlib.h>
@@ -32,8 +33,10 @@
 #error "UDP must be installed for using DNS"
 #endif
 
-IPV4 ip_dns[MAX_INTERFACES];                        // DNS server address
-UInt16 id_dns;                                      // DNS transaction ID
+// --------------------------
+// state of the current stack
+// --------------------------
+#define id_dns                  (hermes->dns.id)
 
 #define DNS_TIMEOUT             500
 #define MAX_RETRIES             3
@@ -62,17 +65,17 @@ void dns_send(char *url)
     // -----------------
     // DNS query message
     // -----------------
-    DNS(buf->data)->id = id_dns;
-    DNS(buf->data)->flags = 0x0001;                     // 0x100 = standard query
-    DNS(buf->data)->qdcount = 0x0100;                   // 0x001, single query
-    DNS(buf->data)->ancount = 0;
-    DNS(buf->data)->nscount = 0;
-    DNS(buf->data)->arcount = 0;
+    DNS(BUF_DATA(buf))->id = id_dns;
+    DNS(BUF_DATA(buf))->flags = 0x0001;                 // 0x100 = standard query
+    DNS(BUF_DATA(buf))->qdcount = 0x0100;               // 0x001, single query
+    DNS(BUF_DATA(buf))->ancount = 0;
+    DNS(BUF_DATA(buf))->nscount = 0;
+    DNS(BUF_DATA(buf))->arcount = 0;
 
     // --------------
     // translates URL
     // --------------
-    p = buf->data + sizeof(DNS_HDR);
+    p = BUF_DATA(buf) + sizeof(DNS_HDR);
     q = p++;
     n = 0;
     while(*url) {
@@ -94,7 +97,7 @@ void dns_send(char *url)
     *p++ = 0;                                           // QCLASS = 1, internet
     *p++ = 1;
 
-    buf->size = p - buf->data;
+    buf->size = p - BUF_DATA(buf);
     udp_send(buf);
     release_buffer(buf);
 }
@@ -141,11 +144,11 @@ BOOL parse_dns(PPBUF buf, IPV4 *ip)
     // -------------
     // verify answer
     // -------------
-    if(DNS(buf->data)->ancount == 0) return FALSE;              // no answer
-    if(DNS(buf->data)->id != id_dns) return FALSE;              // wrong id
+    if(DNS(BUF_DATA(buf))->ancount == 0) return FALSE;          // no answer
+    if(DNS(BUF_DATA(buf))->id != id_dns) return FALSE;          // wrong id
 
     skip(buf, sizeof(DNS_HDR));                                 // skip header
-    buf->data[buf->size] = 0;
+    BUF_DATA(buf)[buf->size] = 0;
 
     // ------------------
     // ignore query field
@@ -158,13 +161,13 @@ BOOL parse_dns(PPBUF buf, IPV4 *ip)
     // ------------
     while(!is_eof(buf)) {
         skip_field(buf);
-        tmp = read_word(buf);
+        tmp = read_uint16(buf);
         skip(buf, 6);
         if(tmp == 1) {
             // ----------------------
             // IP address field found
             // ----------------------
-            tmp = read_word(buf);
+            tmp = read_uint16(buf);
             if(tmp != 4) break;                                 // wrong size
             *ip = read_ip(buf);
             return TRUE;
@@ -172,7 +175,7 @@ BOOL parse_dns(PPBUF buf, IPV4 *ip)
             // -----------------
             // other field, skip
             // -----------------
-            tmp = read_word(buf);
+            tmp = read_uint16(buf);
             skip(buf, tmp);
         }
     }
@@ -235,4 +238,46 @@ end:
     return res;
 }	
 
+#ifdef _PT
+// ------------------------------------------------
+// Function:        dns_get_ip_nb()
+// ------------------------------------------------
+// Input:           Coroutine state
+//                  URL
+//                  Network interface ID
+//                  IP to fill in
+// Output:          PT_DONE if resolved
+// ------------------------------------------------
+// Description:     Non-blocking dns_get_ip()
+// ------------------------------------------------
+BYTE dns_get_ip_nb(PT *pt, char *url, BYTE interface, IPV4 *ip)
+{
+    PPBUF buf;
+
+    PT_BEGIN(pt);
+    ip->d = 0;
+
+    udp_close(SOCKET_DNS);
+    if(!udp_open(SOCKET_DNS, udp_get_port(), ip_dns[interface], UDP_DNS, interface)) goto end;
+
+    id_dns = WORDOF(random(), random());
+    for(pt->retry=0; pt->retry<MAX_RETRIES; pt->retry++) {
+        dns_send(url);
+        PT_TIMEOUT(pt, DNS_TIMEOUT);
+        PT_WAIT_UNTIL(pt, udp_has_data(SOCKET_DNS) || PT_EXPIRED(pt));
+        if(udp_has_data(SOCKET_DNS)) {
+            buf = udp_read(SOCKET_DNS);
+            parse_dns(buf, ip);
+            release_buffer(buf);
+            break;
+        }
+    }
+
+end:
+    udp_close(SOCKET_DNS);
+    if(ip->d == 0) PT_EXIT(pt, PT_ERROR);
+    PT_END(pt);
+}
+#endif
+
 #endif
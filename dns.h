@@ -1,4 +1,12 @@
-extern IPV4 ip_dns[MAX_INTERFACES];
+typedef struct {
+    IPV4 server[MAX_INTERFACES];                // DNS server address
+    UInt16 id;                                  // DNS transaction ID
+} DNS_STATE;
+
+#define ip_dns                          (hermes->dns.server)
 void dns_init(void);
 IPV4 dns_get_ip(char *url, BYTE interface);
 
+#ifdef _PT
+BYTE dns_get_ip_nb(PT *pt, char *url, BYTE interface, IPV4 *ip);
+#endif
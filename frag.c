@@ -0,0 +1,356 @@
+// -------------------------------------------------------
+// File:            FRAG.C
+// Project:         Hermes
+// Description:     IP fragment reassembly
+// Author:          Bruno Abrantes Basseto
+//                  bruno.basseto@uol.com.br
+// Target CPU:      PIC24 / PIC32
+// Compiler:        Microchip C30 v3.24
+//                  Microchip C32 v1.11a
+// -------------------------------------------------------
+// Functions:       frag_offset()
+//                  frag_drop()
+//                  frag_find()
+//                  frag_hole()
+//                  frag_link()
+//                  ip_reassemble()
+//                  frag_expire()
+//                  frag_tick()
+//                  frag_init()
+// -------------------------------------------------------
+
+#include <stdlib.h>
+#include "defs.h"
+#include "net.h"
+#include "cronos.h"
+#include "hermes.h"
+
+#ifdef _IP_FRAG
+
+// ----------------
+// protocol timming
+// ----------------
+#define TICK_FRAG                       250     // timer period (ms)
+#define LIFE_FRAG                       ((FRAG_TIMEOUT + TICK_FRAG - 1) / TICK_FRAG)
+
+#define HOLE_END                        0xffff  // hole open to the end
+
+// -------------------
+// frag_hole() results
+// -------------------
+#define FRAG_FILLED                     0
+#define FRAG_REFUSED                    1       // duplicate or overlap, ignored
+#define FRAG_FAILED                     2       // datagram can not be completed
+
+#define IPH(xxx)                        ((IP_HDR *)xxx)
+#define EXPIRED(t)                      ((UInt16)(frag_clock - (t)) < 0x8000)
+
+// --------------------------
+// state of the current stack
+// --------------------------
+#define frag_table                      (hermes->frag.table)
+#define frag_held                       (hermes->frag.held)
+#define frag_clock                      (hermes->frag.clock)
+#define frag_due                        (hermes->frag.due)
+
+// ------------------------------------------------
+// Function:        frag_offset()
+// ------------------------------------------------
+// Input:           Fragment buffer
+// Output:          Offset in the datagram
+// ------------------------------------------------
+// Description:     Reads the fragment offset
+// ------------------------------------------------
+static UInt16 frag_offset(PPBUF pbuf)
+{
+    return (NTOHS(IPH(BUF_START(pbuf))->frag) & IP_OFFSET) << 3;
+}
+
+// ------------------------------------------------
+// Function:        frag_drop()
+// ------------------------------------------------
+// Input:           Reassembly entry
+// Output:          -
+// ------------------------------------------------
+// Description:     Gives up a datagram, returning
+//                  its buffers to the pool
+// ------------------------------------------------
+static void frag_drop(FRAG_ENTRY *f)
+{
+    if(f->count) STAT_INC(ip.reasm_fails);
+    release_buffer(f->head);
+    frag_held -= f->count;
+    os_set((BYTE *)f, 0, sizeof(FRAG_ENTRY));
+}
+
+// ------------------------------------------------
+// Function:        frag_find()
+// ------------------------------------------------
+// Input:           First fragment buffer
+// Output:          Reassembly entry or NULL
+// ------------------------------------------------
+// Description:     Finds the datagram a fragment
+//                  belongs to, starting a new one
+//                  (or recycling the oldest) if
+//                  needed
+// ------------------------------------------------
+static FRAG_ENTRY *frag_find(PPBUF pbuf)
+{
+    FRAG_ENTRY *f;
+    FRAG_ENTRY *res;
+    BYTE i;
+
+    res = NULL;
+    f = frag_table;
+    for(i=0; i<FRAG_MAX; i++, f++) {
+        if(f->count == 0) {
+            if(res == NULL) res = f;
+            continue;
+        }
+        if(f->id != IPH(BUF_START(pbuf))->id) continue;
+        if(f->source.d != IPH(BUF_START(pbuf))->source.d) continue;
+        if(f->dest.d != IPH(BUF_START(pbuf))->dest.d) continue;
+        if(f->prot != IPH(BUF_START(pbuf))->prot) continue;
+        return f;
+    }
+
+    if(res == NULL) {
+        // -----------------------------------
+        // table full, the oldest one gives up
+        // -----------------------------------
+        res = frag_table;
+        f = frag_table;
+        for(i=0; i<FRAG_MAX; i++, f++)
+            if((UInt16)(f->time - res->time) >= 0x8000) res = f;
+        frag_drop(res);
+    }
+
+    res->source.d = IPH(BUF_START(pbuf))->source.d;
+    res->dest.d = IPH(BUF_START(pbuf))->dest.d;
+    res->id = IPH(BUF_START(pbuf))->id;
+    res->prot = IPH(BUF_START(pbuf))->prot;
+    res->time = frag_clock + LIFE_FRAG;
+    res->holes = 1;
+    res->hole[0].first = 0;
+    res->hole[0].last = HOLE_END;
+    res->head = NULL;
+    return res;
+}
+
+// ------------------------------------------------
+// Function:        frag_hole()
+// ------------------------------------------------
+// Input:           Reassembly entry
+//                  First and last fragment bytes
+//                  TRUE if more fragments follow
+// Output:          FRAG_FILLED, FRAG_REFUSED or
+//                  FRAG_FAILED
+// ------------------------------------------------
+// Description:     Updates the hole descriptors.
+//                  Duplicated and overlapping
+//                  fragments are refused; the
+//                  datagram fails if it has more
+//                  holes than can be tracked
+// ------------------------------------------------
+static BYTE frag_hole(FRAG_ENTRY *f, UInt16 first, UInt16 last, BOOL more)
+{
+    FRAG_HOLE *h;
+    FRAG_HOLE old;
+    BYTE i, n;
+
+    h = f->hole;
+    for(i=0; i<f->holes; i++, h++)
+        if((h->first <= first) && (last <= h->last)) break;
+    if(i == f->holes) return FRAG_REFUSED;                  // no hole for it
+    if(!more && (h->last != HOLE_END)) return FRAG_FAILED;  // data past the end
+
+    n = f->holes - 1;
+    if(first > h->first) n++;
+    if(more && (last < h->last)) n++;
+    if(n > FRAG_HOLES) return FRAG_FAILED;
+
+    // ---------------------------------------------
+    // remove the hole, adding back what is left on
+    // each side of the fragment
+    // ---------------------------------------------
+    old = *h;
+    f->holes--;
+    *h = f->hole[f->holes];
+
+    if(first > old.first) {
+        f->hole[f->holes].first = old.first;
+        f->hole[f->holes].last = first - 1;
+        f->holes++;
+    }
+    if(more && (last < old.last)) {
+        f->hole[f->holes].first = last + 1;
+        f->hole[f->holes].last = old.last;
+        f->holes++;
+    }
+    return FRAG_FILLED;
+}
+
+// ------------------------------------------------
+// Function:        frag_link()
+// ------------------------------------------------
+// Input:           Reassembly entry
+//                  Fragment buffer
+// Output:          -
+// ------------------------------------------------
+// Description:     Inserts the fragment into the
+//                  chain, ordered by offset
+// ------------------------------------------------
+static void frag_link(FRAG_ENTRY *f, PPBUF pbuf)
+{
+    PPBUF *p;
+    UInt16 offset;
+
+    offset = frag_offset(pbuf);
+    p = &f->head;
+    while((*p != NULL) && (frag_offset(*p) < offset)) p = &(*p)->next;
+    pbuf->next = *p;
+    *p = pbuf;
+}
+
+// ------------------------------------------------
+// Function:        ip_reassemble()
+// ------------------------------------------------
+// Input:           Fragment buffer (IP header
+//                  already removed)
+// Output:          -
+// ------------------------------------------------
+// Description:     Holds a received fragment.
+//                  When the datagram is complete
+//                  the chain of fragments is
+//                  delivered as a single message
+// ------------------------------------------------
+void ip_reassemble(PPBUF pbuf)
+{
+    FRAG_ENTRY *f;
+    UInt16 first, size;
+    BOOL more;
+
+    more = (NTOHS(IPH(BUF_START(pbuf))->frag) & IP_MF) != 0;
+    first = frag_offset(pbuf);
+    size = pbuf->size;
+
+    STAT_INC(ip.reasm_reqds);
+
+    // -------------------
+    // sanity and budget
+    // -------------------
+    if(pbuf->next != NULL) goto fail;                       // drivers deliver single frames
+    if(size == 0) goto fail;
+    if(more && (size & 7)) goto fail;                       // only the last one may be odd sized
+    if(((UInt32)first + size) > FRAG_SIZE) goto fail;       // datagram too large
+
+    f = frag_find(pbuf);
+    if(f == NULL) goto fail;
+
+    switch(frag_hole(f, first, first + size - 1, more)) {
+        case FRAG_REFUSED:
+            if(f->count == 0) frag_drop(f);
+            return;
+
+        case FRAG_FAILED:
+            frag_drop(f);
+            return;
+    }
+
+    if(f->holes && (frag_held >= FRAG_BUFFERS)) {
+        frag_drop(f);                                       // would starve the pool
+        return;
+    }
+
+    // -------------------------------------
+    // keep the fragment buffer in the chain
+    // -------------------------------------
+    retain_buffer(pbuf);
+    frag_link(f, pbuf);
+    f->count++;
+    frag_held++;
+
+    if(f->holes) return;                                    // still waiting
+
+    // -------------------------------------
+    // complete: deliver the chain, its head
+    // is the first fragment with its header
+    // -------------------------------------
+    pbuf = f->head;
+    frag_held -= f->count;
+    os_set((BYTE *)f, 0, sizeof(FRAG_ENTRY));
+
+    IPH(BUF_START(pbuf))->frag = 0;
+    STAT_INC(ip.reasm_oks);
+    ip_deliver(pbuf);
+    release_buffer(pbuf);
+    os_signal(SIG_MESSAGE);                                 // head may be behind the parser
+    return;
+
+fail:
+    STAT_INC(ip.reasm_fails);
+}
+
+// ------------------------------------------------
+// Function:        frag_expire()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Drops the datagrams not
+//                  completed in time. Called from
+//                  the Hermes thread
+// ------------------------------------------------
+void frag_expire(void)
+{
+    FRAG_ENTRY *f;
+    BYTE i;
+
+    if(!frag_due) return;
+    frag_due = FALSE;
+
+    f = frag_table;
+    for(i=0; i<FRAG_MAX; i++, f++) {
+        if(f->count == 0) continue;
+        if(EXPIRED(f->time)) frag_drop(f);
+    }
+}
+
+// ------------------------------------------------
+// Function:        frag_tick()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Callback timming function
+// ------------------------------------------------
+void frag_tick(void)
+{
+    frag_clock++;
+    if(frag_held) {
+        frag_due = TRUE;
+        os_signal(SIG_MESSAGE);
+    }
+    os_set_timer(TMR_FRAG, TICK_FRAG, CB_FRAG);
+}
+
+// ------------------------------------------------
+// Function:        frag_init()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Reassembly initialization
+// ------------------------------------------------
+void frag_init(void)
+{
+    os_set((BYTE *)frag_table, 0, sizeof(frag_table));
+    frag_held = 0;
+    frag_clock = 0;
+    frag_due = FALSE;
+
+    os_set_callback(CB_FRAG, frag_tick);
+    os_set_timer(TMR_FRAG, TICK_FRAG, CB_FRAG);
+}
+
+#endif
@@ -0,0 +1,35 @@
+// ---------------------------------------------
+// Datagrams being reassembled. The fragments are
+// kept in their own buffers, chained by offset,
+// so the complete datagram is delivered without
+// copying; the holes still missing are tracked
+// as in RFC 815
+// ---------------------------------------------
+typedef struct {
+    UInt16 first;
+    UInt16 last;
+} FRAG_HOLE;
+
+typedef struct {
+    IPV4 source;
+    IPV4 dest;
+    UInt16 id;
+    BYTE prot;
+    BYTE count;                                 // fragments held
+    UInt16 time;                                // expiry
+    BYTE holes;                                 // holes used
+    FRAG_HOLE hole[FRAG_HOLES];
+    PPBUF head;                                 // fragment chain
+} FRAG_ENTRY;
+
+typedef struct {
+    FRAG_ENTRY table[FRAG_MAX];
+    BYTE held;                                  // buffers held, all datagrams
+    volatile UInt16 clock;                      // time base (TICK_FRAG units)
+    volatile BOOL due;                          // expiry check pending
+} FRAG_STATE;
+
+void ip_reassemble(PPBUF pbuf);
+void frag_expire(void);
+void frag_tick(void);
+void frag_init(void);
@@ -12,9 +12,26 @@
 // Last Revision:   May 15, 2011
 // Revision ID:     6
 // -------------------------------------------------------
-// Functions:       get_buffer()
+// Functions:       quota_room()
+//                  quota_full()
+//                  rc_retain()
+//                  rc_release()
+//                  new_descriptor()
+//                  free_descriptor()
+//                  new_buffer()
+//                  get_buffer()
+//                  link_buffer()
+//                  quota_buffer()
+//                  push_header()
 //                  retain_buffer()
 //                  release_buffer()
+//                  slice_buffer()
+//                  clone_buffer()
+//                  const_buffer()
+//                  chain_buffer()
+//                  buffer_size()
+//                  write_seg()
+//                  read_seg()
 //                  write_byte()
 //                  write_word()
 //                  write_dword()
@@ -32,61 +49,499 @@
 //                  read_integer()
 //                  read_buf()
 //                  is_eof()
+//                  hermes_parse()
 //                  thread_mensagens()
+//                  hermes_select()
 //                  hermes_init()
 // -------------------------------------------------------
 
+#define __HERMES_POOL__                             // defines the buffer functions
 #include <stdlib.h>
 #include "defs.h"
 #include "net.h"
 #include "cronos.h"
 #include "hermes.h"
 
-// ----------------------------
-// buffer static data structure
-// ----------------------------
-TBUFFER buffers[NUM_BUFFERS];
+// ----------------------------------------
+// stack instances: the default one is used
+// until another is selected
+// ----------------------------------------
+static HERMES_STACK hermes_default;
+#ifndef _HOSTED
+HERMES_TLS HERMES_STACK *hermes = &hermes_default;
+#endif
 
-extern char *_string_buf;
+// ------------------------------------------
+// link header room reserved on each interface
+// ------------------------------------------
+static const BYTE link_headroom[MAX_INTERFACES] = {
+    [INTERFACE_PPP] = (HEADROOM_PPP + 3) & ~3,
+    [INTERFACE_ETH] = (HEADROOM_ETH + 3) & ~3,
+    [INTERFACE_LOOP] = 0
+};
 
+#ifdef _QUOTAS
 // ------------------------------------------------
-// Function:        get_buffer()
+// descriptors kept for each class (QUOTA_...)
+// ------------------------------------------------
+static const BYTE quota_min[NUM_QUOTAS] = {
+    [QUOTA_CONTROL] = QUOTA_CONTROL_MIN,
+    [QUOTA_RX] = QUOTA_RX_MIN,
+    [QUOTA_TX] = 0
+};
+
+// ------------------------------------------------
+// Function:        quota_room()
+// ------------------------------------------------
+// Input:           Class (QUOTA_...)
+// Output:          TRUE if the class may take a
+//                  descriptor
+// ------------------------------------------------
+// Description:     A class takes a descriptor only
+//                  if the free ones still cover
+//                  what the other classes have
+//                  reserved and not yet used. The
+//                  stack is locked
+// ------------------------------------------------
+static BOOL quota_room(BYTE quota)
+{
+    BYTE i, used, keep;
+
+    used = 0;
+    keep = 0;
+    for(i=0; i<NUM_QUOTAS; i++) {
+        used += hermes->quota[i];
+        if((i != quota) && (hermes->quota[i] < quota_min[i]))
+            keep += quota_min[i] - hermes->quota[i];
+    }
+    return (NUM_BUFFERS - used) > keep;
+}
+
+// ------------------------------------------------
+// Function:        quota_full()
+// ------------------------------------------------
+// Input:           Socket (QUOTA_OWNER_...)
+// Output:          TRUE if it may take no more
+//                  buffers
+// ------------------------------------------------
+// Description:     Counts the buffers a socket
+//                  holds, received or to be sent,
+//                  against QUOTA_SOCKET_MAX
+// ------------------------------------------------
+BOOL quota_full(BYTE owner)
+{
+    BYTE i, n;
+    PPBUF p;
+
+    n = 0;
+    HERMES_LOCK();
+    p = buffers;
+    for(i=0; i<NUM_BUFFERS; i++, p++)
+        if((BUF_PROTOCOL(p) != BUFFER_EMPTY) && (p->owner == owner)) n++;
+    HERMES_UNLOCK();
+    if(n < QUOTA_SOCKET_MAX) return FALSE;
+    STAT_INC(buffer.socket_caps);
+    return TRUE;
+}
+#endif
+
+// ------------------------------------------------
+// Function:        rc_retain()
+// ------------------------------------------------
+// Input:           Buffer pointer
+// Output:          -
+// ------------------------------------------------
+// Description:     Takes one more reference. Other
+//                  workers (hosted) or interrupt
+//                  handlers (PIC) may hold the
+//                  same buffer meanwhile
+// ------------------------------------------------
+static void rc_retain(PPBUF b)
+{
+#ifdef _HOSTED
+    __atomic_add_fetch(&b->rc, 1, __ATOMIC_RELAXED);
+#else
+    WORD s;
+
+    irq_save(s);
+    b->rc++;
+    irq_restore(s);
+#endif
+}
+
+// ------------------------------------------------
+// Function:        rc_release()
+// ------------------------------------------------
+// Input:           Buffer pointer
+// Output:          Reference count before release
+// ------------------------------------------------
+// Description:     Drops one reference. A count
+//                  already zero is left untouched,
+//                  so only one caller ever sees 1
+//                  and frees the buffer
+// ------------------------------------------------
+static BYTE rc_release(PPBUF b)
+{
+    BYTE n;
+#ifdef _HOSTED
+
+    n = __atomic_load_n(&b->rc, __ATOMIC_RELAXED);
+    do {
+        if(n == 0) return 0;
+    } while(!__atomic_compare_exchange_n(&b->rc, &n, n - 1, TRUE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+#else
+    WORD s;
+
+    irq_save(s);
+    n = b->rc;
+    if(n != 0) b->rc = n - 1;
+    irq_restore(s);
+#endif
+    return n;
+}
+
+// ------------------------------------------------
+// Function:        new_descriptor()
+// ------------------------------------------------
+// Input:           Class (QUOTA_...)
+// Output:          Buffer pointer or NULL
+// ------------------------------------------------
+// Description:     Finds an unused buffer
+//                  descriptor and reserves it
+// ------------------------------------------------
+static PPBUF new_descriptor(BYTE quota)
+{
+    BYTE i;
+    PPBUF p;
+
+    HERMES_LOCK();
+#ifdef _QUOTAS
+    if(!quota_room(quota)) {
+        STAT_INC(buffer.quota_denials);
+        HERMES_UNLOCK();
+        return NULL;
+    }
+#endif
+    for(i=0; i<NUM_BUFFERS; i++) {
+            if(hermes->state[i] == BUFFER_EMPTY) {
+                hermes->state[i] = BUFFER_RESERVED;
+                p = &buffers[i];
+#ifdef _QUOTAS
+                p->quota = quota;
+                hermes->quota[quota]++;
+#endif
+                POOL_ALLOC(p);
+                HERMES_UNLOCK();
+                return p;
+            }
+    }
+    STAT_INC(buffer.no_descriptor);
+    HERMES_UNLOCK();
+    return NULL;
+}
+
+// ------------------------------------------------
+// Function:        free_descriptor()
+// ------------------------------------------------
+// Input:           Buffer pointer
+// Output:          -
+// ------------------------------------------------
+// Description:     Returns a descriptor to the
+//                  pool
+// ------------------------------------------------
+static void free_descriptor(PPBUF p)
+{
+    HERMES_LOCK();
+#ifdef _QUOTAS
+    hermes->quota[p->quota]--;
+#endif
+    os_set((BYTE *)p, 0, sizeof(TBUFFER));
+    BUF_PROTOCOL(p) = BUFFER_EMPTY;
+    POOL_FREE();
+    HERMES_UNLOCK();
+}
+
+// ------------------------------------------------
+// Function:        new_buffer()
 // ------------------------------------------------
 // Input:           Size to allocate
+//                  Class (QUOTA_...)
 // Output:          Buffer pointer or NULL
 // ------------------------------------------------
 // Description:     Allocates and returns a free
 //                  buffer
 // ------------------------------------------------
-PPBUF get_buffer(UInt16 size)
+static PPBUF new_buffer(UInt16 size, BYTE quota)
 {
-    BYTE i;
     BYTE *buf;
     PPBUF p;
 
     // ----------------------------
     // try to find an unused buffer
     // ----------------------------
-    p = buffers;
-    for(i=0; i<NUM_BUFFERS; i++,p++) {
-            if(p->protocol == BUFFER_EMPTY) break;
+    p = new_descriptor(quota);
+    if(p == NULL) {
+        POOL_FAIL(size);
+        return NULL;
     }
-    if(i >= NUM_BUFFERS) return NULL;
 
     // -----------------------------------------
     // alocates and initializes buffer structure
     // -----------------------------------------
     buf = (BYTE *)malloc(size);
-    if(buf == NULL) return NULL;
+    if(buf == NULL) {
+        STAT_INC(buffer.no_memory);
+        POOL_FAIL(size);
+        free_descriptor(p);
+        return NULL;
+    }
     p->rc = 1;
-    p->start = buf;
-    p->data = buf;
-    p->ptr = buf;
+    p->base = buf;
+    p->offset = 0;
+    p->pos = 0;
     p->size = 0;
-    p->protocol = BUFFER_RESERVED;
+    p->alloc = size;
+    p->next = NULL;
+    p->parent = 0;
+    p->room = 0;
+    BUF_PROTOCOL(p) = BUFFER_RESERVED;
+    LAT_STAMP(p);
+    STAT_INC(buffer.allocs);
+    return p;
+}
+
+// ------------------------------------------------
+// Function:        get_buffer()
+// ------------------------------------------------
+// Input:           Size to allocate
+// Output:          Buffer pointer or NULL
+// ------------------------------------------------
+// Description:     Allocates and returns a free
+//                  buffer, of the received frames
+//                  class
+// ------------------------------------------------
+PPBUF get_buffer(UInt16 size)
+{
+    return new_buffer(size, QUOTA_RX);
+}
+
+// ------------------------------------------------
+// Function:        link_buffer()
+// ------------------------------------------------
+// Input:           Size to allocate
+//                  Network interface ID
+// Output:          Buffer pointer or NULL
+// ------------------------------------------------
+// Description:     quota_buffer() for the received
+//                  frames class, as the drivers
+//                  use it
+// ------------------------------------------------
+PPBUF link_buffer(UInt16 size, BYTE interface)
+{
+    return quota_buffer(size, interface, QUOTA_RX);
+}
+
+// ------------------------------------------------
+// Function:        quota_buffer()
+// ------------------------------------------------
+// Input:           Size to allocate
+//                  Network interface ID
+//                  Class (QUOTA_...)
+// Output:          Buffer pointer or NULL
+// ------------------------------------------------
+// Description:     Allocates a buffer with room
+//                  for the interface link header
+//                  before the start pointer, which
+//                  is kept 4-byte aligned
+// ------------------------------------------------
+PPBUF quota_buffer(UInt16 size, BYTE interface, BYTE quota)
+{
+    PPBUF p;
+    BYTE room;
+
+    room = (interface < MAX_INTERFACES)? link_headroom[interface]: 0;
+    p = new_buffer(size + room, quota);
+    if(p == NULL) return NULL;
+
+    p->room = room;
+    p->offset = room;
+    p->pos = room;
+    p->alloc = size;
+    p->interface = interface;
     return p;
 }
 
+// ------------------------------------------------
+// Function:        push_header()
+// ------------------------------------------------
+// Input:           Buffer pointer
+//                  Header size
+// Output:          Header pointer or NULL
+// ------------------------------------------------
+// Description:     Moves the data pointer back to
+//                  prepend a lower layer header in
+//                  place, without copying
+// ------------------------------------------------
+BYTE *push_header(PPBUF b, UInt16 size)
+{
+    if(b == NULL) return NULL;
+    if(b->constant) return NULL;                                // read-only storage
+    if(b->parent != 0) {
+        if(b->offset < (size + b->room)) return NULL;           // shared storage, start is the limit
+    } else if(b->offset < size) return NULL;                    // no room left
+    b->offset -= size;
+    b->size += size;
+    return BUF_DATA(b);
+}
+
+// ------------------------------------------------
+// Function:        slice_buffer()
+// ------------------------------------------------
+// Input:           Buffer pointer
+//                  Offset from the data pointer
+//                  Size of the slice
+// Output:          Slice or NULL
+// ------------------------------------------------
+// Description:     Creates a read-only view of a
+//                  sub-range of the buffer (first
+//                  segment only), sharing its
+//                  storage without copying
+// ------------------------------------------------
+PPBUF slice_buffer(PPBUF b, UInt16 offset, UInt16 size)
+{
+    PPBUF p;
+    PPBUF root;
+
+    if(b == NULL) return NULL;
+    if(offset > b->size) return NULL;
+    if(size > (b->size - offset)) size = b->size - offset;
+
+    p = new_descriptor(QUOTA_OF(b));
+    if(p == NULL) {
+        POOL_FAIL(0);
+        return NULL;
+    }
+
+    // ----------------------------------------------
+    // storage is held by the owner of the allocation
+    // ----------------------------------------------
+    root = (b->parent != 0)? &buffers[b->parent - 1]: b;
+    rc_retain(root);
+
+    p->rc = 1;
+    p->parent = (root - buffers) + 1;
+    p->base = b->base;                                  // keeps access to lower layer headers
+    p->room = b->room;
+    p->offset = b->offset + offset;
+    p->pos = p->offset;
+    p->size = size;
+    p->alloc = 0;                                       // writes chain new segments
+    p->next = NULL;
+    p->interface = b->interface;
+    p->constant = b->constant;
+    BUF_PROTOCOL(p) = BUFFER_RESERVED;
+    QUOTA_COPY(p, b);
+    LAT_COPY(p, b);
+    return p;
+}
+
+// ------------------------------------------------
+// Function:        clone_buffer()
+// ------------------------------------------------
+// Input:           Buffer pointer
+// Output:          Clone or NULL
+// ------------------------------------------------
+// Description:     Creates a zero-copy view of the
+//                  whole buffer chain, one slice
+//                  per segment so that every view
+//                  keeps its own read pointer
+// ------------------------------------------------
+PPBUF clone_buffer(PPBUF b)
+{
+    PPBUF res;
+    PPBUF p;
+    PPBUF q;
+
+    res = NULL;
+    q = NULL;
+    while(b != NULL) {
+        p = slice_buffer(b, 0, b->size);
+        if(p == NULL) {
+            release_buffer(res);
+            return NULL;
+        }
+        if(q == NULL) res = p;
+        else q->next = p;
+        q = p;
+        b = b->next;
+    }
+    return res;
+}
+
+// ------------------------------------------------
+// Function:        const_buffer()
+// ------------------------------------------------
+// Input:           Immutable data (flash, static)
+//                  Data size
+//                  Checksum (check_block()), 0 to
+//                  sum it from the data
+// Output:          Buffer pointer or NULL
+// ------------------------------------------------
+// Description:     Makes a segment of data that
+//                  outlives the buffer, without
+//                  copying it. Chained after the
+//                  headers (chain_buffer()) it is
+//                  sent straight from its storage,
+//                  which is never written nor
+//                  freed
+// ------------------------------------------------
+PPBUF const_buffer(const BYTE *p, UInt16 size, UInt16 sum)
+{
+    PPBUF b;
+
+    b = new_descriptor(QUOTA_TX);
+    if(b == NULL) {
+        POOL_FAIL(0);
+        return NULL;
+    }
+    b->rc = 1;
+    b->base = (BYTE *)p;
+    b->offset = 0;
+    b->pos = 0;
+    b->size = size;
+    b->alloc = 0;                                       // writes chain new segments
+    b->sum = sum;
+    b->constant = 1;
+    b->next = NULL;
+    b->parent = 0;
+    b->room = 0;
+    LAT_STAMP(b);
+    return b;
+}
+
+// ------------------------------------------------
+// Function:        chain_buffer()
+// ------------------------------------------------
+// Input:           Buffer pointer
+//                  Segment (or chain) to append
+// Output:          -
+// ------------------------------------------------
+// Description:     Appends a segment to the end of
+//                  the chain, which takes over its
+//                  reference. Later writes go to a
+//                  new segment after it
+// ------------------------------------------------
+void chain_buffer(PPBUF b, PPBUF seg)
+{
+    if((b == NULL) || (seg == NULL)) return;
+    while(b->next != NULL) b = b->next;
+    b->next = seg;
+    while(seg != NULL) {
+        QUOTA_COPY(seg, b);
+        seg = seg->next;
+    }
+}
+
 // ------------------------------------------------
 // Function:        retain_buffer()
 // ------------------------------------------------
@@ -99,8 +554,8 @@ PPBUF get_buffer(UInt16 size)
 void retain_buffer(PPBUF b)
 {
     if(b == NULL) return;
-    b->rc++;
-    b->protocol = BUFFER_RESERVED;
+    rc_retain(b);
+    BUF_PROTOCOL(b) = BUFFER_RESERVED;
 }
 
 // ------------------------------------------------
@@ -111,33 +566,110 @@ void retain_buffer(PPBUF b)
 // ------------------------------------------------
 // Description:     Signals buffer release, freeing
 //                  memory if reference counter
-//                  reaches zero
+//                  reaches zero. Chained segments
+//                  are released with the buffer
 // ------------------------------------------------
 void release_buffer(PPBUF b)
 {
-    if(b == NULL) return;
+    PPBUF n;
+
+    while(b != NULL) {
+        // ----------------------------------------
+        // verify reference counter, the last
+        // reference frees (zero means already free)
+        // ----------------------------------------
+        if(rc_release(b) != 1) return;
 
-    // ------------------------
-    // verify reference counter
-    // ------------------------
-    if(b->rc > 1) b->rc--;
-    else if(b->rc == 1) {
         // -------------------
         // buffer can be freed
         // -------------------
-        if(b->start != NULL) free((void *)b->start);
-        os_set((BYTE *)b, 0, sizeof(TBUFFER));
+        n = b->next;
+        if(b->parent != 0) release_buffer(&buffers[b->parent - 1]);
+        else if((b->base != NULL) && !b->constant) free((void *)b->base);
+        free_descriptor(b);                         // back to the pool
+        b = n;
     }
 }	
 
 void crop_buffer(PPBUF b, UInt16 size)
 {
     if(b == NULL) return;
-    b->data += size;
+    b->offset += size;
     if(b->size) b->size -= size;
-    b->ptr = b->data;
+    b->pos = b->offset;
+    b->sum = 0;                                     // no longer the whole block
 }	
 
+// ------------------------------------------------
+// Function:        buffer_size()
+// ------------------------------------------------
+// Input:           Buffer pointer
+// Output:          Total size of the chain
+// ------------------------------------------------
+// Description:     Sums the sizes of all segments
+//                  chained to the buffer
+// ------------------------------------------------
+UInt16 buffer_size(PPBUF b)
+{
+    UInt16 res;
+
+    res = 0;
+    while(b != NULL) {
+        res += b->size;
+        b = b->next;
+    }
+    return res;
+}
+
+// ------------------------------------------------
+// Function:        write_seg()
+// ------------------------------------------------
+// Input:           Buffer pointer
+//                  Byte count to write
+// Output:          Segment to write or NULL
+// ------------------------------------------------
+// Description:     Returns the last segment of the
+//                  chain, appending a new one when
+//                  there is no room left
+// ------------------------------------------------
+static PPBUF write_seg(PPBUF buf, UInt16 n)
+{
+    PPBUF seg;
+
+    while(buf->next != NULL) buf = buf->next;
+    if((buf->pos + n) <= (buf->room + buf->alloc)) return buf;
+
+    // ---------------------------
+    // segment full, chain another
+    // ---------------------------
+    seg = new_buffer((n > SEGMENT_SIZE)? n: SEGMENT_SIZE, QUOTA_OF(buf));
+    if(seg == NULL) return NULL;
+    seg->interface = buf->interface;
+    QUOTA_COPY(seg, buf);
+    POOL_COPY(seg, buf);
+    buf->next = seg;
+    return seg;
+}
+
+// ------------------------------------------------
+// Function:        read_seg()
+// ------------------------------------------------
+// Input:           Buffer pointer
+// Output:          Segment to read
+// ------------------------------------------------
+// Description:     Returns the first segment of
+//                  the chain not completely read
+//                  (or the last one)
+// ------------------------------------------------
+static PPBUF read_seg(PPBUF buf)
+{
+    while(buf->next != NULL) {
+        if((buf->offset + buf->size) > buf->pos) break;
+        buf = buf->next;
+    }
+    return buf;
+}
+
 // ------------------------------------------------
 // Function:        write_...()
 // ------------------------------------------------
@@ -145,75 +677,120 @@ void crop_buffer(PPBUF b, UInt16 size)
 // Output:          -
 // ------------------------------------------------
 // Description:     Adds the value to the buffer's
-//                  current position
+//                  current position, chaining new
+//                  segments as needed
 // ------------------------------------------------
 void write_byte(PPBUF buf, BYTE b)
 {
     if(buf == NULL) return;
-    *buf->ptr++ = b;
+    buf = write_seg(buf, 1);
+    if(buf == NULL) return;
+    buf->base[buf->pos++] = b;
     buf->size++;
 }	
 
 void write_uint16(PPBUF buf, UInt16 w)
 {
+    BYTE *p;
+
     if(buf == NULL) return;
-    *buf->ptr++ = HIGH(w);
-    *buf->ptr++ = LOW(w);
+    buf = write_seg(buf, 2);
+    if(buf == NULL) return;
+    p = BUF_PTR(buf);
+    p[0] = HIGH(w);
+    p[1] = LOW(w);
+    buf->pos += 2;
     buf->size += 2;
 }
 
 void write_uint32(PPBUF buf, UInt32 w)
 {
+    BYTE *p;
+
+    if(buf == NULL) return;
+    buf = write_seg(buf, 4);
     if(buf == NULL) return;
-    *buf->ptr++ = ((BYTE *)&w)[3];
-    *buf->ptr++ = ((BYTE *)&w)[2];
-    *buf->ptr++ = ((BYTE *)&w)[1];
-    *buf->ptr++ = ((BYTE *)&w)[0];
+    p = BUF_PTR(buf);
+    p[0] = ((BYTE *)&w)[3];
+    p[1] = ((BYTE *)&w)[2];
+    p[2] = ((BYTE *)&w)[1];
+    p[3] = ((BYTE *)&w)[0];
+    buf->pos += 4;
     buf->size += 4;
 }
 
 void write_string(PPBUF buf, char *s)
 {
-    UInt16 i;
+    PPBUF seg;
+    UInt16 q;
 
     if(buf == NULL) return;
-    for(i=0; *s; i++)
-        *buf->ptr++ = *s++;
-    buf->size += i;
+    while(*s) {
+        seg = write_seg(buf, 1);
+        if(seg == NULL) return;
+        q = seg->room + seg->alloc;
+        while(*s && (seg->pos < q)) {
+            seg->base[seg->pos++] = *s++;
+            seg->size++;
+        }
+    }
 }	
 
 void write_stringP(PPBUF buf, char *s)
 {
-    UInt16 i;
+    PPBUF seg;
     BYTE *p;
+    BYTE i;
 
     if(buf == NULL) return;
-    p = buf->ptr++;
+    seg = write_seg(buf, 1);
+    if(seg == NULL) return;
+    p = BUF_PTR(seg);
+    seg->pos++;
+    seg->size++;
     for(i=0; *s; i++)
-        *buf->ptr++ = *s++;
-    buf->size += i+1;
+        write_byte(buf, *s++);
     *p = i;
 }	
 
 void write_ip(PPBUF buf, IPV4 ip)
 {
+    BYTE *p;
+
+    if(buf == NULL) return;
+    buf = write_seg(buf, 4);
     if(buf == NULL) return;
-    *buf->ptr++ = ip.b[0];
-    *buf->ptr++ = ip.b[1];
-    *buf->ptr++ = ip.b[2];
-    *buf->ptr++ = ip.b[3];
+    p = BUF_PTR(buf);
+    p[0] = ip.b[0];
+    p[1] = ip.b[1];
+    p[2] = ip.b[2];
+    p[3] = ip.b[3];
+    buf->pos += 4;
     buf->size += 4;
 }	
 
 void write_buf(PPBUF buf, BYTE *p, UInt16 size)
 {
+    PPBUF seg;
+    BYTE *q;
+    UInt16 n;
+
     if(buf == NULL) return;
-    buf->size += size;
     while(size) {
-        *buf->ptr = *p;
-        buf->ptr++;
-        p++;
-        size--;
+        seg = write_seg(buf, 1);
+        if(seg == NULL) return;
+        n = (seg->room + seg->alloc) - seg->pos;
+        if(n > size) n = size;
+        seg->size += n;
+        size -= n;
+        q = BUF_PTR(seg);
+        seg->pos += n;
+        while(n) {
+            *q = *p;
+            q++;
+            p++;
+            n--;
+        }
     }
 }	
 
@@ -234,17 +811,15 @@ void write_uuencode(PPBUF buf, BYTE *p, UInt16 size)
     if(buf == NULL) return;
     n = 0;
     while(size) {
-        *buf->ptr++ = uuencode(p[0] >> 2);
-        if(size > 1) *buf->ptr = uuencode((p[0] << 4) | (p[1] >> 4)); else *buf->ptr = '='; buf->ptr++;
-        if(size > 2) *buf->ptr = uuencode((p[1] << 2) | (p[2] >> 6)); else *buf->ptr = '='; buf->ptr++;
-        if(size > 3) *buf->ptr = uuencode(p[2]); else *buf->ptr = '='; buf->ptr++;
-        buf->size += 4;
+        write_byte(buf, uuencode(p[0] >> 2));
+        write_byte(buf, (size > 1)? uuencode((p[0] << 4) | (p[1] >> 4)): '=');
+        write_byte(buf, (size > 2)? uuencode((p[1] << 2) | (p[2] >> 6)): '=');
+        write_byte(buf, (size > 3)? uuencode(p[2]): '=');
         n += 4;
         if(n == 76) {
             n = 0;
-            *buf->ptr++ = '\r';
-            *buf->ptr++ = '\n';
-            buf->size += 2;
+            write_byte(buf, '\r');
+            write_byte(buf, '\n');
         }
         if(size > 3) size -= 3; else size = 0;
         p += 3;
@@ -253,24 +828,17 @@ void write_uuencode(PPBUF buf, BYTE *p, UInt16 size)
 
 void write_integer(PPBUF buf, UInt32 v, BYTE d)
 {
-    char *p;
+    char s[10];                                     // digits, least significant first
     BYTE n;
 
     if(buf == NULL) return;
-    p = _string_buf;
     n = 0;
     do {
-        *p++ = (v % 10) + '0';
-        n++;
+        s[n++] = (v % 10) + '0';
         v /= 10;
     } while(v);
-    for(; n<d; n++) *p++ = '0';
-    buf->size += n;
-    while(n) {
-        --p;
-        *buf->ptr++ = *p--;
-        n--;
-    }
+    for(; d>n; d--) write_byte(buf, '0');           // leading zeros
+    while(n) write_byte(buf, s[--n]);
 }	
 
 // ------------------------------------------------
@@ -280,6 +848,7 @@ void write_integer(PPBUF buf, UInt32 v, BYTE d)
 // Output:          TRUE if found
 // ------------------------------------------------
 // Description:     Tests the next buffer positions
+//                  (inside the current segment)
 //                  for the string
 // ------------------------------------------------
 BOOL compare_string(PPBUF buf, char *s)
@@ -288,14 +857,15 @@ BOOL compare_string(PPBUF buf, char *s)
     UInt16 i;
     if(buf == NULL) return FALSE;
     if(s == NULL) return FALSE;
-    p = buf->ptr;
+    buf = read_seg(buf);
+    p = BUF_PTR(buf);
     i = 0;
     while(*s) {
         if(*s != *p) return FALSE;
         s++; p++; i++;
         if(i > buf->size) return FALSE;
     }
-    buf->ptr = p;
+    buf->pos = p - buf->base;
     return TRUE;
 }
 
@@ -309,8 +879,18 @@ BOOL compare_string(PPBUF buf, char *s)
 // ------------------------------------------------
 void skip(PPBUF buf, UInt16 size)
 {
+    UInt16 n;
+
     if(buf == NULL) return;
-    buf->ptr += size;
+    for(;;) {
+        buf = read_seg(buf);
+        if(buf->next == NULL) break;
+        n = (buf->offset + buf->size) - buf->pos;
+        if(n >= size) break;
+        buf->pos += n;
+        size -= n;
+    }
+    buf->pos += size;
 }
 
 // ------------------------------------------------
@@ -327,13 +907,14 @@ void skip_string(PPBUF buf)
     BYTE *p;
     BYTE *q;
     if(buf == NULL) return;
-    p = buf->ptr;
-    q = buf->data + buf->size;
+    buf = read_seg(buf);
+    p = BUF_PTR(buf);
+    q = BUF_DATA(buf) + buf->size;
     while(*p) {
         p++;
         if(p >= q) break;
     }
-    buf->ptr = p+1;
+    buf->pos = (p - buf->base) + 1;
 }	
 
 // ------------------------------------------------
@@ -343,14 +924,16 @@ void skip_string(PPBUF buf)
 // Output:          value
 // ------------------------------------------------
 // Description:     Reads a value from the current
-//                  buffer pointer
+//                  buffer pointer, walking through
+//                  chained segments
 // ------------------------------------------------
 BYTE read_byte(PPBUF buf)
 {
     BYTE res;
     if(buf == NULL) return 0;
-    res = buf->ptr[0];
-    buf->ptr++;
+    buf = read_seg(buf);
+    res = buf->base[buf->pos];
+    buf->pos++;
     return res;
 }	
 
@@ -358,8 +941,8 @@ UInt16 read_uint16(PPBUF buf)
 {
     WORD res;
     if(buf == NULL) return 0;
-    res = WORDOF(buf->ptr[0], buf->ptr[1]);
-    buf->ptr += 2;
+    res = read_byte(buf);
+    res = WORDOF(res, read_byte(buf));
     return res;
 }	
 
@@ -367,11 +950,10 @@ UInt32 read_uint32(PPBUF buf)
 {
     _UInt32 res;
     if(buf == NULL) return 0;
-    res.b[3] = buf->ptr[0];
-    res.b[2] = buf->ptr[1];
-    res.b[1] = buf->ptr[2];
-    res.b[0] = buf->ptr[3];
-    buf->ptr += 4;
+    res.b[3] = read_byte(buf);
+    res.b[2] = read_byte(buf);
+    res.b[1] = read_byte(buf);
+    res.b[0] = read_byte(buf);
     return res.d;
 }	
 
@@ -381,11 +963,10 @@ IPV4 read_ip(PPBUF buf)
     if(buf == NULL)
         res.d = 0;
     else {
-        res.b[0] = buf->ptr[0];
-        res.b[1] = buf->ptr[1];
-        res.b[2] = buf->ptr[2];
-        res.b[3] = buf->ptr[3];
-        buf->ptr += 4;
+        res.b[0] = read_byte(buf);
+        res.b[1] = read_byte(buf);
+        res.b[2] = read_byte(buf);
+        res.b[3] = read_byte(buf);
     }
     return res;
 }	
@@ -397,8 +978,9 @@ UInt32 read_integer(PPBUF buf)
     UInt32 res;
 
     if(buf == NULL) return 0;
-    p = buf->ptr;
-    q = buf->data + buf->size;
+    buf = read_seg(buf);
+    p = BUF_PTR(buf);
+    q = BUF_DATA(buf) + buf->size;
     res = 0;
 
     // ---------------------------------
@@ -419,17 +1001,30 @@ UInt32 read_integer(PPBUF buf)
         p++;
     }
 
-    buf->ptr = p;
+    buf->pos = p - buf->base;
     return res;
 }	
 
 void read_buf(PPBUF buf, BYTE *p, UInt16 size)
 {
+    PPBUF seg;
+    BYTE *q;
+    UInt16 n;
+
+    if(buf == NULL) return;
     while(size) {
-        *p = *buf->ptr;
-        p++;
-        buf->ptr++;
-        size--;
+        seg = read_seg(buf);
+        n = (seg->offset + seg->size) - seg->pos;
+        if((n > size) || (seg->next == NULL)) n = size;
+        size -= n;
+        q = BUF_PTR(seg);
+        seg->pos += n;
+        while(n) {
+            *p = *q;
+            p++;
+            q++;
+            n--;
+        }
     }
 }
 
@@ -445,10 +1040,97 @@ void read_buf(PPBUF buf, BYTE *p, UInt16 size)
 BOOL is_eof(PPBUF buf)
 {
     if(buf == NULL) return TRUE;
-    if((buf->data + buf->size) > buf->ptr) return FALSE;
+    buf = read_seg(buf);
+    if((buf->offset + buf->size) > buf->pos) return FALSE;
     return TRUE;
 }	
 
+// ------------------------------------------------
+// Function:        hermes_parse()
+// ------------------------------------------------
+// Input:           Message buffer
+// Output:          -
+// ------------------------------------------------
+// Description:     Runs a message through the
+//                  protocol layers until it is
+//                  consumed. Drivers replaying
+//                  traffic may call it directly,
+//                  with the stack locked
+// ------------------------------------------------
+void hermes_parse(PPBUF p)
+{
+    for(;;) {
+        if(BUF_PROTOCOL(p) == BUFFER_EMPTY) break;
+        if(BUF_PROTOCOL(p) == BUFFER_RESERVED) break;
+        switch(BUF_PROTOCOL(p)) {
+#ifdef _PPP
+            case BUFFER_MODEM:
+                BUF_PROTOCOL(p) = BUFFER_RESERVED;
+                modem_parse(p);
+                break;
+
+            case BUFFER_PPP_LCP:
+                BUF_PROTOCOL(p) = BUFFER_RESERVED;
+                lcp_parse(p);
+                break;
+
+            case BUFFER_PPP_PAP:
+                BUF_PROTOCOL(p) = BUFFER_RESERVED;
+                pap_parse(p);
+                break;
+
+            case BUFFER_PPP_IPCP:
+                BUF_PROTOCOL(p) = BUFFER_RESERVED;
+                ipcp_parse(p);
+                break;
+#endif
+            case BUFFER_IP:
+                BUF_PROTOCOL(p) = BUFFER_RESERVED;
+                LAT_MARK(p, LAT_RX_QUEUE);
+                parse_ip(p);
+                break;
+
+            case BUFFER_ICMP:
+                BUF_PROTOCOL(p) = BUFFER_RESERVED;
+                icmp_parse(p);
+                break;
+#ifdef _UDP
+            case BUFFER_UDP:
+                BUF_PROTOCOL(p) = BUFFER_RESERVED;
+#ifdef _SHARDS
+                shard_steer(p);             // the worker releases it
+                return;
+#endif
+                parse_udp(p);
+                break;
+#endif
+#ifdef _TCP
+            case BUFFER_TCP:
+                BUF_PROTOCOL(p) = BUFFER_RESERVED;
+#ifdef _SHARDS
+                shard_steer(p);
+                return;
+#endif
+                parse_tcp(p);
+                break;
+#endif
+#ifdef _ETH
+            case BUFFER_ARP:
+                BUF_PROTOCOL(p) = BUFFER_RESERVED;
+                arp_parse(p);
+                break;
+#endif
+#ifdef _NAT
+            case BUFFER_NAT_TCP:
+                BUF_PROTOCOL(p) = BUFFER_RESERVED;
+                nat_parse(p);
+                break;
+#endif
+        }
+        release_buffer(p);
+    }
+}
+
 // ------------------------------------------------
 // Function:        hermes_thread()
 // ------------------------------------------------
@@ -468,71 +1150,17 @@ void hermes_thread(void)
         // wait for a message
         // ------------------
         os_wait(SIG_MESSAGE);
-
-        p = buffers;
-        for(i=0; i<NUM_BUFFERS; i++, p++) {
-            for(;;) {
-                if(p->protocol == BUFFER_EMPTY) break;
-                if(p->protocol == BUFFER_RESERVED) break;
-                switch(p->protocol) {
-#ifdef _PPP
-                    case BUFFER_MODEM:
-                        p->protocol = BUFFER_RESERVED;
-                        modem_parse(p);
-                        break;
-
-                    case BUFFER_PPP_LCP:
-                        p->protocol = BUFFER_RESERVED;
-                        lcp_parse(p);
-                        break;
-
-                    case BUFFER_PPP_PAP:
-                        p->protocol = BUFFER_RESERVED;
-                        pap_parse(p);
-                        break;
-
-                    case BUFFER_PPP_IPCP:
-                        p->protocol = BUFFER_RESERVED;
-                        ipcp_parse(p);
-                        break;
-#endif
-                    case BUFFER_IP:
-                        p->protocol = BUFFER_RESERVED;
-                        ip_parse(p);
-                        break;
-
-                    case BUFFER_ICMP:
-                        p->protocol = BUFFER_RESERVED;
-                        icmp_parse(p);
-                        break;
-#ifdef _UDP
-                    case BUFFER_UDP:
-                        p->protocol = BUFFER_RESERVED;
-                        udp_parse(p);
-                        break;
-#endif
-#ifdef _TCP
-                    case BUFFER_TCP:
-                        p->protocol = BUFFER_RESERVED;
-                        tcp_parse(p);
-                        break;
-#endif
+        HERMES_LOCK();
 #ifdef _ETH
-                    case BUFFER_ARP:
-                        p->protocol = BUFFER_RESERVED;
-                        arp_parse(p);
-                        break;
+        arp_retry();                                // pending ARP requests
 #endif
-#ifdef _NAT
-                    case BUFFER_NAT_TCP:
-                        p->protocol = BUFFER_RESERVED;
-                        nat_parse(p);
-                        break;
+#ifdef _IP_FRAG
+        frag_expire();                              // stale fragments
 #endif
-                }
-                release_buffer(p);
-            }
-        }
+
+        for(i=0; i<NUM_BUFFERS; i++)                // protocol array only, most are idle
+            if(hermes->state[i] > BUFFER_RESERVED) hermes_parse(&buffers[i]);
+        HERMES_UNLOCK();
     }
 
     // ---------------
@@ -546,6 +1174,24 @@ void hermes_thread(void)
     }
 }
 
+// ------------------------------------------------
+// Function:        hermes_select()
+// ------------------------------------------------
+// Input:           Stack instance
+// Output:          -
+// ------------------------------------------------
+// Description:     Makes the calling thread work
+//                  on a stack instance
+// ------------------------------------------------
+void hermes_select(HERMES_STACK *s)
+{
+#ifdef _HOSTED
+    os_enter(s);                                    // the executive keeps it
+#else
+    hermes = s;
+#endif
+}
+
 // ------------------------------------------------
 // Function:        hermes_init()
 // ------------------------------------------------
@@ -553,11 +1199,27 @@ void hermes_thread(void)
 // Output:          -
 // ------------------------------------------------
 // Description:     Communication initialization
+//                  of the current stack instance
 // ------------------------------------------------
 void hermes_init(void)
 {
+#ifdef _SHARDS
+    BYTE i;
+
+#endif
 //	inicia_rand();
+#ifdef _HOSTED
+    if(hermes == NULL) hermes_select(&hermes_default);
+#endif
+    os_set((BYTE *)hermes, 0, sizeof(HERMES_STACK));
+#ifdef _SHARDS
+    shard_init();
+#endif
     ip_init();
+    route_init();
+#ifdef _IP_FRAG
+    frag_init();
+#endif
 #ifdef _ETH
     eth_init();
     arp_init();
@@ -582,13 +1244,15 @@ void hermes_init(void)
 #ifdef _NAT
     nat_init();
 #endif
-    // -----------------
-    // clean buffer area
-    // -----------------
-    os_set((BYTE *)buffers, 0, sizeof(buffers));
-
+#ifdef _PT
+    pt_init();
+#endif
     // -------------------
     // start hermes thread
     // -------------------
     os_start(THRD_HERMES, hermes_thread, HERMES_STACK_SIZE);
+#ifdef _SHARDS
+    for(i=0; i<NUM_SHARDS; i++)
+        os_start(THRD_SHARD + i, shard_thread, SHARD_STACK_SIZE);
+#endif
 }
@@ -2,19 +2,65 @@
 #include "hermes_config.h"
 #endif
 
-typedef struct {
+// ------------------------------------------------
+// Message buffer. Payloads larger than one block
+// are built as a chain of segments linked by next,
+// each one with its own size; link drivers must
+// send every segment of the chain, prepending
+// their own header inside the room reserved
+// before start (push_header). Slices share
+// the storage of their parent buffer, which is
+// kept alive by its reference count
+// ------------------------------------------------
+typedef struct _TBUFFER {
+	BYTE *base;								// storage, link header room first
+	struct _TBUFFER *next;					// next segment of the chain
+	UInt16 offset;							// data, from base
+	UInt16 pos;								// read/write pointer, from base
+	UInt16 size;							// segment size
+	UInt16 alloc;							// allocated block size, from start
+	UInt16 sum;								// checksum of constant storage, 0 if not known
 	struct {
-		unsigned protocol: 6;
-		unsigned interface: 2;
+		UInt16 interface: 2;
+		UInt16 constant: 1;					// storage not owned (const_buffer()), never written nor freed
+#ifdef _QUOTAS
+		UInt16 quota: 2;					// reservation class (QUOTA_...)
+		UInt16 owner: 6;					// socket holding it (QUOTA_OWNER_...), 0 if none
+#endif
 	};
 	BYTE rc;
-	UInt16 size;
-	BYTE *start;
-	BYTE *data;
-	BYTE *ptr;
+	BYTE room;								// start, from base (link header room)
+	BYTE parent;							// storage owner (slices only), pool index + 1
+#ifdef _LATENCY
+	UInt32 born;							// LAT_CLOCK() at allocation or send
+	UInt32 mark;							// LAT_CLOCK() at the last layer boundary
+#endif
+#ifdef _POOL_DEBUG
+	const char *file;						// last taken or retained at (pool_dump())
+	UInt16 line;
+	UInt32 taken;							// pool allocation count then
+#endif
 } TBUFFER;	
 #define PPBUF TBUFFER *
 
+// ------------------------------------------------
+// The descriptor keeps a single storage pointer:
+// start (past the link header room), data and the
+// read/write pointer are offsets from it. The
+// protocol of each buffer (BUFFER_...) is kept
+// apart, one byte per descriptor in the stack, so
+// the dispatcher and the allocator scan a short
+// array instead of the descriptors
+// ------------------------------------------------
+#define BUF_START(b)			((b)->base + (b)->room)
+#define BUF_DATA(b)				((b)->base + (b)->offset)
+#define BUF_PTR(b)				((b)->base + (b)->pos)
+#define BUF_PROTOCOL(b)			(hermes->state[(b) - buffers])
+
+#if NUM_BUFFERS > 255
+#error "Too many buffers for the parent index"
+#endif
+
 #define BUFFER_EMPTY			0
 #define BUFFER_RESERVED			1
 #define BUFFER_IP				2
@@ -29,6 +75,52 @@ typedef struct {
 #define BUFFER_ARP				11
 #define BUFFER_NAT_TCP			12
 
+// ------------------------------------------------
+// Reservation classes: QUOTA_..._MIN descriptors
+// are kept for each class, the rest is shared.
+// get_buffer() and link_buffer() take from the
+// received frames class, as the drivers use them
+// ------------------------------------------------
+#define QUOTA_CONTROL			0			// ACKs, resets, ARP and ping requests
+#define QUOTA_RX				1			// received frames
+#define QUOTA_TX				2			// data to send
+#define NUM_QUOTAS				3
+
+#define QUOTA_OWNER_TCP(n)		(1 + (n))
+#define QUOTA_OWNER_UDP(n)		(1 + MAX_SOCKETS_TCP + (n))
+
+#ifdef _QUOTAS
+#if (1 + MAX_SOCKETS_TCP + MAX_SOCKETS_UDP) > 63
+#error "Too many sockets for the buffer owner field"
+#endif
+#define QUOTA_OF(b)				((b)->quota)
+#define QUOTA_COPY(d, s)		((d)->owner = (s)->owner)
+#define QUOTA_OWN(b, o)			((b)->owner = (o))
+#define QUOTA_FULL(o)			quota_full(o)
+#else
+#define QUOTA_OF(b)				QUOTA_RX
+#define QUOTA_COPY(d, s)
+#define QUOTA_OWN(b, o)
+#define QUOTA_FULL(o)			FALSE
+#endif
+
+#ifdef _SHARDS
+#include "shard.h"
+#define HERMES_LOCK()					shard_lock()
+#define HERMES_UNLOCK()					shard_unlock()
+#define HERMES_SLOTS					(NUM_SHARDS + 1)	// counters kept per worker, slot 0
+#define HERMES_SLOT						((shard_id == SHARD_NONE)? 0: shard_id + 1)	// for the other threads
+#else
+#define HERMES_LOCK()
+#define HERMES_UNLOCK()
+#define HERMES_SLOTS					1
+#define HERMES_SLOT						0
+#endif
+
+#ifdef _PT
+#include "pt.h"
+#endif
+
 #ifdef _PPP
 #include "ppp.h"
 #include "uart_ppp.h"
@@ -40,16 +132,21 @@ typedef struct {
 #include "arp.h"
 #endif
 
-#ifdef _TCP
 #include "ip.h"
+#include "route.h"
+
+#ifdef _TCP
 #include "tcp.h"
 #endif
 
 #ifdef _UDP
-#include "ip.h"
 #include "udp.h"
 #endif
 
+#ifdef _IP_FRAG
+#include "frag.h"
+#endif
+
 #ifdef _DHCP
 #include "dhcp.h"
 #endif
@@ -70,10 +167,110 @@ typedef struct {
 #include "nat.h"
 #endif
 
+#ifdef _STATS
+#include "stats.h"
+#else
+#define STAT_INC(xxx)
+#endif
+
+#ifdef _LATENCY
+#include "latency.h"
+#else
+#define LAT_STAMP(b)
+#define LAT_COPY(d, s)
+#define LAT_MARK(b, point)
+#define LAT_SPAN(b, point)
+#endif
+
+#ifdef _POOL_DEBUG
+#include "pool.h"
+#else
+#define POOL_ALLOC(b)
+#define POOL_FREE()
+#define POOL_FAIL(size)
+#define POOL_COPY(d, s)
+#endif
+
+// ------------------------------------------------
+// Stack instance. Every mutable protocol variable
+// lives here, so several stacks may run side by
+// side; the protocol code always works on the
+// one pointed by hermes, which the threads of an
+// instance select with hermes_select(). Scratch
+// values living only during a call (checksum
+// accumulator, socket being handled) are kept
+// per thread instead
+// ------------------------------------------------
+typedef struct {
+	BYTE state[NUM_BUFFERS];				// protocol of each buffer (BUFFER_...)
+	TBUFFER pool[NUM_BUFFERS];				// message buffers
+	IP_STATE ip;
+	ROUTE_STATE route;
+#ifdef _ETH
+	ARP_STATE arp;
+#endif
+#ifdef _IP_FRAG
+	FRAG_STATE frag;
+#endif
+#ifdef _TCP
+	TCP_STATE tcp;
+#endif
+#ifdef _UDP
+	UDP_STATE udp;
+#endif
+#ifdef _DHCP
+	DHCP_STATE dhcp;
+#endif
+#ifdef _DNS
+	DNS_STATE dns;
+#endif
+#ifdef _SMTP
+	SMTP_STATE smtp;
+#endif
+#ifdef _PT
+	PT_STATE pt;
+#endif
+#ifdef _ETH_STATE
+	ETH_STATE eth;							// driver kept per stack (hosted)
+#endif
+#ifdef _SHARDS
+	SHARD_STATE shard;
+#endif
+#ifdef _STATS
+	STATS stats[HERMES_SLOTS];				// protocol counters
+#endif
+#ifdef _LATENCY
+	LATENCY latency[HERMES_SLOTS];			// latency histograms
+#endif
+#ifdef _POOL_DEBUG
+	POOL_STATE usage;						// buffer pool usage
+#endif
+#ifdef _QUOTAS
+	BYTE quota[NUM_QUOTAS];					// descriptors in use by each class
+#endif
+} HERMES_STACK;
+
+#ifdef _HOSTED
+extern __thread void *os_domain;			// kept by the executive for each thread,
+#define hermes							((HERMES_STACK *)os_domain)	// inherited by os_start()
+#else
+extern HERMES_TLS HERMES_STACK *hermes;		// current stack
+#endif
+#define buffers							(hermes->pool)
+
 PPBUF get_buffer(UInt16 tam);
+PPBUF link_buffer(UInt16 tam, BYTE interface);
+PPBUF quota_buffer(UInt16 tam, BYTE interface, BYTE quota);
+BOOL quota_full(BYTE owner);
+BYTE *push_header(PPBUF b, UInt16 tam);
 void retain_buffer(PPBUF b);
 void release_buffer(PPBUF b);
 void crop_buffer(PPBUF b, UInt16 tam);
+UInt16 buffer_size(PPBUF b);
+PPBUF slice_buffer(PPBUF b, UInt16 offset, UInt16 size);
+PPBUF clone_buffer(PPBUF b);
+PPBUF const_buffer(const BYTE *p, UInt16 size, UInt16 sum);
+void chain_buffer(PPBUF b, PPBUF seg);
 void write_byte(PPBUF buf, BYTE b);
 void write_uint16(PPBUF buf, UInt16 w);
 void write_uint32(PPBUF buf, UInt32 w);
@@ -93,4 +290,20 @@ IPV4 read_ip(PPBUF buf);
 UInt32 read_integer(PPBUF buf);
 void read_buf(PPBUF buf, BYTE *p, UInt16 size);
 BOOL is_eof(PPBUF buf);
+void hermes_parse(PPBUF p);
+void hermes_select(HERMES_STACK *s);
 void hermes_init(void);
+
+// ------------------------------------------------
+// With _POOL_DEBUG, buffers taken or retained
+// outside the pool code record where it was done
+// ------------------------------------------------
+#if defined(_POOL_DEBUG) && !defined(__HERMES_POOL__)
+#define get_buffer(size)				pool_tag(get_buffer(size), __FILE__, __LINE__)
+#define link_buffer(size, i)			pool_tag(link_buffer(size, i), __FILE__, __LINE__)
+#define quota_buffer(size, i, q)		pool_tag(quota_buffer(size, i, q), __FILE__, __LINE__)
+#define slice_buffer(b, o, size)		pool_tag(slice_buffer(b, o, size), __FILE__, __LINE__)
+#define clone_buffer(b)					pool_tag(clone_buffer(b), __FILE__, __LINE__)
+#define const_buffer(p, size, sum)		pool_tag(const_buffer(p, size, sum), __FILE__, __LINE__)
+#define retain_buffer(b)				pool_retain(b, __FILE__, __LINE__)
+#endif
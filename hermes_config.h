@@ -1,12 +1,17 @@
+#define __HERMES_CONFIG__
+
 // ------------------
 // network interfaces
 // ------------------
 #define _ETH
 //#define _PPP
+#define _LOOP                                   // loopback (127.0.0.0/8 and own addresses)
 
-#define MAX_INTERFACES                  2
+#define MAX_INTERFACES                  3
 #define INTERFACE_PPP                   0
 #define INTERFACE_ETH                   1
+#define INTERFACE_LOOP                  2
+#define INTERFACE_AUTO                  0xff    // let the routing table choose
 
 // ----------------
 // protocols to use
@@ -18,6 +23,12 @@
 #define _DNS
 #define _SMTP
 //#define _NAT
+//#define _PT                                  // stackless coroutine API
+#define _IP_FRAG                                // IP fragment reassembly
+//#define _STATS                                // protocol counters (stats_snapshot())
+//#define _LATENCY                              // per-layer latency histograms (lat_snapshot())
+//#define _POOL_DEBUG                           // buffer owners and pool usage (pool_dump())
+#define _QUOTAS                                 // buffers reserved by traffic class, socket caps
 
 // ------------------
 // PPP configurations
@@ -57,6 +68,27 @@
 #define SOCKET_SMTP                     3
 #define SIG_TCP                         20      // first TCP socket signal
 
+// ----------------------
+// IP routing configuration
+// ----------------------
+#define MAX_ROUTES                      4       // static routes
+#define ROUTE_CACHE_SIZE                8       // next hop cache entries (power of 2)
+#define MTU_ETH                         1500
+#define MTU_PPP                         1500    // peer MRU
+#define MTU_LOOP                        0xffff
+#define PMTU_MIN                        296     // lowest path MTU accepted from ICMP
+
+// -------------------------------
+// IP fragment reassembly configuration
+// -------------------------------
+#define FRAG_MAX                        2       // datagrams reassembled at once
+#define FRAG_HOLES                      4       // holes tracked per datagram
+#define FRAG_BUFFERS                    (NUM_BUFFERS / 2)   // pool buffers fragments may hold
+#define FRAG_SIZE                       2048    // largest datagram accepted
+#define FRAG_TIMEOUT                    4000    // reassembly time limit (ms)
+#define CB_FRAG                         2
+#define TMR_FRAG                        2
+
 // ------------------
 // ICMP configuration
 // ------------------
@@ -66,14 +98,79 @@
 // ARP configuration
 // -----------------
 #define MAX_CACHE_ARP                   8
+#define ARP_HASH_SIZE                   8       // hash buckets (power of 2)
+#define ARP_QUEUE                       2       // packets held per unresolved address
+#define ARP_SNOOP                       1       // learn from received traffic (ARP_SNOOP_...)
+#define ARP_SNOOP_OFF                   0
+#define ARP_SNOOP_SAFE                  1       // never replace or evict confirmed entries
+#define ARP_SNOOP_TRUST                 2       // replace any entry
 #define CB_ARP                          0
 #define TMR_ARP                         0
-#define SIG_ARP                         2
+
+// -----------------------
+// Coroutine configuration
+// -----------------------
+#define MAX_PT                          8       // simultaneous coroutines
+#define PT_TICK                         10      // scheduler clock (ms)
+#define THRD_PT                         1       // scheduler thread ID
+#define PT_STACK_SIZE                   300     // stack size for the scheduler
+#define CB_PT                           1
+#define TMR_PT                          1
+#define SIG_PT                          3
+
+// ---------------------------------
+// Latency histograms configuration
+// ---------------------------------
+#define LAT_BUCKETS                     24      // log2 buckets of clock ticks
+#ifdef _HOSTED
+#define LAT_CLOCK()                     lat_clock()         // microseconds
+#else
+#define LAT_CLOCK()                     _CP0_GET_COUNT()    // PIC32 core timer (half SYSCLK)
+#endif
+
+// -------------------------------------
+// Sharded processing (hosted builds only)
+// -------------------------------------
+//#define _SHARDS                               // TCP/UDP parsed by worker threads
+#define NUM_SHARDS                      4       // worker threads
+#define SHARD_QUEUE                     64      // receive queue of each worker (power of 2)
+#define THRD_SHARD                      2       // first worker thread ID
+#define SHARD_STACK_SIZE                300     // stack size for each worker
+#define SIG_SHARD                       4       // first worker signal
+
+// -------------------------------------
+// Virtual wire (hosted builds only)
+// -------------------------------------
+#define WIRE_PORTS                      8       // stacks or peers on one wire
+#define THRD_WIRE                       6       // receiver thread ID
+#define SIG_WIRE                        8       // frames queued for the port
 
 // --------------------
 // Hermes configuration
 // --------------------
+#ifdef _HOSTED
+#define NUM_BUFFERS                     64      // hosts: room for links with delay
+#else
 #define NUM_BUFFERS                     4
+#endif
+#define SEGMENT_SIZE                    128     // size of chained buffer segments
+#define POOL_CLASSES                    8       // allocation failure counters (pool_class())
+#define QUOTA_CONTROL_MIN               1       // kept for ACKs, ARP and ping requests
+#define QUOTA_RX_MIN                    1       // kept for the drivers
+#ifdef _HOSTED
+#define QUOTA_SOCKET_MAX                16      // buffers one socket may hold
+#else
+#define QUOTA_SOCKET_MAX                2
+#endif
+#define HEADROOM_PPP                    4       // link header room reserved by ip_new() (multiple of 4)
+#define HEADROOM_ETH                    16      // 14 bytes header + 2 bytes to align the IP header
+//#define _ALIGNED_HDR                          // 4-byte aligned IP/TCP headers: drivers must
+                                                // also deliver received IP headers aligned
 #define THRD_HERMES                     0       // Hermes main thread ID
 #define HERMES_STACK_SIZE               300     // stack size for Hermes
 #define SIG_MESSAGE                     0       // Signal ID to awake Hermes main thread
+#ifdef _HOSTED
+#define HERMES_TLS                      __thread // scratch values kept per thread
+#else
+#define HERMES_TLS                              // single executive: plain globals
+#endif
@@ -0,0 +1,546 @@
+// -------------------------------------------------------
+// File:            CAPTURE.C
+// Project:         Hermes
+// Description:     pcap/pcapng replay and pcap capture
+// Author:          Bruno Abrantes Basseto
+//                  bruno.basseto@uol.com.br
+// Target CPU:      x86 / ARM hosts
+// Compiler:        GCC
+// -------------------------------------------------------
+// Functions:       capture_rd32()
+//                  capture_rd16()
+//                  capture_open()
+//                  capture_options()
+//                  capture_next()
+//                  capture_rewind()
+//                  capture_replay()
+//                  capture_close()
+//                  capture_put()
+//                  capture_writer()
+//                  capture_tap_open()
+//                  capture_tap()
+//                  capture_tap_close()
+// -------------------------------------------------------
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "defs.h"
+#include "net.h"
+#include "cronos.h"
+#include "hermes.h"
+#include "capture.h"
+
+#define PCAP_MAGIC                      0xa1b2c3d4
+#define PCAP_MAGIC_NS                   0xa1b23c4d
+#define PCAPNG_SHB                      0x0a0d0d0a
+#define PCAPNG_BOM                      0x1a2b3c4d
+#define PCAPNG_IDB                      1
+#define PCAPNG_SPB                      3
+#define PCAPNG_EPB                      6
+#define CAPTURE_SNAP                    65535
+
+// ------------------------------------------------
+// Function:        capture_rd32()
+// ------------------------------------------------
+// Input:           File
+//                  Field pointer
+// Output:          Field value
+// ------------------------------------------------
+// Description:     Reads a 32-bit field in the byte
+//                  order of the file
+// ------------------------------------------------
+static UInt32 capture_rd32(CAPTURE_FILE *f, BYTE *p)
+{
+    UInt32 v;
+
+    memcpy(&v, p, sizeof(v));
+    if(f->swapped) v = __builtin_bswap32(v);
+    return v;
+}
+
+// ------------------------------------------------
+// Function:        capture_rd16()
+// ------------------------------------------------
+// Input:           File
+//                  Field pointer
+// Output:          Field value
+// ------------------------------------------------
+// Description:     Reads a 16-bit field in the byte
+//                  order of the file
+// ------------------------------------------------
+static UInt16 capture_rd16(CAPTURE_FILE *f, BYTE *p)
+{
+    UInt16 v;
+
+    memcpy(&v, p, sizeof(v));
+    if(f->swapped) v = __builtin_bswap16(v);
+    return v;
+}
+
+// ------------------------------------------------
+// Function:        capture_open()
+// ------------------------------------------------
+// Input:           File
+//                  Path
+// Output:          TRUE if succesful
+// ------------------------------------------------
+// Description:     Maps a pcap or pcapng file
+// ------------------------------------------------
+BOOL capture_open(CAPTURE_FILE *f, char *path)
+{
+    struct stat st;
+    UInt32 magic;
+    int fd;
+
+    memset(f, 0, sizeof(CAPTURE_FILE));
+    fd = open(path, O_RDONLY);
+    if(fd < 0) return FALSE;
+    if((fstat(fd, &st) < 0) || (st.st_size < 24)) {
+        close(fd);
+        return FALSE;
+    }
+    f->length = st.st_size;
+    f->map = (BYTE *)mmap(NULL, f->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(f->map == MAP_FAILED) {
+        f->map = NULL;
+        return FALSE;
+    }
+    madvise(f->map, f->length, MADV_SEQUENTIAL);
+
+    memcpy(&magic, f->map, sizeof(magic));
+    switch(magic) {
+        case PCAPNG_SHB:
+            f->ng = TRUE;                                   // order set by each section
+            break;
+
+        case PCAP_MAGIC_NS:
+            f->nano = TRUE;
+        case PCAP_MAGIC:
+            break;
+
+        default:
+            magic = __builtin_bswap32(magic);
+            if((magic != PCAP_MAGIC) && (magic != PCAP_MAGIC_NS)) {
+                capture_close(f);
+                return FALSE;
+            }
+            f->swapped = TRUE;
+            f->nano = (magic == PCAP_MAGIC_NS);
+            break;
+    }
+    capture_rewind(f);
+    return TRUE;
+}
+
+// ------------------------------------------------
+// Function:        capture_options()
+// ------------------------------------------------
+// Input:           File
+//                  Interface description block
+//                  Block length
+// Output:          -
+// ------------------------------------------------
+// Description:     Registers a pcapng interface and
+//                  its time stamp resolution
+// ------------------------------------------------
+static void capture_options(CAPTURE_FILE *f, BYTE *b, UInt32 len)
+{
+    UInt32 pos;
+    UInt16 code, size;
+    uint64_t units;
+    BYTE r;
+
+    units = 1000000;                                        // default: microseconds
+    pos = 16;
+    while((pos + 4) <= (len - 4)) {
+        code = capture_rd16(f, b + pos);
+        size = capture_rd16(f, b + pos + 2);
+        if(code == 0) break;                                // end of options
+        if((code == 9) && (size >= 1)) {                    // if_tsresol
+            r = b[pos + 4];
+            if(r & 0x80) units = 1ULL << (r & 0x7f);
+            else for(units=1; r>0; r--) units *= 10;
+        }
+        pos += 4 + ((size + 3) & ~3);
+    }
+
+    if(f->ifaces < CAPTURE_INTERFACES) {
+        f->link[f->ifaces] = capture_rd16(f, b + 8);
+        f->units[f->ifaces] = units;
+    }
+    f->ifaces++;
+}
+
+// ------------------------------------------------
+// Function:        capture_next()
+// ------------------------------------------------
+// Input:           File
+//                  Frame to fill in
+// Output:          FALSE at the end of the file
+// ------------------------------------------------
+// Description:     Returns the next frame, pointing
+//                  into the mapped file
+// ------------------------------------------------
+BOOL capture_next(CAPTURE_FILE *f, CAPTURE_FRAME *frame)
+{
+    BYTE *b;
+    UInt32 type, len, magic, i;
+    uint64_t ts, units;
+
+    if(f->map == NULL) return FALSE;
+
+    // --------------
+    // classic format
+    // --------------
+    if(!f->ng) {
+        if((f->pos + 16) > f->length) return FALSE;
+        b = f->map + f->pos;
+        len = capture_rd32(f, b + 8);
+        if((f->pos + 16 + len) > f->length) return FALSE;  // truncated
+        frame->sec = capture_rd32(f, b);
+        frame->usec = capture_rd32(f, b + 4);
+        if(f->nano) frame->usec /= 1000;
+        frame->size = len;
+        frame->data = b + 16;
+        frame->link = f->link[0];
+        f->pos += 16 + len;
+        return TRUE;
+    }
+
+    // ------------------------------
+    // pcapng: walk the blocks up to
+    // the next packet
+    // ------------------------------
+    while((f->pos + 12) <= f->length) {
+        b = f->map + f->pos;
+        memcpy(&type, b, sizeof(type));
+        if(type == PCAPNG_SHB) {
+            memcpy(&magic, b + 8, sizeof(magic));
+            f->swapped = (magic != PCAPNG_BOM);
+            f->ifaces = 0;                                  // new section
+        }
+        type = capture_rd32(f, b);
+        len = capture_rd32(f, b + 4);
+        if((len < 12) || ((f->pos + len) > f->length)) return FALSE;
+        f->pos += len;
+
+        switch(type) {
+            case PCAPNG_IDB:
+                if(len >= 20) capture_options(f, b, len);
+                break;
+
+            case PCAPNG_EPB:
+                if(len < 32) break;
+                i = capture_rd32(f, b + 8);
+                if(i >= f->ifaces || i >= CAPTURE_INTERFACES) break;
+                frame->size = capture_rd32(f, b + 20);
+                if((28 + frame->size) > len) break;
+                ts = ((uint64_t)capture_rd32(f, b + 12) << 32) | capture_rd32(f, b + 16);
+                units = f->units[i];
+                frame->sec = (UInt32)(ts / units);
+                frame->usec = (UInt32)(((ts % units) * 1000000) / units);
+                frame->data = b + 28;
+                frame->link = f->link[i];
+                return TRUE;
+
+            case PCAPNG_SPB:
+                if((len < 16) || (f->ifaces == 0)) break;
+                frame->size = capture_rd32(f, b + 8);
+                if(frame->size > (len - 16)) frame->size = len - 16;
+                frame->sec = 0;
+                frame->usec = 0;
+                frame->data = b + 12;
+                frame->link = f->link[0];
+                return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// ------------------------------------------------
+// Function:        capture_rewind()
+// ------------------------------------------------
+// Input:           File
+// Output:          -
+// ------------------------------------------------
+// Description:     Goes back to the first frame
+// ------------------------------------------------
+void capture_rewind(CAPTURE_FILE *f)
+{
+    if(f->ng) {
+        f->pos = 0;
+        f->ifaces = 0;
+        return;
+    }
+    f->pos = 24;
+    f->link[0] = (UInt16)capture_rd32(f, f->map + 20);
+    f->ifaces = 1;
+}
+
+// ------------------------------------------------
+// Function:        capture_replay()
+// ------------------------------------------------
+// Input:           File
+//                  Frames to feed (0 for all)
+// Output:          Frames fed
+// ------------------------------------------------
+// Description:     Feeds the IP and ARP frames of
+//                  the file straight into the
+//                  protocol layers of the current
+//                  stack, as fast as they are
+//                  parsed. Must run on a thread of
+//                  the stack. Ethernet addresses
+//                  are not checked, IP ones are
+// ------------------------------------------------
+UInt32 capture_replay(CAPTURE_FILE *f, UInt32 count)
+{
+    CAPTURE_FRAME fr;
+    PPBUF pbuf;
+    BYTE *p;
+    UInt32 n, size;
+    UInt16 prot;
+    BYTE proto;
+
+    n = 0;
+    while(((count == 0) || (n < count)) && capture_next(f, &fr)) {
+        // ------------------
+        // strip link headers
+        // ------------------
+        p = fr.data;
+        size = fr.size;
+        switch(fr.link) {
+            case CAPTURE_LINK_ETH:
+                if(size < ETH_HDR_SIZE) {
+                    f->skipped++;
+                    continue;
+                }
+                prot = ((UInt16)p[12] << 8) | p[13];
+                if(prot == ETH_PROT_IP) proto = BUFFER_IP;
+                else if(prot == ETH_PROT_ARP) proto = BUFFER_ARP;
+                else {
+                    f->skipped++;
+                    continue;
+                }
+                p += ETH_HDR_SIZE;
+                size -= ETH_HDR_SIZE;
+                break;
+
+            case CAPTURE_LINK_RAW:
+            case CAPTURE_LINK_IPV4:
+                proto = BUFFER_IP;
+                break;
+
+            default:
+                f->skipped++;
+                continue;
+        }
+        if(size > MTU_ETH) {                                // offloaded segments
+            f->skipped++;
+            continue;
+        }
+
+        pbuf = link_buffer(size, INTERFACE_ETH);
+        if(pbuf == NULL) {
+            f->dropped++;
+            continue;
+        }
+        os_copy(p, BUF_DATA(pbuf), size);
+        pbuf->size = size;
+
+        HERMES_LOCK();
+        BUF_PROTOCOL(pbuf) = proto;
+        hermes_parse(pbuf);
+        HERMES_UNLOCK();
+        n++;
+    }
+    return n;
+}
+
+// ------------------------------------------------
+// Function:        capture_close()
+// ------------------------------------------------
+// Input:           File
+// Output:          -
+// ------------------------------------------------
+// Description:     Unmaps a capture file
+// ------------------------------------------------
+void capture_close(CAPTURE_FILE *f)
+{
+    if(f->map != NULL) munmap(f->map, f->length);
+    f->map = NULL;
+}
+
+// ------------------------------------------------
+// Function:        capture_put()
+// ------------------------------------------------
+// Input:           Tap
+//                  Ring position
+//                  Data
+//                  Size
+// Output:          -
+// ------------------------------------------------
+// Description:     Copies into the ring, wrapping
+//                  around its end
+// ------------------------------------------------
+static void capture_put(CAPTURE_TAP *t, UInt32 pos, BYTE *p, UInt32 size)
+{
+    UInt32 i, n;
+
+    i = pos & (t->ring_size - 1);
+    n = t->ring_size - i;
+    if(n > size) n = size;
+    memcpy(t->ring + i, p, n);
+    if(n < size) memcpy(t->ring, p + n, size - n);
+}
+
+// ------------------------------------------------
+// Function:        capture_writer()
+// ------------------------------------------------
+// Input:           Tap
+// Output:          -
+// ------------------------------------------------
+// Description:     Writer thread: the ring already
+//                  holds the file records, they are
+//                  streamed as they are
+// ------------------------------------------------
+static void *capture_writer(void *arg)
+{
+    CAPTURE_TAP *t;
+    UInt32 head, tail, i, n;
+    struct timespec ts;
+    BOOL last;
+
+    t = (CAPTURE_TAP *)arg;
+    ts.tv_sec = 0;
+    ts.tv_nsec = 1000000;
+    for(;;) {
+        last = t->closing;
+        head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+        tail = t->tail;
+        if(head == tail) {
+            if(last) break;
+            fflush(t->file);
+            nanosleep(&ts, NULL);
+            continue;
+        }
+
+        i = tail & (t->ring_size - 1);
+        n = head - tail;
+        if(n > (t->ring_size - i)) n = t->ring_size - i;   // up to the end of the ring
+        fwrite(t->ring + i, 1, n, t->file);
+        __atomic_store_n(&t->tail, tail + n, __ATOMIC_RELEASE);
+    }
+    fflush(t->file);
+    return NULL;
+}
+
+// ------------------------------------------------
+// Function:        capture_tap_open()
+// ------------------------------------------------
+// Input:           Tap
+//                  Path
+//                  Link type
+//                  Ring size (bytes)
+// Output:          TRUE if succesful
+// ------------------------------------------------
+// Description:     Creates a capture file and starts
+//                  its writer
+// ------------------------------------------------
+BOOL capture_tap_open(CAPTURE_TAP *t, char *path, UInt16 link, UInt32 ring_size)
+{
+    UInt32 h[6];
+
+    memset(t, 0, sizeof(CAPTURE_TAP));
+    t->snap = CAPTURE_SNAP;
+    for(t->ring_size=65536; t->ring_size<ring_size; t->ring_size<<=1);
+    t->ring = (BYTE *)malloc(t->ring_size);
+    if(t->ring == NULL) return FALSE;
+    t->file = fopen(path, "wb");
+    if(t->file == NULL) {
+        free(t->ring);
+        return FALSE;
+    }
+
+    h[0] = PCAP_MAGIC;
+    h[1] = 2 | (4 << 16);                                   // version 2.4
+    h[2] = 0;                                               // GMT
+    h[3] = 0;                                               // accuracy
+    h[4] = t->snap;
+    h[5] = link;
+    fwrite(h, 1, sizeof(h), t->file);
+
+    if(pthread_create(&t->writer, NULL, capture_writer, t)) {
+        fclose(t->file);
+        free(t->ring);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// ------------------------------------------------
+// Function:        capture_tap()
+// ------------------------------------------------
+// Input:           Tap
+//                  Frame
+//                  Frame size
+// Output:          -
+// ------------------------------------------------
+// Description:     Records a frame, with the time
+//                  of the executive clock. Never
+//                  waits for the writer: frames
+//                  not fitting the ring are dropped
+// ------------------------------------------------
+void capture_tap(void *tap, BYTE *frame, UInt16 size)
+{
+    CAPTURE_TAP *t;
+    UInt32 h[4];
+    UInt32 ms, caplen, need, head;
+
+    t = (CAPTURE_TAP *)tap;
+    ms = os_clock();
+    caplen = (size > t->snap)? t->snap: size;
+    need = sizeof(h) + caplen;
+    h[0] = ms / 1000;
+    h[1] = (ms % 1000) * 1000;
+    h[2] = caplen;
+    h[3] = size;
+
+    while(__atomic_test_and_set(&t->busy, __ATOMIC_ACQUIRE));     // other senders copying
+    head = t->head;
+    if((t->ring_size - (head - __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE))) < need) {
+        t->dropped++;
+        __atomic_clear(&t->busy, __ATOMIC_RELEASE);
+        return;
+    }
+    capture_put(t, head, (BYTE *)h, sizeof(h));
+    capture_put(t, head + sizeof(h), frame, caplen);
+    t->captured++;
+    __atomic_store_n(&t->head, head + need, __ATOMIC_RELEASE);
+    __atomic_clear(&t->busy, __ATOMIC_RELEASE);
+}
+
+// ------------------------------------------------
+// Function:        capture_tap_close()
+// ------------------------------------------------
+// Input:           Tap
+// Output:          -
+// ------------------------------------------------
+// Description:     Writes what is left in the ring
+//                  and closes the capture file.
+//                  Remove the tap from its link
+//                  first
+// ------------------------------------------------
+void capture_tap_close(CAPTURE_TAP *t)
+{
+    t->closing = TRUE;
+    pthread_join(t->writer, NULL);
+    fclose(t->file);
+    free(t->ring);
+    t->ring = NULL;
+}
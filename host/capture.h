@@ -0,0 +1,69 @@
+// ------------------------------------------------
+// Capture files: replay of pcap and pcapng files
+// into the receive path, and a capture tap for
+// eth_tap() (or any link driver) writing pcap
+// ------------------------------------------------
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#define CAPTURE_LINK_ETH                1       // DLT_EN10MB
+#define CAPTURE_LINK_PPP                9       // DLT_PPP
+#define CAPTURE_LINK_RAW                101     // DLT_RAW, bare IP
+#define CAPTURE_LINK_IPV4               228     // DLT_IPV4
+#define CAPTURE_INTERFACES              8       // pcapng interfaces kept
+
+// --------------------------------------
+// Capture file, memory mapped: frames are
+// handed out in place, without copies
+// --------------------------------------
+typedef struct {
+    BYTE *map;
+    size_t length;
+    size_t pos;                                 // next record
+    BOOL swapped;                               // other byte order
+    BOOL ng;                                    // pcapng
+    BOOL nano;                                  // nanosecond time stamps (pcap)
+    UInt16 link[CAPTURE_INTERFACES];               // link type of each interface
+    uint64_t units[CAPTURE_INTERFACES];            // time stamp units per second
+    BYTE ifaces;
+    UInt32 skipped;                             // frames of unsupported links
+    UInt32 dropped;                             // frames without a buffer
+} CAPTURE_FILE;
+
+typedef struct {
+    BYTE *data;
+    UInt32 size;
+    UInt16 link;
+    UInt32 sec;
+    UInt32 usec;
+} CAPTURE_FRAME;
+
+// ---------------------------------------
+// Capture tap: frames are copied to a ring
+// and written to the file by a thread of
+// its own; when the ring is full frames
+// are counted and dropped, never waited on
+// ---------------------------------------
+typedef struct {
+    FILE *file;
+    BYTE *ring;
+    UInt32 ring_size;                           // power of 2
+    UInt32 head;                                // written by the senders
+    UInt32 tail;                                // written by the writer thread
+    UInt32 snap;                                // bytes kept of each frame
+    volatile BYTE busy;                         // senders spin lock
+    volatile BOOL closing;
+    pthread_t writer;
+    UInt32 captured;
+    UInt32 dropped;
+} CAPTURE_TAP;
+
+BOOL capture_open(CAPTURE_FILE *f, char *path);
+BOOL capture_next(CAPTURE_FILE *f, CAPTURE_FRAME *frame);
+void capture_rewind(CAPTURE_FILE *f);
+UInt32 capture_replay(CAPTURE_FILE *f, UInt32 count);
+void capture_close(CAPTURE_FILE *f);
+BOOL capture_tap_open(CAPTURE_TAP *t, char *path, UInt16 link, UInt32 ring_size);
+void capture_tap(void *tap, BYTE *frame, UInt16 size);
+void capture_tap_close(CAPTURE_TAP *t);
@@ -0,0 +1,944 @@
+// -------------------------------------------------------
+// File:            CRONOS.C
+// Project:         Hermes
+// Description:     Cronos executive on POSIX threads, to
+//                  run and benchmark the stack on hosts
+// Author:          Bruno Abrantes Basseto
+//                  bruno.basseto@uol.com.br
+// Target CPU:      x86 / ARM hosts
+// Compiler:        GCC
+// -------------------------------------------------------
+// Functions:       os_now()
+//                  os_find()
+//                  os_attach()
+//                  os_thread()
+//                  os_wake()
+//                  os_advance()
+//                  os_block()
+//                  os_wait()
+//                  os_raise()
+//                  os_signal()
+//                  os_post()
+//                  os_set_timeout()
+//                  os_sleep()
+//                  os_set_callback()
+//                  os_set_timer()
+//                  os_timer_run()
+//                  os_run()
+//                  os_start()
+//                  os_enter()
+//                  os_detach()
+//                  os_not_terminated()
+//                  os_terminate()
+//                  os_join()
+//                  os_clock()
+//                  os_set()
+//                  os_copy()
+//                  os_swap()
+//                  os_init()
+// -------------------------------------------------------
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include "defs.h"
+#include "cronos.h"
+
+#define OS_NONE                         0xff
+#define OS_BUCKETS                      256     // domain hash (power of 2)
+#define DUE(t, now)                     ((int)((now) - (t)) >= 0)
+
+// ---------------------------------------------
+// Domain: the threads, signals and timers of a
+// stack instance. Its threads take turns on the
+// domain processor (cpu)
+// ---------------------------------------------
+typedef struct _OS_DOMAIN {
+    void *key;
+    pthread_mutex_t cpu;                        // held by the running thread
+    UInt32 pending;                             // signals nobody was waiting for
+    struct {
+        UInt32 time;
+        BYTE cb;
+        BOOL armed;
+    } timer[OS_TIMERS];
+    void (*callback[OS_CALLBACKS])(void);
+    struct _OS_THREAD *threads;                 // threads of the domain
+    struct _OS_DOMAIN *next;                    // hash chain
+} OS_DOMAIN;
+
+typedef struct _OS_THREAD {
+    pthread_t handle;
+    BYTE id;
+    void (*f)(void);
+    OS_DOMAIN *dom;
+    pthread_cond_t cond;
+    BYTE sig;                                   // signal waited for, OS_NONE if sleeping
+    BOOL blocked;
+    BOOL ready;                                 // woken up, still to resume
+    BOOL signaled;                              // woken up by its signal
+    BOOL timed;
+    UInt32 time;                                // wake up time
+    UInt16 timeout;                             // for the next wait
+    BOOL detached;                              // off the domain processor
+    BOOL counted;                               // holds the virtual clock while running
+    BOOL started;                               // created by os_start()
+    struct _OS_THREAD *dom_next;
+    struct _OS_THREAD *all_next;
+} OS_THREAD;
+
+static pthread_mutex_t os_lock = PTHREAD_MUTEX_INITIALIZER;    // executive data
+static pthread_cond_t os_tick;                  // wakes the timer thread
+static pthread_t os_timer_handle;
+static OS_DOMAIN *os_domains[OS_BUCKETS];
+static OS_THREAD *os_threads;
+static BOOL os_virtual;
+static volatile BOOL os_terminated;
+static BOOL os_ticked;                          // timers due (virtual clock)
+static UInt32 os_vclock;                        // virtual time (ms)
+static struct timespec os_origin;
+static int os_running;                          // threads able to run
+
+__thread void *os_domain;
+static __thread OS_THREAD *os_self;
+
+// ------------------------------------------------
+// Function:        os_now()
+// ------------------------------------------------
+// Input:           -
+// Output:          Time (ms)
+// ------------------------------------------------
+// Description:     Executive time base, real or
+//                  virtual
+// ------------------------------------------------
+static UInt32 os_now(void)
+{
+    struct timespec ts;
+
+    if(os_virtual) return os_vclock;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UInt32)((ts.tv_sec - os_origin.tv_sec) * 1000 +
+                    (ts.tv_nsec - os_origin.tv_nsec) / 1000000);
+}
+
+// ------------------------------------------------
+// Function:        os_find()
+// ------------------------------------------------
+// Input:           Domain key
+// Output:          Domain
+// ------------------------------------------------
+// Description:     Finds (or creates) a domain.
+//                  Called with os_lock held
+// ------------------------------------------------
+static OS_DOMAIN *os_find(void *key)
+{
+    OS_DOMAIN *d;
+    UInt32 h;
+
+    h = ((uintptr_t)key >> 4) & (OS_BUCKETS - 1);
+    for(d=os_domains[h]; d!=NULL; d=d->next)
+        if(d->key == key) return d;
+
+    d = (OS_DOMAIN *)calloc(1, sizeof(OS_DOMAIN));
+    if(d == NULL) abort();
+    d->key = key;
+    pthread_mutex_init(&d->cpu, NULL);
+    d->next = os_domains[h];
+    os_domains[h] = d;
+    return d;
+}
+
+// ------------------------------------------------
+// Function:        os_attach()
+// ------------------------------------------------
+// Input:           Thread
+//                  Domain
+// Output:          -
+// ------------------------------------------------
+// Description:     Moves a thread to a domain.
+//                  Called with os_lock held
+// ------------------------------------------------
+static void os_attach(OS_THREAD *t, OS_DOMAIN *d)
+{
+    OS_THREAD **p;
+
+    if(t->dom != NULL) {
+        for(p=&t->dom->threads; *p!=NULL; p=&(*p)->dom_next) {
+            if(*p == t) {
+                *p = t->dom_next;
+                break;
+            }
+        }
+    }
+    t->dom = d;
+    t->dom_next = d->threads;
+    d->threads = t;
+}
+
+// ------------------------------------------------
+// Function:        os_thread()
+// ------------------------------------------------
+// Input:           -
+// Output:          Calling thread
+// ------------------------------------------------
+// Description:     Threads not created by the
+//                  executive are registered as
+//                  detached on their first call
+// ------------------------------------------------
+static OS_THREAD *os_thread(void)
+{
+    OS_THREAD *t;
+    pthread_condattr_t attr;
+
+    if(os_self != NULL) return os_self;
+
+    t = (OS_THREAD *)calloc(1, sizeof(OS_THREAD));
+    if(t == NULL) abort();
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&t->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    t->handle = pthread_self();
+    t->sig = OS_NONE;
+    t->detached = TRUE;
+
+    pthread_mutex_lock(&os_lock);
+    os_attach(t, os_find(os_domain));
+    t->all_next = os_threads;
+    os_threads = t;
+    pthread_mutex_unlock(&os_lock);
+
+    os_self = t;
+    return t;
+}
+
+// ------------------------------------------------
+// Function:        os_wake()
+// ------------------------------------------------
+// Input:           Blocked thread
+//                  TRUE if woken by its signal
+// Output:          -
+// ------------------------------------------------
+// Description:     Makes a thread ready. Called
+//                  with os_lock held
+// ------------------------------------------------
+static void os_wake(OS_THREAD *t, BOOL signaled)
+{
+    t->ready = TRUE;
+    t->signaled = signaled;
+    if(t->counted) os_running++;
+    pthread_cond_signal(&t->cond);
+}
+
+// ------------------------------------------------
+// Function:        os_advance()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Virtual clock: every thread is
+//                  blocked, so time jumps to the
+//                  next deadline. Called with
+//                  os_lock held
+// ------------------------------------------------
+static void os_advance(void)
+{
+    OS_DOMAIN *d;
+    OS_THREAD *t;
+    UInt32 next;
+    BOOL found;
+    int h, i;
+
+    // ------------------
+    // find next deadline
+    // ------------------
+    found = FALSE;
+    next = 0;
+    for(t=os_threads; t!=NULL; t=t->all_next) {
+        if(!t->blocked || t->ready || !t->timed || !t->counted) continue;
+        if(!found || ((int)(t->time - next) < 0)) next = t->time;
+        found = TRUE;
+    }
+    for(h=0; h<OS_BUCKETS; h++) {
+        for(d=os_domains[h]; d!=NULL; d=d->next) {
+            for(i=0; i<OS_TIMERS; i++) {
+                if(!d->timer[i].armed) continue;
+                if(!found || ((int)(d->timer[i].time - next) < 0)) next = d->timer[i].time;
+                found = TRUE;
+            }
+        }
+    }
+    if(!found) return;                                      // idle until signaled
+    if((int)(next - os_vclock) > 0) os_vclock = next;
+
+    // ----------------------
+    // wake what is now due
+    // ----------------------
+    for(t=os_threads; t!=NULL; t=t->all_next) {
+        if(!t->blocked || t->ready || !t->timed || !t->counted) continue;
+        if(DUE(t->time, os_vclock)) os_wake(t, FALSE);
+    }
+    for(h=0; h<OS_BUCKETS; h++) {
+        for(d=os_domains[h]; d!=NULL; d=d->next) {
+            for(i=0; i<OS_TIMERS; i++) {
+                if(!d->timer[i].armed || !DUE(d->timer[i].time, os_vclock)) continue;
+                if(!os_ticked) {
+                    os_ticked = TRUE;
+                    os_running++;                           // the timer thread
+                    pthread_cond_signal(&os_tick);
+                }
+            }
+        }
+    }
+}
+
+// ------------------------------------------------
+// Function:        os_block()
+// ------------------------------------------------
+// Input:           Calling thread, its wait set up
+// Output:          TRUE if woken by its signal
+// ------------------------------------------------
+// Description:     Gives up the domain processor
+//                  until woken, timed out or
+//                  terminated. Called with os_lock
+//                  held, returns without it
+// ------------------------------------------------
+static BOOL os_block(OS_THREAD *t)
+{
+    struct timespec ts;
+    UInt32 ms;
+    BOOL res;
+
+    t->ready = FALSE;
+    t->signaled = FALSE;
+    t->blocked = TRUE;
+    if(!t->detached) pthread_mutex_unlock(&t->dom->cpu);
+    if(t->counted) {
+        os_running--;
+        if(os_virtual && (os_running == 0)) os_advance();
+    }
+
+    if(t->timed && !os_virtual) {
+        ms = t->time;
+        ts.tv_sec = os_origin.tv_sec + ms / 1000;
+        ts.tv_nsec = os_origin.tv_nsec + (long)(ms % 1000) * 1000000;
+        if(ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+    }
+
+    while(!t->ready && !os_terminated) {
+        if(t->timed && !os_virtual) {
+            if(pthread_cond_timedwait(&t->cond, &os_lock, &ts) == ETIMEDOUT) break;
+        } else {
+            pthread_cond_wait(&t->cond, &os_lock);
+        }
+    }
+    if(!t->ready && t->counted) os_running++;               // woke up by itself
+
+    res = t->ready && t->signaled;
+    t->blocked = FALSE;
+    t->ready = FALSE;
+    t->timed = FALSE;
+    t->sig = OS_NONE;
+    pthread_mutex_unlock(&os_lock);
+
+    if(!t->detached) pthread_mutex_lock(&t->dom->cpu);
+    return res;
+}
+
+// ------------------------------------------------
+// Function:        os_wait()
+// ------------------------------------------------
+// Input:           Signal ID
+// Output:          TRUE if signaled, FALSE on
+//                  timeout or termination
+// ------------------------------------------------
+// Description:     Waits for a signal of the
+//                  domain, at most the time set by
+//                  os_set_timeout()
+// ------------------------------------------------
+BOOL os_wait(BYTE sig)
+{
+    OS_THREAD *t;
+    UInt32 bit;
+
+    t = os_thread();
+    bit = 1UL << (sig % OS_SIGNALS);
+
+    pthread_mutex_lock(&os_lock);
+    if(t->dom->pending & bit) {
+        t->dom->pending &= ~bit;
+        t->timeout = 0;
+        pthread_mutex_unlock(&os_lock);
+        return TRUE;
+    }
+    if(os_terminated) {
+        pthread_mutex_unlock(&os_lock);
+        return FALSE;
+    }
+
+    t->sig = sig % OS_SIGNALS;
+    if(t->timeout) {
+        t->timed = TRUE;
+        t->time = os_now() + t->timeout;
+        t->timeout = 0;
+    }
+    return os_block(t);
+}
+
+// ------------------------------------------------
+// Function:        os_raise()
+// ------------------------------------------------
+// Input:           Domain
+//                  Signal ID
+// Output:          -
+// ------------------------------------------------
+// Description:     Wakes a thread of the domain
+//                  waiting for the signal, or
+//                  keeps it for the next wait.
+//                  Called with os_lock held
+// ------------------------------------------------
+static void os_raise(OS_DOMAIN *d, BYTE sig)
+{
+    OS_THREAD *t;
+
+    sig %= OS_SIGNALS;
+    for(t=d->threads; t!=NULL; t=t->dom_next) {
+        if(t->blocked && !t->ready && (t->sig == sig)) {
+            os_wake(t, TRUE);
+            return;
+        }
+    }
+    d->pending |= 1UL << sig;
+}
+
+// ------------------------------------------------
+// Function:        os_signal()
+// ------------------------------------------------
+// Input:           Signal ID
+// Output:          -
+// ------------------------------------------------
+// Description:     Signals a thread of the domain
+// ------------------------------------------------
+void os_signal(BYTE sig)
+{
+    OS_THREAD *t;
+
+    t = os_thread();
+    pthread_mutex_lock(&os_lock);
+    os_raise((t->dom->key == os_domain)? t->dom: os_find(os_domain), sig);
+    pthread_mutex_unlock(&os_lock);
+}
+
+// ------------------------------------------------
+// Function:        os_post()
+// ------------------------------------------------
+// Input:           Domain key
+//                  Signal ID
+// Output:          -
+// ------------------------------------------------
+// Description:     Signals a thread of another
+//                  domain, as link drivers do when
+//                  handing frames between stacks
+// ------------------------------------------------
+void os_post(void *domain, BYTE sig)
+{
+    pthread_mutex_lock(&os_lock);
+    os_raise(os_find(domain), sig);
+    pthread_mutex_unlock(&os_lock);
+}
+
+// ------------------------------------------------
+// Function:        os_set_timeout()
+// ------------------------------------------------
+// Input:           Time (ms)
+// Output:          -
+// ------------------------------------------------
+// Description:     Limits the next os_wait()
+// ------------------------------------------------
+void os_set_timeout(UInt16 t)
+{
+    os_thread()->timeout = t;
+}
+
+// ------------------------------------------------
+// Function:        os_sleep()
+// ------------------------------------------------
+// Input:           Time (ms)
+// Output:          -
+// ------------------------------------------------
+// Description:     Suspends the calling thread
+// ------------------------------------------------
+void os_sleep(UInt16 t)
+{
+    OS_THREAD *s;
+
+    s = os_thread();
+    if(t == 0) {
+        // -------------------------
+        // just let the others run
+        // -------------------------
+        if(s->detached) {
+            sched_yield();
+            return;
+        }
+        pthread_mutex_unlock(&s->dom->cpu);
+        sched_yield();
+        pthread_mutex_lock(&s->dom->cpu);
+        return;
+    }
+
+    pthread_mutex_lock(&os_lock);
+    s->sig = OS_NONE;
+    s->timed = TRUE;
+    s->time = os_now() + t;
+    os_block(s);
+}
+
+// ------------------------------------------------
+// Function:        os_set_callback()
+// ------------------------------------------------
+// Input:           Callback ID
+//                  Function
+// Output:          -
+// ------------------------------------------------
+// Description:     Sets a callback of the domain
+// ------------------------------------------------
+void os_set_callback(BYTE cb, void (*f)(void))
+{
+    os_thread();
+    pthread_mutex_lock(&os_lock);
+    os_find(os_domain)->callback[cb % OS_CALLBACKS] = f;
+    pthread_mutex_unlock(&os_lock);
+}
+
+// ------------------------------------------------
+// Function:        os_set_timer()
+// ------------------------------------------------
+// Input:           Timer ID
+//                  Time (ms)
+//                  Callback ID
+// Output:          -
+// ------------------------------------------------
+// Description:     Arms a one shot timer of the
+//                  domain. The callback runs on
+//                  the domain processor
+// ------------------------------------------------
+void os_set_timer(BYTE tmr, UInt16 t, BYTE cb)
+{
+    OS_DOMAIN *d;
+
+    os_thread();
+    pthread_mutex_lock(&os_lock);
+    d = os_find(os_domain);
+    tmr %= OS_TIMERS;
+    d->timer[tmr].time = os_now() + t;
+    d->timer[tmr].cb = cb % OS_CALLBACKS;
+    d->timer[tmr].armed = TRUE;
+    if(!os_virtual) pthread_cond_signal(&os_tick);
+    pthread_mutex_unlock(&os_lock);
+}
+
+// ------------------------------------------------
+// Function:        os_timer_run()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Timer thread: runs the callbacks
+//                  of the expired timers
+// ------------------------------------------------
+static void *os_timer_run(void *arg)
+{
+    OS_DOMAIN *d;
+    void (*f)(void);
+    struct timespec ts;
+    UInt32 now, next;
+    BOOL found, fired;
+    int h, i;
+
+    pthread_mutex_lock(&os_lock);
+    while(!os_terminated) {
+        // ---------------------------------------
+        // run the due callbacks, one at a time as
+        // each one may arm timers again
+        // ---------------------------------------
+        do {
+            fired = FALSE;
+            now = os_now();
+            for(h=0; (h<OS_BUCKETS) && !fired; h++) {
+                for(d=os_domains[h]; (d!=NULL) && !fired; d=d->next) {
+                    for(i=0; i<OS_TIMERS; i++) {
+                        if(!d->timer[i].armed || !DUE(d->timer[i].time, now)) continue;
+                        d->timer[i].armed = FALSE;
+                        f = d->callback[d->timer[i].cb];
+                        pthread_mutex_unlock(&os_lock);
+
+                        pthread_mutex_lock(&d->cpu);
+                        os_domain = d->key;
+                        if(f != NULL) f();
+                        pthread_mutex_unlock(&d->cpu);
+
+                        pthread_mutex_lock(&os_lock);
+                        fired = TRUE;
+                        break;
+                    }
+                }
+            }
+        } while(fired && !os_terminated);
+        if(os_terminated) break;
+
+        if(os_virtual) {
+            // -------------------------------------
+            // idle until the clock reaches a timer
+            // -------------------------------------
+            os_ticked = FALSE;
+            os_running--;
+            if(os_running == 0) os_advance();
+            while(!os_ticked && !os_terminated) pthread_cond_wait(&os_tick, &os_lock);
+            continue;
+        }
+
+        // --------------------------
+        // sleep until the next timer
+        // --------------------------
+        found = FALSE;
+        next = 0;
+        for(h=0; h<OS_BUCKETS; h++) {
+            for(d=os_domains[h]; d!=NULL; d=d->next) {
+                for(i=0; i<OS_TIMERS; i++) {
+                    if(!d->timer[i].armed) continue;
+                    if(!found || ((int)(d->timer[i].time - next) < 0)) next = d->timer[i].time;
+                    found = TRUE;
+                }
+            }
+        }
+        if(!found) {
+            pthread_cond_wait(&os_tick, &os_lock);
+            continue;
+        }
+        ts.tv_sec = os_origin.tv_sec + next / 1000;
+        ts.tv_nsec = os_origin.tv_nsec + (long)(next % 1000) * 1000000;
+        if(ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&os_tick, &os_lock, &ts);
+    }
+    pthread_mutex_unlock(&os_lock);
+    return NULL;
+}
+
+// ------------------------------------------------
+// Function:        os_run()
+// ------------------------------------------------
+// Input:           Thread
+// Output:          -
+// ------------------------------------------------
+// Description:     Body of the executive threads
+// ------------------------------------------------
+static void *os_run(void *arg)
+{
+    OS_THREAD *t;
+
+    t = (OS_THREAD *)arg;
+    os_self = t;
+    os_domain = t->dom->key;
+
+    pthread_mutex_lock(&t->dom->cpu);
+    t->f();
+
+    // ---------------
+    // thread finished
+    // ---------------
+    if(!t->detached) pthread_mutex_unlock(&t->dom->cpu);
+    pthread_mutex_lock(&os_lock);
+    if(t->counted) {
+        os_running--;
+        if(os_virtual && (os_running == 0)) os_advance();
+    }
+    pthread_mutex_unlock(&os_lock);
+    return NULL;
+}
+
+// ------------------------------------------------
+// Function:        os_start()
+// ------------------------------------------------
+// Input:           Thread ID
+//                  Thread function
+//                  Stack size (ignored)
+// Output:          -
+// ------------------------------------------------
+// Description:     Starts a thread in the domain
+//                  of the caller
+// ------------------------------------------------
+void os_start(BYTE id, void (*f)(void), UInt16 stack)
+{
+    OS_THREAD *t;
+    pthread_condattr_t attr;
+
+    os_thread();
+    t = (OS_THREAD *)calloc(1, sizeof(OS_THREAD));
+    if(t == NULL) abort();
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&t->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    t->id = id;
+    t->f = f;
+    t->sig = OS_NONE;
+    t->started = TRUE;
+    t->counted = TRUE;
+
+    pthread_mutex_lock(&os_lock);
+    os_attach(t, os_find(os_domain));
+    t->all_next = os_threads;
+    os_threads = t;
+    os_running++;
+    pthread_mutex_unlock(&os_lock);
+
+    if(pthread_create(&t->handle, NULL, os_run, t)) abort();
+}
+
+// ------------------------------------------------
+// Function:        os_enter()
+// ------------------------------------------------
+// Input:           Domain key
+// Output:          -
+// ------------------------------------------------
+// Description:     Moves the calling thread to
+//                  another domain (stack instance)
+// ------------------------------------------------
+void os_enter(void *domain)
+{
+    OS_THREAD *t;
+    OS_DOMAIN *old;
+
+    t = os_thread();
+    pthread_mutex_lock(&os_lock);
+    old = t->dom;
+    os_attach(t, os_find(domain));
+    pthread_mutex_unlock(&os_lock);
+    os_domain = domain;
+
+    if(!t->detached && (old != t->dom)) {
+        pthread_mutex_unlock(&old->cpu);
+        pthread_mutex_lock(&t->dom->cpu);
+    }
+}
+
+// ------------------------------------------------
+// Function:        os_detach()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     The calling thread leaves the
+//                  domain processor and runs in
+//                  parallel with the others; it
+//                  must synchronize by itself.
+//                  The virtual clock still waits
+//                  for it to block
+// ------------------------------------------------
+void os_detach(void)
+{
+    OS_THREAD *t;
+
+    t = os_thread();
+    if(t->detached) return;
+
+    pthread_mutex_lock(&os_lock);
+    t->detached = TRUE;
+    pthread_mutex_unlock(&os_lock);
+    pthread_mutex_unlock(&t->dom->cpu);
+}
+
+// ------------------------------------------------
+// Function:        os_not_terminated()
+// ------------------------------------------------
+// Input:           -
+// Output:          FALSE once os_terminate() is
+//                  called
+// ------------------------------------------------
+// Description:     Thread loop condition
+// ------------------------------------------------
+BOOL os_not_terminated(void)
+{
+    return !os_terminated;
+}
+
+// ------------------------------------------------
+// Function:        os_terminate()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Asks every thread to finish
+// ------------------------------------------------
+void os_terminate(void)
+{
+    OS_THREAD *t;
+
+    pthread_mutex_lock(&os_lock);
+    os_terminated = TRUE;
+    for(t=os_threads; t!=NULL; t=t->all_next)
+        pthread_cond_signal(&t->cond);
+    pthread_cond_signal(&os_tick);
+    pthread_mutex_unlock(&os_lock);
+}
+
+// ------------------------------------------------
+// Function:        os_join()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Waits for the threads started
+//                  by os_start() to finish
+// ------------------------------------------------
+void os_join(void)
+{
+    OS_THREAD *t;
+    OS_THREAD *s;
+
+    s = os_thread();
+    if(!s->detached) pthread_mutex_unlock(&s->dom->cpu);
+    if(s->counted) {
+        pthread_mutex_lock(&os_lock);
+        os_running--;
+        if(os_virtual && (os_running == 0)) os_advance();
+        pthread_mutex_unlock(&os_lock);
+    }
+
+    for(t=os_threads; t!=NULL; t=t->all_next)
+        if(t->started && (t != s)) pthread_join(t->handle, NULL);
+    pthread_join(os_timer_handle, NULL);
+
+    if(s->counted) {
+        pthread_mutex_lock(&os_lock);
+        os_running++;
+        pthread_mutex_unlock(&os_lock);
+    }
+    if(!s->detached) pthread_mutex_lock(&s->dom->cpu);
+}
+
+// ------------------------------------------------
+// Function:        os_clock()
+// ------------------------------------------------
+// Input:           -
+// Output:          Time since os_init() (ms)
+// ------------------------------------------------
+// Description:     Executive time, virtual when
+//                  so initialized
+// ------------------------------------------------
+UInt32 os_clock(void)
+{
+    UInt32 res;
+
+    pthread_mutex_lock(&os_lock);
+    res = os_now();
+    pthread_mutex_unlock(&os_lock);
+    return res;
+}
+
+// ------------------------------------------------
+// Function:        os_set()
+// ------------------------------------------------
+// Input:           Memory pointer
+//                  Value
+//                  Size
+// Output:          -
+// ------------------------------------------------
+// Description:     Fills memory
+// ------------------------------------------------
+void os_set(BYTE *p, BYTE v, UInt32 n)
+{
+    memset(p, v, n);
+}
+
+// ------------------------------------------------
+// Function:        os_copy()
+// ------------------------------------------------
+// Input:           Source
+//                  Destination
+//                  Size
+// Output:          -
+// ------------------------------------------------
+// Description:     Copies memory
+// ------------------------------------------------
+void os_copy(BYTE *s, BYTE *d, UInt32 n)
+{
+    memmove(d, s, n);
+}
+
+// ------------------------------------------------
+// Function:        os_swap()
+// ------------------------------------------------
+// Input:           Memory pointers
+//                  Size
+// Output:          -
+// ------------------------------------------------
+// Description:     Swaps two memory blocks
+// ------------------------------------------------
+void os_swap(BYTE *a, BYTE *b, UInt32 n)
+{
+    BYTE t;
+
+    while(n--) {
+        t = *a;
+        *a++ = *b;
+        *b++ = t;
+    }
+}
+
+// ------------------------------------------------
+// Function:        os_init()
+// ------------------------------------------------
+// Input:           TRUE for a virtual clock
+// Output:          -
+// ------------------------------------------------
+// Description:     Executive initialization. The
+//                  caller becomes a thread of the
+//                  current domain. With a virtual
+//                  clock, time only moves when all
+//                  the threads are blocked, jumping
+//                  to the next deadline, so long
+//                  timeouts cost nothing and runs
+//                  are repeatable
+// ------------------------------------------------
+void os_init(BOOL virtual_clock)
+{
+    OS_THREAD *t;
+    pthread_condattr_t attr;
+
+    os_virtual = virtual_clock;
+    os_vclock = 0;
+    os_terminated = FALSE;
+    os_ticked = FALSE;
+    clock_gettime(CLOCK_MONOTONIC, &os_origin);
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&os_tick, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // ----------------------------------------
+    // the caller holds the processor of its
+    // domain, the timer thread counts as ready
+    // ----------------------------------------
+    t = os_thread();
+    pthread_mutex_lock(&os_lock);
+    t->detached = FALSE;
+    t->counted = TRUE;
+    os_running = 2;
+    pthread_mutex_unlock(&os_lock);
+    pthread_mutex_lock(&t->dom->cpu);
+
+    if(pthread_create(&os_timer_handle, NULL, os_timer_run, NULL)) abort();
+}
@@ -0,0 +1,42 @@
+// ------------------------------------------------
+// Cronos executive API, hosted implementation
+// ------------------------------------------------
+// Threads of the same domain (stack instance) run
+// one at a time, as on the PIC: a thread keeps the
+// processor until it waits or sleeps. Different
+// domains run in parallel. Signals, timers and
+// callbacks are scoped to the domain, so every
+// stack may use the same IDs.
+// ------------------------------------------------
+
+#define OS_SIGNALS                      32      // signal IDs per domain
+#define OS_TIMERS                       8       // timer IDs per domain
+#define OS_CALLBACKS                    8       // callback IDs per domain
+
+// ---------------------------
+// API shared with the targets
+// ---------------------------
+BOOL os_wait(BYTE sig);
+void os_signal(BYTE sig);
+void os_set_timeout(UInt16 t);
+void os_set_timer(BYTE tmr, UInt16 t, BYTE cb);
+void os_set_callback(BYTE cb, void (*f)(void));
+void os_start(BYTE id, void (*f)(void), UInt16 stack);
+void os_sleep(UInt16 t);
+void os_set(BYTE *p, BYTE v, UInt32 n);
+void os_copy(BYTE *s, BYTE *d, UInt32 n);
+void os_swap(BYTE *a, BYTE *b, UInt32 n);
+BOOL os_not_terminated(void);
+
+// -----------
+// hosted only
+// -----------
+extern __thread void *os_domain;                // domain of the calling thread
+
+void os_init(BOOL virtual_clock);
+UInt32 os_clock(void);
+void os_enter(void *domain);
+void os_post(void *domain, BYTE sig);
+void os_detach(void);
+void os_terminate(void);
+void os_join(void);
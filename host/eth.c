@@ -0,0 +1,230 @@
+// -------------------------------------------------------
+// File:            ETH.C
+// Project:         Hermes
+// Description:     Ethernet driver of the hosted build
+// Author:          Bruno Abrantes Basseto
+//                  bruno.basseto@uol.com.br
+// Target CPU:      x86 / ARM hosts
+// Compiler:        GCC
+// -------------------------------------------------------
+// Functions:       eth_attach()
+//                  eth_tap()
+//                  eth_input()
+//                  eth_send()
+//                  eth_init()
+// -------------------------------------------------------
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "defs.h"
+#include "net.h"
+#include "cronos.h"
+#include "hermes.h"
+
+// --------------------------
+// state of the current stack
+// --------------------------
+#define eth_output                      (hermes->eth.output)
+#define eth_port                        (hermes->eth.port)
+#define eth_tap_f                       (hermes->eth.tap)
+#define eth_tap_arg                     (hermes->eth.tap_arg)
+
+#define IPH(xxx)                        ((IP_HDR *)xxx)
+#define ARP(xxx)                        ((ARP_HDR *)xxx)
+
+// ------------------------------------------------
+// Function:        eth_attach()
+// ------------------------------------------------
+// Input:           MAC address (NULL keeps it)
+//                  Output hook
+//                  Hook argument
+// Output:          -
+// ------------------------------------------------
+// Description:     Connects the interface of the
+//                  current stack, after hermes_init()
+// ------------------------------------------------
+void eth_attach(MACADDR *mac, ETH_OUTPUT output, void *port)
+{
+    if(mac != NULL) os_copy((BYTE *)mac, (BYTE *)&mac_local, sizeof(MACADDR));
+    eth_output = output;
+    eth_port = port;
+}
+
+// ------------------------------------------------
+// Function:        eth_tap()
+// ------------------------------------------------
+// Input:           Tap function (NULL removes it)
+//                  Its argument
+// Output:          -
+// ------------------------------------------------
+// Description:     Installs a capture tap on the
+//                  interface of the current stack.
+//                  It runs in the send and receive
+//                  paths, so it must never block
+// ------------------------------------------------
+void eth_tap(ETH_OUTPUT tap, void *arg)
+{
+    eth_tap_arg = arg;
+    eth_tap_f = tap;
+}
+
+// ------------------------------------------------
+// Function:        eth_input()
+// ------------------------------------------------
+// Input:           Frame (with ethernet header)
+//                  Frame size
+// Output:          -
+// ------------------------------------------------
+// Description:     Receives a frame for the current
+//                  stack. Must be called by one of
+//                  its threads. The sender of IP
+//                  frames is learnt (arp_snoop())
+// ------------------------------------------------
+void eth_input(BYTE *frame, UInt16 size)
+{
+    PPBUF pbuf;
+    UInt16 prot;
+    BYTE i;
+    BYTE proto;
+    IPV4 ip;
+    MACADDR mac;
+
+    if(size < ETH_HDR_SIZE) return;
+    if(eth_tap_f != NULL) eth_tap_f(eth_tap_arg, frame, size);
+
+    // -------------------------
+    // check destination address
+    // -------------------------
+    for(i=0; i<sizeof(MACADDR); i++)
+        if(frame[i] != 0xff) break;
+    if(i < sizeof(MACADDR)) {
+        for(i=0; i<sizeof(MACADDR); i++)
+            if(frame[i] != mac_local.b[i]) return;          // not for us
+    }
+
+    prot = ((UInt16)frame[12] << 8) | frame[13];
+    switch(prot) {
+        case ETH_PROT_IP:
+            proto = BUFFER_IP;
+            if(size < (ETH_HDR_SIZE + sizeof(IP_HDR))) break;
+            os_copy((BYTE *)&IPH(&frame[ETH_HDR_SIZE])->source, (BYTE *)&ip, sizeof(IPV4));
+            os_copy(frame + 6, (BYTE *)&mac, sizeof(MACADDR));
+            HERMES_LOCK();
+            arp_snoop(&ip, &mac);                           // source pair, no request needed
+            HERMES_UNLOCK();
+            break;
+
+        case ETH_PROT_ARP:
+            proto = BUFFER_ARP;
+            break;
+
+        default:
+            return;
+    }
+
+    // --------------------------------
+    // copy to a buffer for the Hermes
+    // thread, dropped if none is left
+    // --------------------------------
+    size -= ETH_HDR_SIZE;
+    pbuf = link_buffer(size, INTERFACE_ETH);
+    if(pbuf == NULL) return;
+    os_copy(frame + ETH_HDR_SIZE, BUF_DATA(pbuf), size);
+    pbuf->size = size;
+    BUF_PROTOCOL(pbuf) = proto;
+    os_signal(SIG_MESSAGE);
+}
+
+// ------------------------------------------------
+// Function:        eth_send()
+// ------------------------------------------------
+// Input:           Message buffer
+//                  Ethernet protocol
+// Output:          -
+// ------------------------------------------------
+// Description:     Sends a message. Single segment
+//                  buffers get the header in their
+//                  room and go out without a copy;
+//                  chains are gathered into a frame
+// ------------------------------------------------
+void eth_send(PPBUF pbuf, UInt16 prot)
+{
+    BYTE frame[ETH_FRAME_SIZE];
+    MACADDR dest;
+    BYTE *hdr;
+    PPBUF b;
+    UInt16 n;
+
+    if((eth_output == NULL) && (eth_tap_f == NULL)) return;
+
+    // -------------------
+    // destination address
+    // -------------------
+    if(prot == ETH_PROT_ARP) {
+        os_copy((BYTE *)&ARP(BUF_DATA(pbuf))->dest_hw_address,
+                (BYTE *)&dest,
+                sizeof(MACADDR));
+    } else {
+        if(!arp_get_mac(&IPH(BUF_DATA(pbuf))->dest, &dest)) return;
+    }
+
+    // --------------------
+    // header in place
+    // --------------------
+    if(pbuf->next == NULL) {
+        hdr = push_header(pbuf, ETH_HDR_SIZE);
+        if(hdr != NULL) {
+            os_copy((BYTE *)&dest, hdr, sizeof(MACADDR));
+            os_copy((BYTE *)&mac_local, hdr + 6, sizeof(MACADDR));
+            hdr[12] = (BYTE)(prot >> 8);
+            hdr[13] = (BYTE)prot;
+            if(eth_tap_f != NULL) eth_tap_f(eth_tap_arg, hdr, pbuf->size);
+            if(eth_output != NULL) eth_output(eth_port, hdr, pbuf->size);
+            pbuf->offset += ETH_HDR_SIZE;
+            pbuf->size -= ETH_HDR_SIZE;
+            return;
+        }
+    }
+
+    // --------------------
+    // gather the segments
+    // --------------------
+    os_copy((BYTE *)&dest, frame, sizeof(MACADDR));
+    os_copy((BYTE *)&mac_local, frame + 6, sizeof(MACADDR));
+    frame[12] = (BYTE)(prot >> 8);
+    frame[13] = (BYTE)prot;
+    n = ETH_HDR_SIZE;
+    for(b=pbuf; b!=NULL; b=b->next) {
+        if((n + b->size) > sizeof(frame)) return;           // larger than the MTU
+        os_copy(BUF_DATA(b), frame + n, b->size);
+        n += b->size;
+    }
+    if(eth_tap_f != NULL) eth_tap_f(eth_tap_arg, frame, n);
+    if(eth_output != NULL) eth_output(eth_port, frame, n);
+}
+
+// ------------------------------------------------
+// Function:        eth_init()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Driver initialization: a locally
+//                  administered address taken from
+//                  the stack instance, no output
+// ------------------------------------------------
+void eth_init(void)
+{
+    uintptr_t k;
+    BYTE i;
+
+    k = (uintptr_t)hermes;
+    mac_local.b[0] = 0x02;
+    for(i=1; i<sizeof(MACADDR); i++) {
+        mac_local.b[i] = (BYTE)(k >> (8 * (5 - i)));
+    }
+    eth_output = NULL;
+    eth_port = NULL;
+    eth_tap_f = NULL;
+    eth_tap_arg = NULL;
+}
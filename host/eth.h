@@ -0,0 +1,28 @@
+// ------------------------------------------------
+// Ethernet driver of the hosted build: frames are
+// handed to an output hook and come back through
+// eth_input(), so stacks may be wired to each
+// other, to a capture file or to a host device
+// ------------------------------------------------
+#define _ETH_STATE
+
+#define ETH_HDR_SIZE                    14
+#define ETH_FRAME_SIZE                  (ETH_HDR_SIZE + MTU_ETH)
+
+typedef void (*ETH_OUTPUT)(void *port, BYTE *frame, UInt16 size);
+
+typedef struct {
+    MACADDR mac;
+    ETH_OUTPUT output;                          // NULL: frames are dropped
+    void *port;                                 // output hook argument
+    ETH_OUTPUT tap;                             // sees every frame sent and received
+    void *tap_arg;
+} ETH_STATE;
+
+#define mac_local                       (hermes->eth.mac)
+
+void eth_attach(MACADDR *mac, ETH_OUTPUT output, void *port);
+void eth_tap(ETH_OUTPUT tap, void *arg);
+void eth_input(BYTE *frame, UInt16 size);
+void eth_send(PPBUF pbuf, UInt16 prot);
+void eth_init(void);
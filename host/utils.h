@@ -0,0 +1,3 @@
+// ------------------------------------------------
+// Target utilities, nothing needed on hosts
+// ------------------------------------------------
@@ -0,0 +1,416 @@
+// -------------------------------------------------------
+// File:            WIRE.C
+// Project:         Hermes
+// Description:     Virtual wire link driver, joining
+//                  stack instances in memory
+// Author:          Bruno Abrantes Basseto
+//                  bruno.basseto@uol.com.br
+// Target CPU:      x86 / ARM hosts
+// Compiler:        GCC
+// -------------------------------------------------------
+// Functions:       wire_random()
+//                  wire_chance()
+//                  wire_queue()
+//                  wire_run()
+//                  wire_thread()
+//                  wire_peer_thread()
+//                  wire_init()
+//                  wire_attach()
+//                  wire_peer()
+//                  wire_link()
+//                  wire_send()
+//                  wire_output()
+// -------------------------------------------------------
+
+#include <stdlib.h>
+#include <string.h>
+#include "defs.h"
+#include "net.h"
+#include "cronos.h"
+#include "hermes.h"
+#include "wire.h"
+
+#define DUE(t, now)                     ((int)((now) - (t)) >= 0)
+
+// ------------------------------------------------
+// Function:        wire_random()
+// ------------------------------------------------
+// Input:           Wire
+// Output:          Pseudo random number
+// ------------------------------------------------
+// Description:     Xorshift generator of the wire.
+//                  Called with the wire locked
+// ------------------------------------------------
+static UInt32 wire_random(WIRE *w)
+{
+    UInt32 x;
+
+    x = w->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    w->seed = x;
+    return x;
+}
+
+// ------------------------------------------------
+// Function:        wire_chance()
+// ------------------------------------------------
+// Input:           Wire
+//                  Probability (parts per million)
+// Output:          TRUE if the event happens
+// ------------------------------------------------
+// Description:     Draws a random event
+// ------------------------------------------------
+static BOOL wire_chance(WIRE *w, UInt32 ppm)
+{
+    if(ppm == 0) return FALSE;
+    return (wire_random(w) % 1000000) < ppm;
+}
+
+// ------------------------------------------------
+// Function:        wire_queue()
+// ------------------------------------------------
+// Input:           Receiving port
+//                  Frame
+//                  Frame size
+//                  Delivery time (ms)
+// Output:          -
+// ------------------------------------------------
+// Description:     Queues a frame by delivery time,
+//                  after those due at the same time.
+//                  Called with the wire locked
+// ------------------------------------------------
+static void wire_queue(WIRE_PORT *p, BYTE *frame, UInt16 size, UInt32 due)
+{
+    WIRE_FRAME *f;
+    WIRE_FRAME **q;
+
+    if(p->link.queue && (p->queued >= p->link.queue)) {
+        p->count.dropped++;
+        return;
+    }
+    f = (WIRE_FRAME *)malloc(sizeof(WIRE_FRAME) + size);
+    if(f == NULL) {
+        p->count.dropped++;
+        return;
+    }
+    memcpy(f->data, frame, size);
+    f->size = size;
+    f->due = due;
+
+    for(q=&p->rx; *q!=NULL; q=&(*q)->next)
+        if((int)((*q)->due - due) > 0) break;
+    f->next = *q;
+    *q = f;
+    p->queued++;
+    os_post(p->domain, SIG_WIRE);
+}
+
+// ------------------------------------------------
+// Function:        wire_run()
+// ------------------------------------------------
+// Input:           Port
+// Output:          -
+// ------------------------------------------------
+// Description:     Receiver loop of a port: hands
+//                  each frame over once it is due
+// ------------------------------------------------
+static void wire_run(WIRE_PORT *p)
+{
+    WIRE *w;
+    WIRE_FRAME *f;
+    UInt32 now;
+    UInt32 wait;
+
+    w = p->wire;
+    while(os_not_terminated()) {
+        pthread_mutex_lock(&w->lock);
+        now = os_clock();
+        while((p->rx != NULL) && DUE(p->rx->due, now)) {
+            f = p->rx;
+            p->rx = f->next;
+            p->queued--;
+            p->count.rx++;
+            pthread_mutex_unlock(&w->lock);
+
+            if(p->peer != NULL) p->peer(p->arg, f->data, f->size);
+            else eth_input(f->data, f->size);
+            free(f);
+
+            pthread_mutex_lock(&w->lock);
+            now = os_clock();
+        }
+
+        // -----------------------------
+        // sleep until the next frame is
+        // due or another one is queued
+        // -----------------------------
+        wait = 0;
+        if(p->rx != NULL) {
+            wait = p->rx->due - now;
+            if(wait > 0xffff) wait = 0xffff;
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        os_set_timeout((UInt16)wait);
+        os_wait(SIG_WIRE);
+    }
+
+    // ---------------
+    // finishes thread
+    // ---------------
+    pthread_mutex_lock(&w->lock);
+    while((f = p->rx) != NULL) {
+        p->rx = f->next;
+        free(f);
+    }
+    p->queued = 0;
+    pthread_mutex_unlock(&w->lock);
+}
+
+// ------------------------------------------------
+// Function:        wire_thread()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Receiver thread of a stack
+// ------------------------------------------------
+static void wire_thread(void)
+{
+    wire_run((WIRE_PORT *)hermes->eth.port);
+}
+
+// ------------------------------------------------
+// Function:        wire_peer_thread()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Receiver thread of a scripted
+//                  peer, whose domain is its port
+// ------------------------------------------------
+static void wire_peer_thread(void)
+{
+    wire_run((WIRE_PORT *)os_domain);
+}
+
+// ------------------------------------------------
+// Function:        wire_init()
+// ------------------------------------------------
+// Input:           Wire
+//                  Random seed
+// Output:          -
+// ------------------------------------------------
+// Description:     Wire initialization
+// ------------------------------------------------
+void wire_init(WIRE *w, UInt32 seed)
+{
+    memset(w, 0, sizeof(WIRE));
+    w->seed = seed? seed: 1;
+    pthread_mutex_init(&w->lock, NULL);
+}
+
+// ------------------------------------------------
+// Function:        wire_attach()
+// ------------------------------------------------
+// Input:           Wire
+//                  Link of the port
+// Output:          Port or WIRE_NONE
+// ------------------------------------------------
+// Description:     Connects the ethernet interface
+//                  of the current stack, after
+//                  hermes_init()
+// ------------------------------------------------
+BYTE wire_attach(WIRE *w, WIRE_LINK *link)
+{
+    WIRE_PORT *p;
+    BYTE n;
+
+    pthread_mutex_lock(&w->lock);
+    if(w->ports >= WIRE_PORTS) {
+        pthread_mutex_unlock(&w->lock);
+        return WIRE_NONE;
+    }
+    n = w->ports++;
+    p = &w->port[n];
+    p->wire = w;
+    p->domain = hermes;
+    os_copy((BYTE *)&mac_local, (BYTE *)&p->mac, sizeof(MACADDR));
+    if(link != NULL) p->link = *link;
+    pthread_mutex_unlock(&w->lock);
+
+    eth_attach(NULL, wire_output, p);
+    os_start(THRD_WIRE, wire_thread, 0);
+    return n;
+}
+
+// ------------------------------------------------
+// Function:        wire_peer()
+// ------------------------------------------------
+// Input:           Wire
+//                  MAC address of the peer
+//                  Link of the port
+//                  Receive function
+//                  Its argument
+// Output:          Port or WIRE_NONE
+// ------------------------------------------------
+// Description:     Connects a scripted peer, which
+//                  gets its frames on a thread of
+//                  its own and sends with
+//                  wire_send()
+// ------------------------------------------------
+BYTE wire_peer(WIRE *w, MACADDR *mac, WIRE_LINK *link, WIRE_PEER f, void *arg)
+{
+    WIRE_PORT *p;
+    void *domain;
+    BYTE n;
+
+    pthread_mutex_lock(&w->lock);
+    if(w->ports >= WIRE_PORTS) {
+        pthread_mutex_unlock(&w->lock);
+        return WIRE_NONE;
+    }
+    n = w->ports++;
+    p = &w->port[n];
+    p->wire = w;
+    p->domain = p;
+    os_copy((BYTE *)mac, (BYTE *)&p->mac, sizeof(MACADDR));
+    if(link != NULL) p->link = *link;
+    p->peer = f;
+    p->arg = arg;
+    pthread_mutex_unlock(&w->lock);
+
+    domain = os_domain;
+    os_enter(p);
+    os_start(THRD_WIRE, wire_peer_thread, 0);
+    os_enter(domain);
+    return n;
+}
+
+// ------------------------------------------------
+// Function:        wire_link()
+// ------------------------------------------------
+// Input:           Wire
+//                  Port
+//                  New link
+// Output:          -
+// ------------------------------------------------
+// Description:     Changes the link of a port, for
+//                  the frames sent from now on
+// ------------------------------------------------
+void wire_link(WIRE *w, BYTE port, WIRE_LINK *link)
+{
+    if(port >= w->ports) return;
+    pthread_mutex_lock(&w->lock);
+    w->port[port].link = *link;
+    pthread_mutex_unlock(&w->lock);
+}
+
+// ------------------------------------------------
+// Function:        wire_send()
+// ------------------------------------------------
+// Input:           Wire
+//                  Sending port
+//                  Frame (with ethernet header)
+//                  Frame size
+// Output:          -
+// ------------------------------------------------
+// Description:     Transmits a frame: it leaves
+//                  once the link is free, after its
+//                  serialization time, and reaches
+//                  the other ports after the
+//                  latency of the link
+// ------------------------------------------------
+void wire_send(WIRE *w, BYTE port, BYTE *frame, UInt16 size)
+{
+    WIRE_PORT *s;
+    WIRE_PORT *d;
+    uint64_t now;
+    UInt32 sent, due;
+    BOOL flood, held;
+    BYTE copies, i, c;
+
+    if((port >= w->ports) || (size < 14)) return;
+    s = &w->port[port];
+
+    pthread_mutex_lock(&w->lock);
+    s->count.tx++;
+
+    // -------------------
+    // serialization delay
+    // -------------------
+    now = (uint64_t)os_clock() * 1000;
+    if(s->busy < now) s->busy = now;
+    if(s->link.bandwidth) s->busy += ((uint64_t)size * 8 * 1000000) / s->link.bandwidth;
+    sent = (UInt32)((s->busy + 999) / 1000);
+
+    if(wire_chance(w, s->link.loss)) {
+        s->count.lost++;
+        pthread_mutex_unlock(&w->lock);
+        return;
+    }
+    copies = 1;
+    if(wire_chance(w, s->link.duplicate)) {
+        s->count.duplicated++;
+        copies = 2;
+    }
+
+    // -------------------------
+    // known unicast destination
+    // -------------------------
+    flood = TRUE;
+    if(!(frame[0] & 1)) {
+        for(i=0; i<w->ports; i++) {
+            if((i != port) && !memcmp(frame, &w->port[i].mac, sizeof(MACADDR))) {
+                flood = FALSE;
+                break;
+            }
+        }
+    }
+
+    for(c=0; c<copies; c++) {
+        // ---------------------------------
+        // jitter keeps the order, reordered
+        // frames are held back on their own
+        // ---------------------------------
+        due = sent + s->link.latency;
+        if(s->link.jitter) due += wire_random(w) % (s->link.jitter + 1);
+        held = wire_chance(w, s->link.reorder);
+        if(held) {
+            s->count.reordered++;
+            due += s->link.reorder_delay;
+        } else {
+            if((int)(s->last - due) > 0) due = s->last;
+            s->last = due;
+        }
+
+        for(i=0; i<w->ports; i++) {
+            if(i == port) continue;
+            d = &w->port[i];
+            if(!flood && memcmp(frame, &d->mac, sizeof(MACADDR))) continue;
+            wire_queue(d, frame, size, due);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+// ------------------------------------------------
+// Function:        wire_output()
+// ------------------------------------------------
+// Input:           Port
+//                  Frame
+//                  Frame size
+// Output:          -
+// ------------------------------------------------
+// Description:     Ethernet output hook of the
+//                  attached stacks
+// ------------------------------------------------
+void wire_output(void *port, BYTE *frame, UInt16 size)
+{
+    WIRE_PORT *p;
+
+    p = (WIRE_PORT *)port;
+    wire_send(p->wire, (BYTE)(p - p->wire->port), frame, size);
+}
@@ -0,0 +1,74 @@
+// ------------------------------------------------
+// Virtual wire: an in-memory ethernet segment
+// joining stack instances and scripted peers.
+// Frames are switched by destination address
+// (group addresses and unknown ones are flooded)
+// and shaped by the link of the sending port.
+// Random effects come from the wire seed, so a
+// run on the virtual clock is repeatable
+// ------------------------------------------------
+#include <pthread.h>
+#include <stdint.h>
+
+#define WIRE_NONE                       0xff
+
+// ---------------------------------------------
+// Link of a port, applied to the frames it sends.
+// Probabilities in parts per million
+// ---------------------------------------------
+typedef struct {
+    UInt32 bandwidth;                           // bits per second, 0 unlimited
+    UInt16 latency;                             // ms
+    UInt16 jitter;                              // ms added at random, order kept
+    UInt32 loss;
+    UInt32 duplicate;
+    UInt32 reorder;                             // held back, later frames overtake it
+    UInt16 reorder_delay;                       // ms
+    UInt16 queue;                               // frames waiting at the receiver, 0 unlimited
+} WIRE_LINK;
+
+typedef struct {
+    UInt32 tx;
+    UInt32 rx;
+    UInt32 lost;
+    UInt32 duplicated;
+    UInt32 reordered;
+    UInt32 dropped;                             // receiver queue full
+} WIRE_COUNTERS;
+
+typedef void (*WIRE_PEER)(void *arg, BYTE *frame, UInt16 size);
+
+typedef struct _WIRE_FRAME {
+    struct _WIRE_FRAME *next;
+    UInt32 due;                                 // delivery time (ms)
+    UInt16 size;
+    BYTE data[];
+} WIRE_FRAME;
+
+typedef struct {
+    struct _WIRE *wire;
+    void *domain;                               // stack instance, or the port for peers
+    MACADDR mac;
+    WIRE_LINK link;
+    uint64_t busy;                              // link busy until (us)
+    UInt32 last;                                // last delivery time (ms), keeps order
+    WIRE_FRAME *rx;                             // sorted by delivery time
+    UInt16 queued;
+    WIRE_PEER peer;                             // NULL for stacks
+    void *arg;
+    WIRE_COUNTERS count;
+} WIRE_PORT;
+
+typedef struct _WIRE {
+    WIRE_PORT port[WIRE_PORTS];
+    BYTE ports;
+    UInt32 seed;
+    pthread_mutex_t lock;
+} WIRE;
+
+void wire_init(WIRE *w, UInt32 seed);
+BYTE wire_attach(WIRE *w, WIRE_LINK *link);
+BYTE wire_peer(WIRE *w, MACADDR *mac, WIRE_LINK *link, WIRE_PEER f, void *arg);
+void wire_link(WIRE *w, BYTE port, WIRE_LINK *link);
+void wire_send(WIRE *w, BYTE port, BYTE *frame, UInt16 size);
+void wire_output(void *port, BYTE *frame, UInt16 size);
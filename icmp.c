@@ -16,15 +16,17 @@
 // Functions:       icmp_checksum()
 //                  ping_request()
 //                  ping()
+//                  mtu_plateau()
+//                  echo_copy()
 //                  icmp_parse()
 // -------------------------------------------------------
 
 #include <stdlib.h>
 #include "defs.h"
 #include "net.h"
-#include "checksum.h"
 #include "cronos.h"
 #include "hermes.h"
+#include "checksum.h"
 
 #ifdef _ICMP
 
@@ -33,6 +35,8 @@
 // ------------------
 #define PING_REQUEST                    8
 #define PING_REPLY                      0
+#define DEST_UNREACHABLE                3
+#define FRAG_NEEDED                     4       // unreachable code
 
 #define IPH(xxx) ((IP_HDR *)xxx)
 #define ICMP(xxx) ((ICMP_HDR *)xxx)
@@ -83,25 +87,27 @@ void ping_request(IPV4 ip, BYTE interface)
 {
     PPBUF buf;
 
-    buf = ip_new(ip, 64, interface);
+    buf = ip_new(ip, 64, interface, QUOTA_CONTROL);
     if(buf == NULL) return;
 
     // ---------------------
     // assemble ICMP message
     // ---------------------
-    IPH(buf->start)->prot = IP_PROT_ICMP;
-    ICMP(buf->data)->type = PING_REQUEST;
-    ICMP(buf->data)->code = 0;
-    ICMP(buf->data)->checksum = 0;
-    ICMP(buf->data)->id = random();
-    ICMP(buf->data)->seq = random();
+    IPH(BUF_START(buf))->prot = IP_PROT_ICMP;
+    ICMP(BUF_DATA(buf))->type = PING_REQUEST;
+    ICMP(BUF_DATA(buf))->code = 0;
+    ICMP(BUF_DATA(buf))->checksum = 0;
+    ICMP(BUF_DATA(buf))->id = random();
+    ICMP(BUF_DATA(buf))->seq = random();
     buf->size = sizeof(ICMP_HDR);
+    STAT_INC(icmp.out_msgs);
+    STAT_INC(icmp.out_echos);
 
     // ------------------
     // calculate checksum
     // ------------------
-    icmp_checksum(buf->data, buf->size);
-    ICMP(buf->data)->checksum = HTONS(~WORDOF(chk_H, chk_L));
+    icmp_checksum(BUF_DATA(buf), buf->size);
+    ICMP(BUF_DATA(buf))->checksum = HTONS(~WORDOF(chk_H, chk_L));
 
     // -----------------------------
     // sends message to IP interface
@@ -132,6 +138,71 @@ BOOL ping(IPV4 ip, BYTE interface)
     return FALSE;
 }	
 
+// ------------------------------------------------
+// Function:        mtu_plateau()
+// ------------------------------------------------
+// Input:           Size of the datagram refused
+// Output:          Next path MTU to try
+// ------------------------------------------------
+// Description:     Guess for routers that do not
+//                  report the next hop MTU
+//                  (RFC 1191 plateau table)
+// ------------------------------------------------
+static UInt16 mtu_plateau(UInt16 size)
+{
+    if(size > 1492) return 1492;
+    if(size > 1006) return 1006;
+    if(size > 576) return 576;
+    return 296;
+}
+
+// ------------------------------------------------
+// Function:        echo_copy()
+// ------------------------------------------------
+// Input:           Looped back echo request
+// Output:          Private copy or NULL
+// ------------------------------------------------
+// Description:     A looped back request is a view
+//                  of the sender's buffer: the
+//                  answer gets its own IP and ICMP
+//                  headers, the data (only read)
+//                  is still shared
+// ------------------------------------------------
+static PPBUF echo_copy(PPBUF pbuf)
+{
+    PPBUF res;
+    PPBUF seg;
+
+    if(pbuf->size < sizeof(ICMP_HDR)) return NULL;
+    res = quota_buffer(sizeof(IP_HDR) + sizeof(ICMP_HDR), INTERFACE_LOOP, QUOTA_CONTROL);
+    if(res == NULL) return NULL;
+
+    os_copy(BUF_START(pbuf), BUF_START(res), sizeof(IP_HDR));
+    res->offset += sizeof(IP_HDR);
+    res->pos = res->offset;
+    os_copy(BUF_DATA(pbuf), BUF_DATA(res), sizeof(ICMP_HDR));
+    res->size = sizeof(ICMP_HDR);
+
+    // -----------------------
+    // shares the echoed data
+    // -----------------------
+    if(pbuf->size > sizeof(ICMP_HDR)) {
+        seg = slice_buffer(pbuf, sizeof(ICMP_HDR), pbuf->size - sizeof(ICMP_HDR));
+        if(seg == NULL) goto error;
+        chain_buffer(res, seg);
+    }
+    if(pbuf->next != NULL) {
+        seg = clone_buffer(pbuf->next);
+        if(seg == NULL) goto error;
+        chain_buffer(res, seg);
+    }
+    return res;
+
+error:
+    release_buffer(res);
+    return NULL;
+}
+
 // ------------------------------------------------
 // Function:        icmp_parse()
 // ------------------------------------------------
@@ -142,31 +213,48 @@ BOOL ping(IPV4 ip, BYTE interface)
 // ------------------------------------------------
 void icmp_parse(PPBUF pbuf)
 {
+    IP_HDR orig;
+    UInt16 mtu;
+
+    STAT_INC(icmp.in_msgs);
+
     // ---------------------
     // checksum verification
     // ---------------------
-    icmp_checksum(pbuf->data, pbuf->size);
-    if(chk_H != 0xff) return;
-    if(chk_L != 0xff) return;
+    if(pbuf->interface != INTERFACE_LOOP) {                 // not computed on loopback
+        check_buffer(pbuf);                                 // every segment of a reassembled chain
+        if((chk_H != 0xff) || (chk_L != 0xff)) {
+            STAT_INC(icmp.in_errors);
+            return;
+        }
+    }
 
     // -------------------------------
     // checks recognized message types
     // -------------------------------
-    switch(ICMP(pbuf->data)->type) {
+    switch(ICMP(BUF_DATA(pbuf))->type) {
         case PING_REQUEST:
             // ---------
             // answer it
             // ---------
-            retain_buffer(pbuf);
+            STAT_INC(icmp.in_echos);
+            if(pbuf->interface == INTERFACE_LOOP) {
+                pbuf = echo_copy(pbuf);                     // never written: shared with the sender
+                if(pbuf == NULL) break;
+            } else retain_buffer(pbuf);
+            STAT_INC(icmp.out_msgs);
+            STAT_INC(icmp.out_echo_reps);
             ip_answer(pbuf);
-            ICMP(pbuf->data)->type = PING_REPLY;
+            ICMP(BUF_DATA(pbuf))->type = PING_REPLY;
 
-            // ---------------
-            // update checksum
-            // ---------------
-            ICMP(pbuf->data)->checksum = 0;
-            icmp_checksum(pbuf->data, pbuf->size);
-            ICMP(pbuf->data)->checksum = HTONS(~WORDOF(chk_H, chk_L));
+            // ------------------------------------
+            // update checksum (not on loopback)
+            // ------------------------------------
+            ICMP(BUF_DATA(pbuf))->checksum = 0;
+            if(pbuf->interface != INTERFACE_LOOP) {
+                check_buffer(pbuf);
+                ICMP(BUF_DATA(pbuf))->checksum = HTONS(~WORDOF(chk_H, chk_L));
+            }
 
             // ----------------------------
             // sends answer to IP interface
@@ -179,8 +267,30 @@ void icmp_parse(PPBUF pbuf)
             // --------------------------------------
             // answer received, signal waiting thread
             // --------------------------------------
+            STAT_INC(icmp.in_echo_reps);
             os_signal(SIG_ICMP);
             break;
+
+        case DEST_UNREACHABLE:
+            // --------------------------------------------
+            // path MTU discovery: the original header
+            // follows the ICMP one, with the path MTU in
+            // the (unused) sequence field. It is only
+            // believed for a datagram we could have sent
+            // --------------------------------------------
+            STAT_INC(icmp.in_dest_unreachs);
+            if(ICMP(BUF_DATA(pbuf))->code != FRAG_NEEDED) break;
+            if(buffer_size(pbuf) < (sizeof(ICMP_HDR) + sizeof(IP_HDR))) break;
+            skip(pbuf, sizeof(ICMP_HDR));
+            read_buf(pbuf, (BYTE *)&orig, sizeof(IP_HDR));  // the quote may span segments
+            if(orig.ver_length != 0x45) break;              // ip_new() sends no options
+            if(orig.source.d != ip_local[pbuf->interface].d) break;
+            if((orig.prot != IP_PROT_TCP) && (orig.prot != IP_PROT_UDP) && (orig.prot != IP_PROT_ICMP)) break;
+            mtu = NTOHS(ICMP(BUF_DATA(pbuf))->seq);
+            if(mtu == 0) mtu = mtu_plateau(NTOHS(orig.length));
+            if(mtu < PMTU_MIN) break;                       // below the lowest plateau
+            route_set_mtu(&orig.dest, mtu);
+            break;
     }
 }
 #endif
@@ -16,25 +16,27 @@
 //                  ip_checksum()
 //                  ip_answer()
 //                  ip_new()
+//                  ip_is_local()
+//                  ip_loopback()
+//                  ip_link()
+//                  ip_fragment()
 //                  ip_send()
 //                  parse_ip()
+//                  ip_deliver()
 //                  ip_init()
 // -------------------------------------------------------
 
 #include <stdlib.h>
 #include "defs.h"
 #include "net.h"
-#include "checksum.h"
 #include "cronos.h"
 #include "hermes.h"
+#include "checksum.h"
 
-// -----------------------
-// IP protocol information
-// -----------------------
-IPV4 ip_local[MAX_INTERFACES];                      // IP local address for each network interface
-IPV4 ip_mask[MAX_INTERFACES];                       // IP mask for each network interface
-IPV4 ip_gateway[MAX_INTERFACES];                    // IP gateway for each network interface
-UInt16 id;                                          // datagram ID
+// --------------------------
+// state of the current stack
+// --------------------------
+#define ip_id                           (hermes->ip.id)
 
 #define IPH(xxx) ((IP_HDR *)xxx)
 
@@ -88,12 +90,12 @@ void ip_answer(PPBUF pbuf)
     // -----------------
     // changes IP header
     // -----------------
-    IPH(pbuf->start)->id = HTONS(id);
-    IPH(pbuf->start)->checksum = 0;
-    os_swap((BYTE *)&IPH(pbuf->start)->source,			// swap addresses
-            (BYTE *)&IPH(pbuf->start)->dest,
+    IPH(BUF_START(pbuf))->id = HTONS(ip_id);
+    IPH(BUF_START(pbuf))->checksum = 0;
+    os_swap((BYTE *)&IPH(BUF_START(pbuf))->source,			// swap addresses
+            (BYTE *)&IPH(BUF_START(pbuf))->dest,
             sizeof(IPV4));
-    id++;
+    ip_id++;
 }	
 
 // ------------------------------------------------
@@ -101,73 +103,136 @@ void ip_answer(PPBUF pbuf)
 // ------------------------------------------------
 // Input:           Destination address
 //                  Size
-//                  Network interface ID
+//                  Network interface ID (or
+//                  INTERFACE_AUTO)
+//                  Buffer class (QUOTA_...)
 // Output:          Empty message buffer
 // ------------------------------------------------
 // Description:     Returns a free buffer to be
 //                  filled with a higher level
 //                  protocol
 // ------------------------------------------------
-PPBUF ip_new(IPV4 dest, UInt16 tam, BYTE interface)
+PPBUF ip_new(IPV4 dest, UInt16 tam, BYTE interface, BYTE quota)
 {
     PPBUF pbuf;
+    IPV4 hop;
+
+    HERMES_LOCK();
+    if(interface == INTERFACE_AUTO)
+        if(!route_lookup(&dest, &interface, &hop)) {
+            STAT_INC(ip.out_no_routes);
+            HERMES_UNLOCK();
+            return NULL;                                            // no route to host
+        }
 
-    pbuf = get_buffer(tam);
-    if(pbuf == NULL) return NULL;
+    pbuf = quota_buffer(tam, interface, quota);
+    if(pbuf == NULL) {
+        STAT_INC(ip.out_discards);
+        HERMES_UNLOCK();
+        return NULL;
+    }
 
     // ---------------
     // setup IP header
     // ---------------
-    IPH(pbuf->start)->ver_length = 0x45;
-    IPH(pbuf->start)->tos = TOSV;
-    IPH(pbuf->start)->length = 0;
-    IPH(pbuf->start)->id = HTONS(id);
-    IPH(pbuf->start)->frag = 0;
-    IPH(pbuf->start)->ttl = TTL;
-    IPH(pbuf->start)->prot = IP_PROT_TCP;
-    IPH(pbuf->start)->checksum = 0;
-    IPH(pbuf->start)->source.d = ip_local[interface].d;
-    IPH(pbuf->start)->dest.d = dest.d;
-    id++;
+    IPH(BUF_START(pbuf))->ver_length = 0x45;
+    IPH(BUF_START(pbuf))->tos = TOSV;
+    IPH(BUF_START(pbuf))->length = 0;
+    IPH(BUF_START(pbuf))->id = HTONS(ip_id);
+    IPH(BUF_START(pbuf))->frag = 0;
+    IPH(BUF_START(pbuf))->ttl = TTL;
+    IPH(BUF_START(pbuf))->prot = IP_PROT_TCP;
+    IPH(BUF_START(pbuf))->checksum = 0;
+    IPH(BUF_START(pbuf))->source.d = ip_local[interface].d;
+    IPH(BUF_START(pbuf))->dest.d = dest.d;
+    ip_id++;
+    HERMES_UNLOCK();
 
     // --------------------
     // setup message buffer
     // --------------------
     pbuf->interface = interface;
-    pbuf->data += sizeof(IP_HDR);
-    pbuf->ptr = pbuf->data;
+    pbuf->offset += sizeof(IP_HDR);
+    pbuf->pos = pbuf->offset;
     pbuf->size = 0;
     return pbuf;
 }	
 
 // ------------------------------------------------
-// Function:        ip_send()
+// Function:        ip_is_local()
 // ------------------------------------------------
-// Input:           Message buffer
+// Input:           IP address
+// Output:          TRUE if it is this host
+// ------------------------------------------------
+// Description:     Checks for loopback addresses
+//                  and the addresses of every
+//                  interface
+// ------------------------------------------------
+BOOL ip_is_local(IPV4 *ip)
+{
+#ifdef _LOOP
+    BYTE i;
+
+    if(ip->b[0] == 127) return TRUE;
+    for(i=0; i<MAX_INTERFACES; i++)
+        if(ip_local[i].d && (ip->d == ip_local[i].d)) return TRUE;
+#endif
+    return FALSE;
+}
+
+#ifdef _LOOP
+// ------------------------------------------------
+// Function:        ip_loopback()
+// ------------------------------------------------
+// Input:           Message buffer (with header)
 // Output:          -
 // ------------------------------------------------
-// Description:     Transfer an IP message to link
-//                  layer
+// Description:     Delivers a local datagram back
+//                  to the Hermes thread, through a
+//                  zero-copy view of the buffer.
+//                  No checksum is computed nor
+//                  verified on this path
 // ------------------------------------------------
-void ip_send(PPBUF pbuf)
+static void ip_loopback(PPBUF pbuf)
 {
-    // ------------------------
-    // backup to message header
-    // ------------------------
-    pbuf->data = pbuf->start;
+    PPBUF b;
 
-    // ------------
-    // adjusts size
-    // ------------
-    pbuf->size += sizeof(IP_HDR);
-    IPH(pbuf->start)->length = HTONS(pbuf->size);
+    b = clone_buffer(pbuf);
+    if(b == NULL) {
+        STAT_INC(ip.out_discards);
+        return;
+    }
+
+    b->interface = INTERFACE_LOOP;
+    b->offset += sizeof(IP_HDR);
+    b->pos = b->offset;
+    b->size -= sizeof(IP_HDR);
+    ip_deliver(b);
+    release_buffer(b);
+    os_signal(SIG_MESSAGE);
+}
+#endif
+
+// ------------------------------------------------
+// Function:        ip_link()
+// ------------------------------------------------
+// Input:           Message buffer (with header)
+// Output:          -
+// ------------------------------------------------
+// Description:     Updates the header checksum and
+//                  transfers the datagram to its
+//                  link layer
+// ------------------------------------------------
+static void ip_link(PPBUF pbuf)
+{
+    LAT_MARK(pbuf, LAT_TX_STACK);
 
     // ---------------
     // update checksum
     // ---------------
-    IPH(pbuf->start)->checksum = 0;
-    ip_checksum((BYTE *)pbuf->start, sizeof(IP_HDR));
-    IPH(pbuf->start)->checksum = HTONS(~WORDOF(chk_H, chk_L));
+    IPH(BUF_START(pbuf))->checksum = 0;
+    ip_checksum((BYTE *)BUF_START(pbuf), sizeof(IP_HDR));
+    IPH(BUF_START(pbuf))->checksum = HTONS(~WORDOF(chk_H, chk_L));
 
     // ------------------------------
     // verify interface to link layer
@@ -180,10 +245,139 @@ void ip_send(PPBUF pbuf)
 #endif
 #ifdef _ETH			
         case INTERFACE_ETH:
-            eth_send(pbuf, ETH_PROT_IP);
+            arp_send(pbuf);                         // never blocks on resolution
             break;
 #endif
     }
+}
+
+// ------------------------------------------------
+// Function:        ip_fragment()
+// ------------------------------------------------
+// Input:           Message buffer (with header)
+//                  Path MTU
+// Output:          -
+// ------------------------------------------------
+// Description:     Sends a datagram larger than
+//                  the path MTU as fragments. Each
+//                  one has its own header buffer
+//                  followed by slices of the
+//                  original payload (no copying)
+// ------------------------------------------------
+static void ip_fragment(PPBUF pbuf, UInt16 mtu)
+{
+    PPBUF frag;
+    PPBUF tail;
+    PPBUF seg;
+    PPBUF s;
+    UInt16 total, offset, max, len, n, pos, f;
+
+    max = (mtu - sizeof(IP_HDR)) & ~7;                  // offsets are multiples of 8
+    total = buffer_size(pbuf) - sizeof(IP_HDR);
+    seg = pbuf;
+    pos = sizeof(IP_HDR);
+
+    for(offset=0; offset<total; offset+=len) {
+        len = total - offset;
+        if(len > max) len = max;
+
+        frag = quota_buffer(sizeof(IP_HDR), pbuf->interface, QUOTA_CONTROL);  // datagram already admitted
+        if(frag == NULL) {
+            STAT_INC(ip.frag_fails);
+            return;
+        }
+        os_copy((BYTE *)BUF_START(pbuf), (BYTE *)BUF_START(frag), sizeof(IP_HDR));
+        frag->size = sizeof(IP_HDR);
+        LAT_COPY(frag, pbuf);
+
+        // -------------------------------------------
+        // chain slices of the payload, they may span
+        // several segments of the original chain
+        // -------------------------------------------
+        tail = frag;
+        for(n=len; n; n-=f) {
+            while(pos >= seg->size) {
+                seg = seg->next;
+                pos = 0;
+            }
+            f = seg->size - pos;
+            if(f > n) f = n;
+            s = slice_buffer(seg, pos, f);
+            if(s == NULL) {
+                STAT_INC(ip.frag_fails);
+                release_buffer(frag);
+                return;
+            }
+            tail->next = s;
+            tail = s;
+            pos += f;
+        }
+
+        // -------------
+        // update header
+        // -------------
+        f = sizeof(IP_HDR) + len;
+        IPH(BUF_START(frag))->length = HTONS(f);
+        f = offset >> 3;
+        if((offset + len) < total) f |= IP_MF;
+        IPH(BUF_START(frag))->frag = HTONS(f);
+
+        ip_link(frag);
+        release_buffer(frag);
+        STAT_INC(ip.frag_creates);
+    }
+    STAT_INC(ip.frag_oks);
+}
+
+// ------------------------------------------------
+// Function:        ip_send()
+// ------------------------------------------------
+// Input:           Message buffer
+// Output:          -
+// ------------------------------------------------
+// Description:     Transfer an IP message to link
+//                  layer, fragmenting it if it
+//                  does not fit the path MTU
+// ------------------------------------------------
+void ip_send(PPBUF pbuf)
+{
+    UInt16 t;
+    UInt16 mtu;
+
+    // ------------------------
+    // backup to message header
+    // ------------------------
+    pbuf->offset = pbuf->room;
+
+    // ------------
+    // adjusts size
+    // ------------
+    pbuf->size += sizeof(IP_HDR);
+    t = buffer_size(pbuf);
+    IPH(BUF_START(pbuf))->length = HTONS(t);
+
+    HERMES_LOCK();
+    STAT_INC(ip.out_requests);
+#ifdef _LOOP
+    if(ip_is_local(&IPH(BUF_START(pbuf))->dest)) {
+        ip_loopback(pbuf);
+        HERMES_UNLOCK();
+        pbuf->size -= sizeof(IP_HDR);
+        return;
+    }
+#endif
+
+    mtu = route_mtu(&IPH(BUF_START(pbuf))->dest, pbuf->interface);
+    if(t > mtu) {
+        // ---------------------------------------
+        // too large: fragmented here even if DF
+        // was asked, the path MTU is already known
+        // ---------------------------------------
+        ip_fragment(pbuf, mtu);
+    } else {
+        ip_link(pbuf);
+    }
+    HERMES_UNLOCK();
 	
     pbuf->size -= sizeof(IP_HDR);
 }	
@@ -201,57 +395,97 @@ void parse_ip(PPBUF pbuf)
     UInt16 t;
     BYTE i;
 
+    STAT_INC(ip.in_receives);
+
     // -----------------
     // check packet size
     // -----------------
-    t = NTOHS(IPH(pbuf->data)->length);
-    if(pbuf->size < t) return;								// test for inconsistent sizes
+    t = NTOHS(IPH(BUF_DATA(pbuf))->length);
+    if(pbuf->size < t) goto hdr_error;						// test for inconsistent sizes
     pbuf->size = t;											// remove pads
-    t = (IPH(pbuf->data)->ver_length & 0x0f) << 2;			// IP header size
+    t = (IPH(BUF_DATA(pbuf))->ver_length & 0x0f) << 2;			// IP header size
     i = pbuf->interface;
-    if(i >= MAX_INTERFACES) return;							// test for inconsistent interfaces
+    if(i >= MAX_INTERFACES) goto hdr_error;					// test for inconsistent interfaces
 
     // --------------
     // tests checksum
     // --------------
-    ip_checksum((BYTE *)pbuf->data, t);
-    if(chk_H != 0xff) return;								// wrong checksum
-    if(chk_L != 0xff) return;								// wrong checksum
+    ip_checksum((BYTE *)BUF_DATA(pbuf), t);
+    if((chk_H != 0xff) || (chk_L != 0xff)) {				// wrong checksum
+        STAT_INC(ip.in_csum_errors);
+        return;
+    }
 
     // -------------------------
     // check destination address
     // -------------------------
-    if(IPH(pbuf->data)->dest.d != 0xffffffff)				// broadcast address?
-        if(IPH(pbuf->data)->dest.d != ip_local[i].d)	  	// unicast address?
+    if(IPH(BUF_DATA(pbuf))->dest.d != 0xffffffff)				// broadcast address?
+        if(IPH(BUF_DATA(pbuf))->dest.d != ip_local[i].d) {	  	// unicast address?
+            STAT_INC(ip.in_addr_errors);
             return;											// not a local IP
+        }
 
 
-    // --------------------------------
-    // remove header and check protocol
-    // --------------------------------
-    pbuf->data += t;
-    pbuf->ptr = pbuf->data;
+    // -------------
+    // remove header
+    // -------------
+    pbuf->offset += t;
+    pbuf->pos = pbuf->offset;
     pbuf->size -= t;
-    switch(IPH(pbuf->start)->prot) {
+
+    // ---------------------------------------
+    // fragments are held until the datagram
+    // is complete
+    // ---------------------------------------
+    if(NTOHS(IPH(BUF_START(pbuf))->frag) & (IP_MF | IP_OFFSET)) {
+#ifdef _IP_FRAG
+        ip_reassemble(pbuf);
+#endif
+        return;
+    }
+    ip_deliver(pbuf);
+    return;
+
+hdr_error:
+    STAT_INC(ip.in_hdr_errors);
+}
+
+// ------------------------------------------------
+// Function:        ip_deliver()
+// ------------------------------------------------
+// Input:           Message buffer (IP header
+//                  removed)
+// Output:          -
+// ------------------------------------------------
+// Description:     Hands a datagram to its
+//                  transport protocol
+// ------------------------------------------------
+void ip_deliver(PPBUF pbuf)
+{
+    switch(IPH(BUF_START(pbuf))->prot) {
 #ifdef _TCP
         case IP_PROT_TCP:
             retain_buffer(pbuf);
-            pbuf->protocol = BUFFER_TCP;
+            BUF_PROTOCOL(pbuf) = BUFFER_TCP;
             break;
 #endif
 #ifdef _UDP
         case IP_PROT_UDP:
             retain_buffer(pbuf);
-            pbuf->protocol = BUFFER_UDP;
+            BUF_PROTOCOL(pbuf) = BUFFER_UDP;
             break;
 #endif
 #ifdef _ICMP
         case IP_PROT_ICMP:
             retain_buffer(pbuf);
-            pbuf->protocol = BUFFER_ICMP;
+            BUF_PROTOCOL(pbuf) = BUFFER_ICMP;
             break;
 #endif
+        default:
+            STAT_INC(ip.in_unknown_protos);
+            return;
     }
+    STAT_INC(ip.in_delivers);
 }
 
 // ------------------------------------------------
@@ -264,6 +498,10 @@ void parse_ip(PPBUF pbuf)
 // ------------------------------------------------
 void ip_init(void)
 {
+#ifdef _LOOP
+    ip_local[INTERFACE_LOOP] = make_ipv4(127, 0, 0, 1);
+    ip_mask[INTERFACE_LOOP] = make_ipv4(255, 0, 0, 0);
+#endif
     // AQUI
 
 //	ip_local[0] = ext_ip_at(CFG_IP_LOCAL);
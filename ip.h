@@ -1,13 +1,25 @@
 
 
-extern IPV4 ip_local[MAX_INTERFACES];
-extern IPV4 ip_mask[MAX_INTERFACES];
-extern IPV4 ip_gateway[MAX_INTERFACES];
-extern UInt16 id;
+// -----------------------
+// IP protocol information
+// -----------------------
+typedef struct {
+    IPV4 local[MAX_INTERFACES];                     // IP local address for each network interface
+    IPV4 mask[MAX_INTERFACES];                      // IP mask for each network interface
+    IPV4 gateway[MAX_INTERFACES];                   // IP gateway for each network interface
+    UInt16 id;                                      // datagram ID
+} IP_STATE;
+
+#define ip_local                        (hermes->ip.local)
+#define ip_mask                         (hermes->ip.mask)
+#define ip_gateway                      (hermes->ip.gateway)
 
 IPV4 make_ipv4(BYTE a, BYTE b, BYTE c, BYTE d);
+void ip_checksum(BYTE *p, UInt16 t);
 void ip_answer(PPBUF pbuf);
-PPBUF ip_new(IPV4 dest, UInt16 tam, BYTE interface);
+PPBUF ip_new(IPV4 dest, UInt16 tam, BYTE interface, BYTE quota);
+BOOL ip_is_local(IPV4 *ip);
 void ip_send(PPBUF pbuf);
 void parse_ip(PPBUF pbuf);
+void ip_deliver(PPBUF pbuf);
 void ip_init(void);
@@ -0,0 +1,160 @@
+// -------------------------------------------------------
+// File:            LATENCY.C
+// Project:         Hermes
+// Description:     Latency histograms of the layer
+//                  boundaries crossed by the buffers
+// Author:          Bruno Abrantes Basseto
+//                  bruno.basseto@uol.com.br
+// Target CPU:      PIC24 / PIC32
+// Compiler:        Microchip C30 v3.24
+//                  Microchip C32 v1.11a
+// -------------------------------------------------------
+// Functions:       lat_clock()
+//                  lat_add()
+//                  lat_mark()
+//                  lat_snapshot()
+//                  lat_clear()
+//                  lat_percentile()
+// -------------------------------------------------------
+
+#include <stdlib.h>
+#include "defs.h"
+#include "net.h"
+#include "cronos.h"
+#include "hermes.h"
+#ifdef _HOSTED
+#include <time.h>
+#endif
+
+#ifdef _LATENCY
+
+#ifdef _HOSTED
+// ------------------------------------------------
+// Function:        lat_clock()
+// ------------------------------------------------
+// Input:           -
+// Output:          Microseconds
+// ------------------------------------------------
+// Description:     Wall clock of the host, even
+//                  when the executive runs on the
+//                  virtual one: time spent in the
+//                  stack is what matters here
+// ------------------------------------------------
+UInt32 lat_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UInt32)ts.tv_sec * 1000000 + (UInt32)(ts.tv_nsec / 1000);
+}
+#endif
+
+// ------------------------------------------------
+// Function:        lat_add()
+// ------------------------------------------------
+// Input:           Boundary (LAT_...)
+//                  Elapsed ticks
+// Output:          -
+// ------------------------------------------------
+// Description:     Counts a sample in the bucket
+//                  of its log2, in the slot of the
+//                  calling worker
+// ------------------------------------------------
+void lat_add(BYTE point, UInt32 t)
+{
+    BYTE n;
+
+    for(n=0; t; n++) t >>= 1;
+    if(n >= LAT_BUCKETS) n = LAT_BUCKETS - 1;
+    hermes->latency[HERMES_SLOT].count[point][n]++;
+}
+
+// ------------------------------------------------
+// Function:        lat_mark()
+// ------------------------------------------------
+// Input:           Message buffer
+//                  Boundary (LAT_...)
+// Output:          -
+// ------------------------------------------------
+// Description:     Counts the time since the last
+//                  boundary the buffer crossed and
+//                  marks this one
+// ------------------------------------------------
+void lat_mark(PPBUF b, BYTE point)
+{
+    UInt32 t;
+
+    t = LAT_CLOCK();
+    lat_add(point, t - b->mark);
+    b->mark = t;
+}
+
+// ------------------------------------------------
+// Function:        lat_snapshot()
+// ------------------------------------------------
+// Input:           Histograms to fill in
+// Output:          -
+// ------------------------------------------------
+// Description:     Adds up the histograms of every
+//                  worker
+// ------------------------------------------------
+void lat_snapshot(LATENCY *l)
+{
+    UInt32 *src;
+    UInt32 *dst;
+    UInt16 i;
+    BYTE n;
+
+    os_set((BYTE *)l, 0, sizeof(LATENCY));
+    for(n=0; n<HERMES_SLOTS; n++) {
+        src = (UInt32 *)&hermes->latency[n];
+        dst = (UInt32 *)l;
+        for(i=0; i<sizeof(LATENCY)/sizeof(UInt32); i++)
+            *dst++ += *(volatile UInt32 *)src++;
+    }
+}
+
+// ------------------------------------------------
+// Function:        lat_clear()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Zeroes the histograms
+// ------------------------------------------------
+void lat_clear(void)
+{
+    os_set((BYTE *)hermes->latency, 0, sizeof(hermes->latency));
+}
+
+// ------------------------------------------------
+// Function:        lat_percentile()
+// ------------------------------------------------
+// Input:           Histograms
+//                  Boundary (LAT_...)
+//                  Percentile, in thousandths
+// Output:          Ticks (bucket upper bound) or 0
+//                  if there are no samples
+// ------------------------------------------------
+// Description:     Finds the bucket holding the
+//                  given share of the samples
+// ------------------------------------------------
+UInt32 lat_percentile(LATENCY *l, BYTE point, UInt16 permille)
+{
+    UInt32 total, sum, goal;
+    BYTE n;
+
+    total = 0;
+    for(n=0; n<LAT_BUCKETS; n++) total += l->count[point][n];
+    if(total == 0) return 0;
+    goal = (total / 1000) * permille + ((total % 1000) * permille + 999) / 1000;
+
+    sum = 0;
+    for(n=0; n<LAT_BUCKETS-1; n++) {
+        sum += l->count[point][n];
+        if(sum >= goal) break;
+    }
+    return (UInt32)1 << n;
+}
+
+#endif
@@ -0,0 +1,33 @@
+// ---------------------------------------------
+// Latency histograms. A buffer carries the
+// clock at its allocation (born) and at the
+// last layer boundary it crossed (mark); each
+// boundary counts the time spent since the
+// previous one in a log2 bucket of LAT_CLOCK()
+// ticks: bucket n holds 2^(n-1) <= t < 2^n
+// ---------------------------------------------
+#define LAT_RX_QUEUE                    0       // received, until hermes_thread() dispatches it
+#define LAT_RX_PARSE                    1       // dispatched, until TCP/UDP parse it
+#define LAT_RX_APP                      2       // parsed, until tcp_read()/udp_read() return it
+#define LAT_RX_TOTAL                    3       // received, until the application has it
+#define LAT_TX_STACK                    4       // tcp_send()/udp_send(), until handed to the link
+#define LAT_TX_ARP                      5       // held by the link for address resolution
+#define LAT_POINTS                      6
+
+typedef struct {
+    UInt32 count[LAT_POINTS][LAT_BUCKETS];
+} LATENCY;
+
+#define LAT_STAMP(b)                    ((b)->born = (b)->mark = LAT_CLOCK())
+#define LAT_COPY(d, s)                  ((d)->born = (s)->born, (d)->mark = (s)->mark)
+#define LAT_MARK(b, point)              lat_mark(b, point)
+#define LAT_SPAN(b, point)              lat_add(point, LAT_CLOCK() - (b)->born)
+
+void lat_mark(PPBUF b, BYTE point);
+void lat_add(BYTE point, UInt32 t);
+void lat_snapshot(LATENCY *l);
+void lat_clear(void);
+UInt32 lat_percentile(LATENCY *l, BYTE point, UInt16 permille);
+#ifdef _HOSTED
+UInt32 lat_clock(void);
+#endif
@@ -1,4 +1,18 @@
 
+#ifndef __HERMES_CONFIG__
+#include "hermes_config.h"
+#endif
+
+// --------------------------------------------
+// headers with 32-bit fields may be accessed
+// with word loads when stored 4-byte aligned
+// --------------------------------------------
+#ifdef _ALIGNED_HDR
+#define _PACKED_HDR __attribute__((packed, aligned(4)))
+#else
+#define _PACKED_HDR _PACKED
+#endif
+
 #define UDP_DHCP_CLI            68
 #define UDP_DHCP_SERV           67
 
@@ -18,7 +32,7 @@ typedef struct _PACKED {
     IPV4 dest_ip_address;
 } ARP_HDR;
 
-typedef struct _PACKED {
+typedef struct _PACKED_HDR {
     BYTE ver_length;
     BYTE tos;
     UInt16 length;
@@ -39,7 +53,7 @@ typedef struct _PACKED {
     UInt16 seq;
 } ICMP_HDR;
 
-typedef struct _PACKED {
+typedef struct _PACKED_HDR {
     UInt16 src_port;
     UInt16 dst_port;
     _UInt32 n_seq;
@@ -108,6 +122,13 @@ typedef struct _PACKED {
 #define IP_PROT_UDP                     17
 #define IP_PROT_ICMP                    1
 
+// ---------------------------
+// IP fragment field (host order)
+// ---------------------------
+#define IP_DF                           0x4000  // don't fragment
+#define IP_MF                           0x2000  // more fragments
+#define IP_OFFSET                       0x1fff  // offset (8 byte units)
+
 // -----------------------------
 // host and network order macros
 // -----------------------------
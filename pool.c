@@ -0,0 +1,223 @@
+// -------------------------------------------------------
+// File:            POOL.C
+// Project:         Hermes
+// Description:     Buffer pool usage and owners of the
+//                  buffers in use
+// Author:          Bruno Abrantes Basseto
+//                  bruno.basseto@uol.com.br
+// Target CPU:      PIC24 / PIC32
+// Compiler:        Microchip C30 v3.24
+//                  Microchip C32 v1.11a
+// -------------------------------------------------------
+// Functions:       pool_tag()
+//                  pool_retain()
+//                  pool_alloc()
+//                  pool_free()
+//                  pool_class()
+//                  pool_fail()
+//                  pool_usage()
+//                  pool_clear()
+//                  pool_dump()
+// -------------------------------------------------------
+
+#define __HERMES_POOL__                         // calls the buffer functions themselves
+#include <stdlib.h>
+#include "defs.h"
+#include "net.h"
+#include "cronos.h"
+#include "hermes.h"
+
+#ifdef _POOL_DEBUG
+
+#define usage                           (hermes->usage)
+
+// ------------------------------------------------
+// Function:        pool_tag()
+// ------------------------------------------------
+// Input:           Buffer (chain) or NULL
+//                  Source file and line
+// Output:          The same buffer
+// ------------------------------------------------
+// Description:     Records the owner of a buffer
+//                  just taken, on each segment
+// ------------------------------------------------
+PPBUF pool_tag(PPBUF b, const char *file, UInt16 line)
+{
+    PPBUF p;
+
+    for(p=b; p!=NULL; p=p->next) {
+        p->file = file;
+        p->line = line;
+        p->taken = usage.allocs;
+    }
+    return b;
+}
+
+// ------------------------------------------------
+// Function:        pool_retain()
+// ------------------------------------------------
+// Input:           Buffer or NULL
+//                  Source file and line
+// Output:          -
+// ------------------------------------------------
+// Description:     retain_buffer(), the caller
+//                  becoming the owner
+// ------------------------------------------------
+void pool_retain(PPBUF b, const char *file, UInt16 line)
+{
+    if(b == NULL) return;
+    retain_buffer(b);
+    b->file = file;
+    b->line = line;
+    b->taken = usage.allocs;
+}
+
+// ------------------------------------------------
+// Function:        pool_alloc()
+// ------------------------------------------------
+// Input:           Descriptor taken
+// Output:          -
+// ------------------------------------------------
+// Description:     Counts a descriptor in use,
+//                  with the stack locked
+// ------------------------------------------------
+void pool_alloc(PPBUF b)
+{
+    usage.allocs++;
+    usage.used++;
+    if(usage.used > usage.peak) usage.peak = usage.used;
+    b->taken = usage.allocs;
+}
+
+// ------------------------------------------------
+// Function:        pool_free()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Counts a descriptor back to the
+//                  pool
+// ------------------------------------------------
+void pool_free(void)
+{
+    HERMES_LOCK();
+    if(usage.used) usage.used--;
+    HERMES_UNLOCK();
+}
+
+// ------------------------------------------------
+// Function:        pool_class()
+// ------------------------------------------------
+// Input:           Requested size, 0 for views
+// Output:          Failure counter index
+// ------------------------------------------------
+// Description:     Views (slices, clones) hold no
+//                  storage and count in class 0.
+//                  Class n takes sizes up to
+//                  16 << n, the last one anything
+//                  larger
+// ------------------------------------------------
+BYTE pool_class(UInt16 size)
+{
+    BYTE n;
+
+    if(size == 0) return 0;
+    for(n=1; n<POOL_CLASSES-1; n++)
+        if(size <= ((UInt32)16 << n)) break;
+    return n;
+}
+
+// ------------------------------------------------
+// Function:        pool_fail()
+// ------------------------------------------------
+// Input:           Requested size, 0 for views
+// Output:          -
+// ------------------------------------------------
+// Description:     Counts an allocation that found
+//                  no descriptor or no memory
+// ------------------------------------------------
+void pool_fail(UInt16 size)
+{
+    HERMES_LOCK();
+    usage.fails[pool_class(size)]++;
+    HERMES_UNLOCK();
+}
+
+// ------------------------------------------------
+// Function:        pool_usage()
+// ------------------------------------------------
+// Input:           Usage to fill in
+// Output:          -
+// ------------------------------------------------
+// Description:     Copies the pool usage counters
+// ------------------------------------------------
+void pool_usage(POOL_STATE *u)
+{
+    HERMES_LOCK();
+    os_copy((BYTE *)&usage, (BYTE *)u, sizeof(POOL_STATE));
+    HERMES_UNLOCK();
+}
+
+// ------------------------------------------------
+// Function:        pool_clear()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Restarts the high-watermark
+//                  from the current use and zeroes
+//                  the failure counters
+// ------------------------------------------------
+void pool_clear(void)
+{
+    HERMES_LOCK();
+    usage.peak = usage.used;
+    os_set((BYTE *)usage.fails, 0, sizeof(usage.fails));
+    HERMES_UNLOCK();
+}
+
+// ------------------------------------------------
+// Function:        pool_dump()
+// ------------------------------------------------
+// Input:           List to fill in (NUM_BUFFERS
+//                  entries)
+//                  Minimum age, in allocations
+// Output:          Entries filled in
+// ------------------------------------------------
+// Description:     Lists the buffers held at least
+//                  for the given age and who took
+//                  them, oldest first
+// ------------------------------------------------
+BYTE pool_dump(POOL_HELD *list, UInt32 age)
+{
+    POOL_HELD h;
+    PPBUF p;
+    BYTE i, j, n;
+
+    n = 0;
+    HERMES_LOCK();
+    p = buffers;
+    for(i=0; i<NUM_BUFFERS; i++, p++) {
+        if(BUF_PROTOCOL(p) == BUFFER_EMPTY) continue;
+        if((usage.allocs - p->taken) < age) continue;
+        h.file = p->file;
+        h.line = p->line;
+        h.index = i;
+        h.protocol = BUF_PROTOCOL(p);
+        h.rc = p->rc;
+        h.size = p->size;
+        h.age = usage.allocs - p->taken;
+
+        // -------------------------
+        // insertion by age, oldest
+        // first
+        // -------------------------
+        for(j=n; j && (list[j-1].age < h.age); j--) list[j] = list[j-1];
+        list[j] = h;
+        n++;
+    }
+    HERMES_UNLOCK();
+    return n;
+}
+
+#endif
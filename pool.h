@@ -0,0 +1,40 @@
+// ---------------------------------------------
+// Buffer pool usage. A descriptor records the
+// allocation count of the pool when it was
+// last taken or retained: its age is the number
+// of allocations made since, so a buffer still
+// held after many others came and went has
+// probably leaked
+// ---------------------------------------------
+typedef struct {
+    UInt32 allocs;                              // descriptors taken so far
+    BYTE used;                                  // descriptors in use
+    BYTE peak;                                  // high-watermark of used
+    UInt32 fails[POOL_CLASSES];                 // failures: views, then by size (pool_class())
+} POOL_STATE;
+
+typedef struct {
+    const char *file;                           // last get or retain, NULL if unknown
+    UInt16 line;
+    BYTE index;                                 // descriptor in the pool
+    BYTE protocol;
+    BYTE rc;
+    UInt16 size;
+    UInt32 age;                                 // allocations since then
+} POOL_HELD;
+
+#define POOL_COPY(d, s)                 ((d)->file = (s)->file, (d)->line = (s)->line)
+
+#define POOL_ALLOC(b)                   pool_alloc(b)
+#define POOL_FREE()                     pool_free()
+#define POOL_FAIL(size)                 pool_fail(size)
+
+PPBUF pool_tag(PPBUF b, const char *file, UInt16 line);
+void pool_retain(PPBUF b, const char *file, UInt16 line);
+void pool_alloc(PPBUF b);
+void pool_free(void);
+void pool_fail(UInt16 size);
+BYTE pool_class(UInt16 size);
+void pool_usage(POOL_STATE *u);
+void pool_clear(void);
+BYTE pool_dump(POOL_HELD *list, UInt32 age);
@@ -0,0 +1,133 @@
+// -------------------------------------------------------
+// File:            PT.C
+// Project:         Hermes
+// Description:     Stackless coroutine scheduler
+// Author:          Bruno Abrantes Basseto
+//                  bruno.basseto@uol.com.br
+// Target CPU:      PIC24 / PIC32
+// Compiler:        Microchip C30 v3.24
+//                  Microchip C32 v1.11a
+// -------------------------------------------------------
+// Functions:       pt_start()
+//                  pt_wake()
+//                  pt_tick()
+//                  pt_thread()
+//                  pt_init()
+// -------------------------------------------------------
+
+#include <stdlib.h>
+#include "defs.h"
+#include "net.h"
+#include "cronos.h"
+#include "hermes.h"
+
+#ifdef _PT
+
+// --------------------------
+// state of the current stack
+// --------------------------
+#define pt_tasks                        (hermes->pt.tasks)
+
+// ------------------------------------------------
+// Function:        pt_start()
+// ------------------------------------------------
+// Input:           Coroutine function
+//                  Coroutine argument
+// Output:          TRUE if succesful
+// ------------------------------------------------
+// Description:     Schedules a new coroutine
+// ------------------------------------------------
+BOOL pt_start(PT_FUNC f, void *arg)
+{
+    PT_TASK *t;
+    BYTE i;
+
+    t = pt_tasks;
+    for(i=0; i<MAX_PT; i++, t++) {
+        if(t->f == NULL) {
+            t->arg = arg;
+            PT_INIT(&t->pt);
+            t->f = f;
+            pt_wake();
+            return TRUE;
+        }
+    }
+    return FALSE;                                   // table full
+}
+
+// ------------------------------------------------
+// Function:        pt_wake()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Awakes the scheduler so that
+//                  waiting conditions are checked
+// ------------------------------------------------
+void pt_wake(void)
+{
+    os_signal(SIG_PT);
+}
+
+// ------------------------------------------------
+// Function:        pt_tick()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Callback timming function
+//                  Advances the scheduler clock
+// ------------------------------------------------
+void pt_tick(void)
+{
+    pt_clock++;
+    os_signal(SIG_PT);
+    os_set_timer(TMR_PT, PT_TICK, CB_PT);
+}
+
+// ------------------------------------------------
+// Function:        pt_thread()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Runs every scheduled coroutine
+//                  each time an event happens
+// ------------------------------------------------
+void pt_thread(void)
+{
+    PT_TASK *t;
+    BYTE i;
+
+    while(os_not_terminated()) {
+        os_wait(SIG_PT);
+
+        t = pt_tasks;
+        for(i=0; i<MAX_PT; i++, t++) {
+            if(t->f == NULL) continue;
+            if(t->f(&t->pt, t->arg) != PT_WAITING)
+                t->f = NULL;                        // coroutine ended
+        }
+    }
+}
+
+// ------------------------------------------------
+// Function:        pt_init()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Coroutine scheduler
+//                  initialization
+// ------------------------------------------------
+void pt_init(void)
+{
+    os_set((BYTE *)pt_tasks, 0, sizeof(pt_tasks));
+    pt_clock = 0;
+
+    os_set_callback(CB_PT, pt_tick);
+    os_set_timer(TMR_PT, PT_TICK, CB_PT);
+    os_start(THRD_PT, pt_thread, PT_STACK_SIZE);
+}
+
+#endif
@@ -0,0 +1,63 @@
+// ------------------------------------------------
+// Stackless coroutines (protothreads)
+// ------------------------------------------------
+// A coroutine is a function taking a PT pointer
+// that runs up to its next blocking point and
+// returns PT_WAITING. All of them are driven by
+// the single pt_thread(), so each session costs
+// only its PT state instead of a thread stack.
+// Locals are NOT preserved across waits.
+// ------------------------------------------------
+
+typedef struct {
+    UInt16 lc;                                      // local continuation
+    UInt16 time;                                    // timeout deadline (ticks)
+    BYTE retry;                                     // retry counter
+} PT;
+
+typedef BYTE (*PT_FUNC)(PT *pt, void *arg);
+
+// ------------------------
+// coroutine return values
+// ------------------------
+#define PT_WAITING                      0
+#define PT_DONE                         1
+#define PT_ERROR                        2
+
+// ----------------
+// coroutines table
+// ----------------
+typedef struct {
+    PT_FUNC f;
+    void *arg;
+    PT pt;
+} PT_TASK;
+
+typedef struct {
+    PT_TASK tasks[MAX_PT];
+    volatile UInt16 clock;                          // scheduler time base (PT_TICK units)
+} PT_STATE;
+
+#define pt_clock                        (hermes->pt.clock)
+
+// --------------------
+// flow control macros
+// --------------------
+#define PT_INIT(pt)                     (pt)->lc = 0
+#define PT_BEGIN(pt)                    switch((pt)->lc) { case 0:
+#define PT_END(pt)                      } (pt)->lc = 0; return PT_DONE
+#define PT_EXIT(pt, res)                { (pt)->lc = 0; return (res); }
+#define PT_WAIT_UNTIL(pt, c)            (pt)->lc = __LINE__; case __LINE__: if(!(c)) return PT_WAITING
+#define PT_WAIT_WHILE(pt, c)            PT_WAIT_UNTIL(pt, !(c))
+#define PT_YIELD(pt)                    (pt)->lc = __LINE__; return PT_WAITING; case __LINE__:
+#define PT_CALL(pt, res, call)          PT_WAIT_WHILE(pt, ((res) = (call)) == PT_WAITING)
+
+// -------------
+// timer macros
+// -------------
+#define PT_TIMEOUT(pt, ms)              (pt)->time = pt_clock + ((ms) / PT_TICK)
+#define PT_EXPIRED(pt)                  ((UInt16)(pt_clock - (pt)->time) < 0x8000)
+
+BOOL pt_start(PT_FUNC f, void *arg);
+void pt_wake(void);
+void pt_init(void);
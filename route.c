@@ -0,0 +1,357 @@
+// -------------------------------------------------------
+// File:            ROUTE.C
+// Project:         Hermes
+// Description:     IP routing table and next hop
+//                  cache
+// Author:          Bruno Abrantes Basseto
+//                  bruno.basseto@uol.com.br
+// Target CPU:      PIC24 / PIC32
+// Compiler:        Microchip C30 v3.24
+//                  Microchip C32 v1.11a
+// -------------------------------------------------------
+// Functions:       prefix_length()
+//                  route_flush()
+//                  route_add()
+//                  route_del()
+//                  route_find()
+//                  route_lookup()
+//                  route_mtu()
+//                  route_set_mtu()
+//                  route_init()
+// -------------------------------------------------------
+
+#include <stdlib.h>
+#include "defs.h"
+#include "net.h"
+#include "cronos.h"
+#include "hermes.h"
+
+// --------------------------
+// state of the current stack
+// --------------------------
+#define route_table                     (hermes->route.table)
+#define route_count                     (hermes->route.count)
+#define route_cache                     (hermes->route.cache)
+#define route_gen                       (hermes->route.gen)
+
+#define ROUTE_HASH(ip)                  (((ip)->b[3] ^ (ip)->b[2] ^ (ip)->b[1]) & (ROUTE_CACHE_SIZE - 1))
+#define ROUTE_NONE                      0xff
+
+// ------------------------
+// link MTU of each interface
+// ------------------------
+static const UInt16 link_mtu[MAX_INTERFACES] = {
+    [INTERFACE_PPP] = MTU_PPP,
+    [INTERFACE_ETH] = MTU_ETH,
+    [INTERFACE_LOOP] = MTU_LOOP
+};
+
+// ------------------------------------------------
+// Function:        prefix_length()
+// ------------------------------------------------
+// Input:           Network mask
+// Output:          Number of bits set
+// ------------------------------------------------
+// Description:     Length of a network prefix
+// ------------------------------------------------
+static BYTE prefix_length(IPV4 *mask)
+{
+    BYTE i, b, n;
+
+    n = 0;
+    for(i=0; i<4; i++) {
+        for(b=mask->b[i]; b; b<<=1) n++;
+    }
+    return n;
+}
+
+// ------------------------------------------------
+// Function:        route_flush()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Invalidates the next hop cache.
+//                  Must be called whenever the
+//                  interface addresses change
+// ------------------------------------------------
+void route_flush(void)
+{
+    route_gen++;
+    if(route_gen == 0) {
+        // -------------------------------------
+        // generation wrapped, really clear cache
+        // -------------------------------------
+        os_set((BYTE *)route_cache, 0, sizeof(route_cache));
+        route_gen = 1;
+    }
+}
+
+// ------------------------------------------------
+// Function:        route_add()
+// ------------------------------------------------
+// Input:           Network address
+//                  Network mask
+//                  Gateway (0 if on-link)
+//                  Network interface ID
+// Output:          TRUE if succesful
+// ------------------------------------------------
+// Description:     Adds (or replaces) a static
+//                  route
+// ------------------------------------------------
+BOOL route_add(IPV4 net, IPV4 mask, IPV4 gateway, BYTE interface)
+{
+    ROUTE *r;
+    BYTE i, len;
+
+    if(interface >= MAX_INTERFACES) return FALSE;
+    HERMES_LOCK();
+    route_del(net, mask);
+    if(route_count >= MAX_ROUTES) {
+        HERMES_UNLOCK();
+        return FALSE;                                       // table full
+    }
+
+    // ---------------------------
+    // keep longest prefixes first
+    // ---------------------------
+    len = prefix_length(&mask);
+    for(i=route_count; i; i--) {
+        if(route_table[i - 1].prefix >= len) break;
+        route_table[i] = route_table[i - 1];
+    }
+
+    r = &route_table[i];
+    r->net.d = net.d & mask.d;
+    r->mask.d = mask.d;
+    r->gateway.d = gateway.d;
+    r->prefix = len;
+    r->interface = interface;
+    route_count++;
+    route_flush();
+    HERMES_UNLOCK();
+    return TRUE;
+}
+
+// ------------------------------------------------
+// Function:        route_del()
+// ------------------------------------------------
+// Input:           Network address
+//                  Network mask
+// Output:          -
+// ------------------------------------------------
+// Description:     Removes a static route
+// ------------------------------------------------
+void route_del(IPV4 net, IPV4 mask)
+{
+    BYTE i;
+
+    HERMES_LOCK();
+    for(i=0; i<route_count; i++) {
+        if(route_table[i].mask.d != mask.d) continue;
+        if(route_table[i].net.d != (net.d & mask.d)) continue;
+
+        route_count--;
+        for(; i<route_count; i++) route_table[i] = route_table[i + 1];
+        route_flush();
+        break;
+    }
+    HERMES_UNLOCK();
+}
+
+// ------------------------------------------------
+// Function:        route_find()
+// ------------------------------------------------
+// Input:           Destination address
+//                  Network interface ID (or
+//                  INTERFACE_AUTO)
+//                  Next hop to fill in
+// Output:          Interface, ROUTE_NONE if there
+//                  is no route
+// ------------------------------------------------
+// Description:     Longest prefix match among the
+//                  static routes, the connected
+//                  subnets and the default gateways
+// ------------------------------------------------
+static BYTE route_find(IPV4 *dest, BYTE interface, IPV4 *hop)
+{
+    ROUTE *r;
+    BYTE i, len, best, res;
+
+    best = 0;
+    res = ROUTE_NONE;
+
+    // --------------------------------------
+    // static routes, first match is longest
+    // --------------------------------------
+    r = route_table;
+    for(i=0; i<route_count; i++, r++) {
+        if((dest->d & r->mask.d) != r->net.d) continue;
+        if((interface != INTERFACE_AUTO) && (interface != r->interface)) continue;
+        hop->d = (r->gateway.d)? r->gateway.d: dest->d;
+        res = r->interface;
+        best = r->prefix;
+        break;
+    }
+
+    for(i=0; i<MAX_INTERFACES; i++) {
+        if((interface != INTERFACE_AUTO) && (interface != i)) continue;
+        if(ip_local[i].d == 0) continue;                    // interface down
+
+        // --------------
+        // connected subnet
+        // --------------
+        if(((dest->d ^ ip_local[i].d) & ip_mask[i].d) == 0) {
+            len = prefix_length(&ip_mask[i]);
+            if((res == ROUTE_NONE) || (len > best)) {
+                hop->d = dest->d;
+                res = i;
+                best = len;
+            }
+            continue;
+        }
+
+        // ---------------
+        // default gateway
+        // ---------------
+        if((res == ROUTE_NONE) && ip_gateway[i].d) {
+            hop->d = ip_gateway[i].d;
+            res = i;
+        }
+    }
+    return res;
+}
+
+// ------------------------------------------------
+// Function:        route_lookup()
+// ------------------------------------------------
+// Input:           Destination address
+//                  Network interface ID (or
+//                  INTERFACE_AUTO), updated
+//                  Next hop to fill in
+// Output:          TRUE if there is a route
+// ------------------------------------------------
+// Description:     Finds the interface and the
+//                  link layer next hop for a
+//                  destination, through the cache
+// ------------------------------------------------
+BOOL route_lookup(IPV4 *dest, BYTE *interface, IPV4 *hop)
+{
+    ROUTE_CACHE_ENTRY *c;
+    BYTE i;
+
+    if(dest->d == 0xffffffff) {
+        // ---------------------------------
+        // limited broadcast, stays on-link
+        // ---------------------------------
+        if(*interface == INTERFACE_AUTO) return FALSE;
+        hop->d = dest->d;
+        return TRUE;
+    }
+
+    // ---------------------------------------
+    // cache miss: keep the best route, which
+    // is what the hot path asks for
+    // ---------------------------------------
+    c = &route_cache[ROUTE_HASH(dest)];
+    if((c->gen != route_gen) || (c->dest.d != dest->d)) {
+        i = route_find(dest, INTERFACE_AUTO, hop);
+        if(i == ROUTE_NONE) {
+            if(*interface == INTERFACE_AUTO) return FALSE;
+            hop->d = dest->d;                               // forced interface, try on-link
+            return TRUE;
+        }
+        c->dest.d = dest->d;
+        c->hop.d = hop->d;
+        c->mtu = 0;
+        c->interface = i;
+        c->gen = route_gen;
+    }
+
+    if((*interface == INTERFACE_AUTO) || (*interface == c->interface)) {
+        *interface = c->interface;
+        hop->d = c->hop.d;
+        return TRUE;
+    }
+
+    // -------------------------------------
+    // forced to another interface, not cached
+    // -------------------------------------
+    if(route_find(dest, *interface, hop) == ROUTE_NONE) hop->d = dest->d;
+    return TRUE;
+}
+
+// ------------------------------------------------
+// Function:        route_mtu()
+// ------------------------------------------------
+// Input:           Destination address
+//                  Network interface ID (or
+//                  INTERFACE_AUTO)
+// Output:          Largest datagram to send
+// ------------------------------------------------
+// Description:     Path MTU to a destination, the
+//                  interface MTU if not learnt
+// ------------------------------------------------
+UInt16 route_mtu(IPV4 *dest, BYTE interface)
+{
+    ROUTE_CACHE_ENTRY *c;
+    IPV4 hop;
+    UInt16 mtu;
+
+    HERMES_LOCK();
+    if(!route_lookup(dest, &interface, &hop)) {
+        HERMES_UNLOCK();
+        return PMTU_MIN;
+    }
+    mtu = link_mtu[interface];
+
+    c = &route_cache[ROUTE_HASH(dest)];
+    if((c->gen == route_gen) && (c->dest.d == dest->d) && (c->interface == interface))
+        if(c->mtu && (c->mtu < mtu)) mtu = c->mtu;
+    HERMES_UNLOCK();
+    return mtu;
+}
+
+// ------------------------------------------------
+// Function:        route_set_mtu()
+// ------------------------------------------------
+// Input:           Destination address
+//                  Path MTU reported
+// Output:          -
+// ------------------------------------------------
+// Description:     Lowers the path MTU to a
+//                  destination (ICMP fragmentation
+//                  needed). It is kept until the
+//                  entry is replaced or flushed
+// ------------------------------------------------
+void route_set_mtu(IPV4 *dest, UInt16 mtu)
+{
+    ROUTE_CACHE_ENTRY *c;
+    IPV4 hop;
+    BYTE i;
+
+    i = INTERFACE_AUTO;
+    if(!route_lookup(dest, &i, &hop)) return;               // also fills in the cache
+    if(mtu < PMTU_MIN) mtu = PMTU_MIN;
+
+    c = &route_cache[ROUTE_HASH(dest)];
+    if((c->gen != route_gen) || (c->dest.d != dest->d)) return;
+    if(mtu >= link_mtu[c->interface]) return;
+    if(c->mtu && (c->mtu <= mtu)) return;                   // never raised by ICMP
+    c->mtu = mtu;
+}
+
+// ------------------------------------------------
+// Function:        route_init()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Routing table initialization
+// ------------------------------------------------
+void route_init(void)
+{
+    route_count = 0;
+    os_set((BYTE *)route_cache, 0, sizeof(route_cache));
+    route_gen = 1;
+}
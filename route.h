@@ -0,0 +1,41 @@
+// ---------------------------------------------
+// Static routes, sorted from the longest to the
+// shortest prefix so the first match wins.
+// Connected subnets and default gateways come
+// from ip_local[], ip_mask[] and ip_gateway[]
+// ---------------------------------------------
+typedef struct {
+    IPV4 net;
+    IPV4 mask;
+    IPV4 gateway;                               // 0 for on-link networks
+    BYTE prefix;                                // mask length
+    BYTE interface;
+} ROUTE;
+
+// ---------------------------------------------
+// Next hop cache: direct mapped by destination,
+// entries of older generations are stale. It
+// also keeps the path MTU learnt by ICMP
+// ---------------------------------------------
+typedef struct {
+    IPV4 dest;
+    IPV4 hop;
+    UInt16 mtu;                                 // path MTU, 0 if unknown
+    BYTE interface;
+    BYTE gen;
+} ROUTE_CACHE_ENTRY;
+
+typedef struct {
+    ROUTE table[MAX_ROUTES];
+    BYTE count;
+    ROUTE_CACHE_ENTRY cache[ROUTE_CACHE_SIZE];
+    BYTE gen;                                   // cache generation
+} ROUTE_STATE;
+
+void route_flush(void);
+BOOL route_add(IPV4 net, IPV4 mask, IPV4 gateway, BYTE interface);
+void route_del(IPV4 net, IPV4 mask);
+BOOL route_lookup(IPV4 *dest, BYTE *interface, IPV4 *hop);
+UInt16 route_mtu(IPV4 *dest, BYTE interface);
+void route_set_mtu(IPV4 *dest, UInt16 mtu);
+void route_init(void);
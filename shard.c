@@ -0,0 +1,243 @@
+// -------------------------------------------------------
+// File:            SHARD.C
+// Project:         Hermes
+// Description:     Flow sharded TCP/UDP processing on
+//                  worker threads (hosted builds)
+// Author:          Bruno Abrantes Basseto
+//                  bruno.basseto@uol.com.br
+// Target CPU:      x86 / ARM hosts
+// Compiler:        GCC
+// -------------------------------------------------------
+// Functions:       shard_flow()
+//                  shard_push()
+//                  shard_pop()
+//                  shard_steer()
+//                  shard_lock()
+//                  shard_unlock()
+//                  shard_thread()
+//                  shard_init()
+// -------------------------------------------------------
+
+#include <stdlib.h>
+#include "defs.h"
+#include "net.h"
+#include "cronos.h"
+#include "hermes.h"
+
+#ifdef _SHARDS
+
+#ifndef _HOSTED
+#error "Sharded processing needs a hosted build"
+#endif
+
+// --------------------------
+// state of the current stack
+// --------------------------
+#define shard_rx                        (hermes->shard.rx)
+#define shard_started                   (hermes->shard.started)
+#define shard_mutex                     (hermes->shard.lock)
+
+#define IPH(xxx)                        ((IP_HDR *)xxx)
+#define TCPH(xxx)                       ((TCP_HDR *)xxx)
+#define UDPH(xxx)                       ((UDP_HDR *)xxx)
+
+HERMES_TLS BYTE shard_id = SHARD_NONE;
+
+// ------------------------------------------------
+// Function:        shard_flow()
+// ------------------------------------------------
+// Input:           Remote address (0 for UDP)
+//                  Remote port (0 for UDP)
+//                  Local port
+// Output:          Worker index
+// ------------------------------------------------
+// Description:     Flow hash. TCP flows are spread
+//                  by their 4-tuple; UDP sockets
+//                  only bind a local port, so UDP
+//                  is spread by that port alone
+// ------------------------------------------------
+BYTE shard_flow(UInt32 peer, UInt16 p_rem, UInt16 p_loc)
+{
+    UInt32 h;
+
+    h = peer ^ (((UInt32)p_rem << 16) | p_loc);
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return h % NUM_SHARDS;
+}
+
+// ------------------------------------------------
+// Function:        shard_push()
+// ------------------------------------------------
+// Input:           Receive queue
+//                  Message buffer
+// Output:          FALSE if the queue is full
+// ------------------------------------------------
+// Description:     Queues a message for a worker
+// ------------------------------------------------
+static BOOL shard_push(SHARD_RX *q, PPBUF pbuf)
+{
+    UInt16 head;
+
+    head = q->head;
+    if((UInt16)(head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) >= SHARD_QUEUE) return FALSE;
+    q->ring[head & (SHARD_QUEUE - 1)] = pbuf;
+    __atomic_store_n(&q->head, (UInt16)(head + 1), __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+// ------------------------------------------------
+// Function:        shard_pop()
+// ------------------------------------------------
+// Input:           Receive queue
+// Output:          Message buffer or NULL
+// ------------------------------------------------
+// Description:     Takes the oldest queued message
+// ------------------------------------------------
+static PPBUF shard_pop(SHARD_RX *q)
+{
+    PPBUF res;
+    UInt16 tail;
+
+    tail = q->tail;
+    if(tail == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) return NULL;
+    res = q->ring[tail & (SHARD_QUEUE - 1)];
+    __atomic_store_n(&q->tail, (UInt16)(tail + 1), __ATOMIC_RELEASE);
+    return res;
+}
+
+// ------------------------------------------------
+// Function:        shard_steer()
+// ------------------------------------------------
+// Input:           TCP or UDP message buffer, its
+//                  IP header already checked
+// Output:          -
+// ------------------------------------------------
+// Description:     Hands the message to the worker
+//                  owning its flow, which releases
+//                  it. Dropped if that worker is
+//                  behind, as a NIC queue would
+// ------------------------------------------------
+void shard_steer(PPBUF pbuf)
+{
+    UInt16 p_rem, p_loc;
+    BYTE i;
+
+    if(IPH(BUF_START(pbuf))->prot == IP_PROT_TCP) {
+        p_rem = NTOHS(TCPH(BUF_DATA(pbuf))->src_port);
+        p_loc = NTOHS(TCPH(BUF_DATA(pbuf))->dst_port);
+        i = shard_flow(IPH(BUF_START(pbuf))->source.d, p_rem, p_loc);
+    } else {
+        p_loc = NTOHS(UDPH(BUF_DATA(pbuf))->dst_port);
+        i = shard_flow(0, 0, p_loc);
+    }
+
+    BUF_PROTOCOL(pbuf) = BUFFER_RESERVED;
+    if(!shard_push(&shard_rx[i], pbuf)) {
+        release_buffer(pbuf);
+        return;
+    }
+    os_signal(SIG_SHARD + i);
+}
+
+// ------------------------------------------------
+// Function:        shard_lock()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Takes the tables shared by all
+//                  workers: buffer descriptors,
+//                  routes, ARP, fragments and the
+//                  link drivers. May be nested
+// ------------------------------------------------
+void shard_lock(void)
+{
+    pthread_mutex_lock(&shard_mutex);
+}
+
+// ------------------------------------------------
+// Function:        shard_unlock()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Releases the shared tables
+// ------------------------------------------------
+void shard_unlock(void)
+{
+    pthread_mutex_unlock(&shard_mutex);
+}
+
+// ------------------------------------------------
+// Function:        shard_thread()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Worker thread: parses the TCP
+//                  and UDP messages of its flows.
+//                  TCP sockets are shared with the
+//                  application threads under their
+//                  lock
+// ------------------------------------------------
+void shard_thread(void)
+{
+    SHARD_RX *q;
+    PPBUF p;
+
+    os_detach();                                    // runs beside the Hermes thread
+    shard_id = __atomic_fetch_add(&shard_started, 1, __ATOMIC_RELAXED);
+    q = &shard_rx[shard_id];
+
+    while(os_not_terminated()) {
+        os_wait(SIG_SHARD + shard_id);
+
+        while((p = shard_pop(q)) != NULL) {
+            switch(IPH(BUF_START(p))->prot) {
+#ifdef _TCP
+                case IP_PROT_TCP:
+                    parse_tcp(p);
+                    break;
+#endif
+#ifdef _UDP
+                case IP_PROT_UDP:
+                    parse_udp(p);
+                    break;
+#endif
+            }
+            release_buffer(p);
+        }
+    }
+
+    // ---------------
+    // finishes thread
+    // ---------------
+    while((p = shard_pop(q)) != NULL) release_buffer(p);
+}
+
+// ------------------------------------------------
+// Function:        shard_init()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Sharding initialization, must
+//                  precede any other one as it
+//                  sets up the lock
+// ------------------------------------------------
+void shard_init(void)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&shard_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    os_set((BYTE *)shard_rx, 0, sizeof(shard_rx));
+    shard_started = 0;
+}
+
+#endif
@@ -0,0 +1,29 @@
+#include <pthread.h>
+
+// ---------------------------------------------
+// Receive queue of a worker. The Hermes thread
+// is its only producer and the worker its only
+// consumer, so it needs no lock
+// ---------------------------------------------
+typedef struct {
+    PPBUF ring[SHARD_QUEUE];
+    UInt16 head;                                // written by the Hermes thread
+    UInt16 tail;                                // written by the worker
+} SHARD_RX;
+
+typedef struct {
+    SHARD_RX rx[NUM_SHARDS];
+    BYTE started;                               // workers already running
+    pthread_mutex_t lock;                       // shared tables (recursive)
+} SHARD_STATE;
+
+#define SHARD_NONE                      0xff
+
+extern HERMES_TLS BYTE shard_id;                // worker of the calling thread
+
+BYTE shard_flow(UInt32 peer, UInt16 p_rem, UInt16 p_loc);
+void shard_steer(PPBUF pbuf);
+void shard_lock(void);
+void shard_unlock(void);
+void shard_thread(void);
+void shard_init(void);
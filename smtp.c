@@ -20,6 +20,14 @@
 //                  smtp_data()
 //                  smtp_send()
 //                  smtp_inicia()
+//                  smtp_ok_nb()
+//                  smtp_cmd_nb()
+//                  smtp_quit_nb()
+//                  smtp_new_nb()
+//                  smtp_from_nb()
+//                  smtp_to_nb()
+//                  smtp_data_nb()
+//                  smtp_send_nb()
 // -------------------------------------------------------
 
 #include <stdlib.h>
@@ -34,13 +42,10 @@
 #error "TCP must be installed for using SMTP"
 #endif
 
-typedef enum {
-    SMTP_IDLE,
-    SMTP_FROM,
-    SMTP_RCPT,
-    SMTP_DATA
-} SMTP_STATE;
-SMTP_STATE smtp_state;
+// --------------------------
+// state of the current stack
+// --------------------------
+#define smtp_state                      (hermes->smtp.phase)
 
 #define TIMEOUT_SMTP	2000
 
@@ -70,8 +75,8 @@ BOOL smtp_ok(void)
     // analyse answer
     // --------------
     res = FALSE;
-    if(buf->data[0] == '2') res = TRUE;
-    if(buf->data[0] == '3') res = TRUE;
+    if(BUF_DATA(buf)[0] == '2') res = TRUE;
+    if(BUF_DATA(buf)[0] == '3') res = TRUE;
 
     release_buffer(buf);
     return res;
@@ -92,7 +97,7 @@ void smtp_quit(void)
     // ----------------------
     // sends the QUIT command
     // ----------------------
-    tcp_send_text(SOCKET_SMTP, "QUIT\r\n");
+    tcp_send_rom(SOCKET_SMTP, "QUIT\r\n");
     smtp_ok();
 
     // -------------------------
@@ -130,7 +135,7 @@ BOOL smtp_new(IPV4 server, BYTE interface)
     // -----------------
     // send HELO command
     // -----------------
-    if(!tcp_send_text(SOCKET_SMTP, "HELO hermes\r\n")) {
+    if(!tcp_send_rom(SOCKET_SMTP, "HELO hermes\r\n")) {
         smtp_quit();
         return FALSE;
     }
@@ -222,7 +227,7 @@ BOOL smtp_data(char *s)
         // -----------------
         // send DATA command
         // -----------------
-        if(!tcp_send_text(SOCKET_SMTP, "DATA\r\n")) return FALSE;
+        if(!tcp_send_rom(SOCKET_SMTP, "DATA\r\n")) return FALSE;
         if(!smtp_ok()) return FALSE;
         smtp_state = SMTP_DATA;
     }
@@ -247,7 +252,7 @@ BOOL smtp_data(char *s)
 BOOL smtp_send(void)
 {
     if(smtp_state != SMTP_DATA) return FALSE;
-    if(!tcp_send_text(SOCKET_SMTP, "\r\n.\r\n")) return FALSE;
+    if(!tcp_send_rom(SOCKET_SMTP, "\r\n.\r\n")) return FALSE;
     if(!smtp_ok()) return FALSE;
     smtp_state = SMTP_FROM;
     return TRUE;
@@ -266,4 +271,259 @@ void smtp_init(void)
     smtp_state = SMTP_IDLE;
 }
 
+#ifdef _PT
+// ------------------------------------------------
+// Non-blocking (coroutine) interface
+// ------------------------------------------------
+#define smtp_pt                         (hermes->smtp.pt)
+#define smtp_io                         (hermes->smtp.io)
+#define smtp_buf                        (hermes->smtp.buf)
+#define smtp_port                       (hermes->smtp.port)
+
+// ------------------------------------------------
+// Function:        smtp_ok_nb()
+// ------------------------------------------------
+// Input:           Coroutine state
+// Output:          PT_DONE if SMTP sever answers ok
+// ------------------------------------------------
+// Description:     Non-blocking smtp_ok()
+// ------------------------------------------------
+static BYTE smtp_ok_nb(PT *pt)
+{
+    PPBUF buf;
+    BOOL res;
+
+    PT_BEGIN(pt);
+
+    // -------------------
+    // wait for a response
+    // -------------------
+    PT_TIMEOUT(pt, TIMEOUT_SMTP);
+    PT_WAIT_UNTIL(pt, tcp_has_data(SOCKET_SMTP) ||
+                      !tcp_is_open(SOCKET_SMTP) ||
+                      PT_EXPIRED(pt));
+    buf = tcp_read_nb(SOCKET_SMTP);
+    if(buf == NULL) PT_EXIT(pt, PT_ERROR);
+
+    // --------------
+    // analyse answer
+    // --------------
+    res = FALSE;
+    if(BUF_DATA(buf)[0] == '2') res = TRUE;
+    if(BUF_DATA(buf)[0] == '3') res = TRUE;
+
+    release_buffer(buf);
+    if(!res) PT_EXIT(pt, PT_ERROR);
+    PT_END(pt);
+}
+
+// ------------------------------------------------
+// Function:        smtp_cmd_nb()
+// ------------------------------------------------
+// Input:           Coroutine state
+//                  Command
+//                  Address argument or NULL
+//                  TRUE to wait for the answer
+// Output:          PT_DONE if succesful
+// ------------------------------------------------
+// Description:     Sends one SMTP command line
+// ------------------------------------------------
+static BYTE smtp_cmd_nb(PT *pt, char *cmd, char *arg, BOOL wait)
+{
+    BYTE res;
+
+    PT_BEGIN(pt);
+    smtp_buf = tcp_new(SOCKET_SMTP);
+    if(smtp_buf == NULL) PT_EXIT(pt, PT_ERROR);
+
+    write_string(smtp_buf, cmd);
+    if(arg != NULL) {
+        write_string(smtp_buf, arg);
+        write_string(smtp_buf, ">\r\n");
+    }
+
+    PT_INIT(&smtp_io);
+    PT_CALL(pt, res, tcp_send_nb(&smtp_io, SOCKET_SMTP, smtp_buf));
+    release_buffer(smtp_buf);
+    smtp_buf = NULL;
+    if(res != PT_DONE) PT_EXIT(pt, PT_ERROR);
+    if(!wait) PT_EXIT(pt, PT_DONE);
+
+    PT_INIT(&smtp_io);
+    PT_CALL(pt, res, smtp_ok_nb(&smtp_io));
+    PT_EXIT(pt, res);
+    PT_END(pt);
+}
+
+// ------------------------------------------------
+// Function:        smtp_quit_nb()
+// ------------------------------------------------
+// Input:           Coroutine state
+// Output:          PT_DONE when finished
+// ------------------------------------------------
+// Description:     Non-blocking smtp_quit()
+// ------------------------------------------------
+BYTE smtp_quit_nb(PT *pt)
+{
+    BYTE res;
+
+    PT_BEGIN(pt);
+    if(tcp_is_open(SOCKET_SMTP)) {
+        PT_INIT(&smtp_pt);
+        PT_CALL(pt, res, smtp_cmd_nb(&smtp_pt, "QUIT\r\n", NULL, TRUE));
+
+        // -------------------------
+        // waits for a disconnection
+        // -------------------------
+        PT_TIMEOUT(pt, 500);
+        PT_WAIT_UNTIL(pt, !tcp_is_open(SOCKET_SMTP) || PT_EXPIRED(pt));
+        PT_INIT(&smtp_pt);
+        PT_CALL(pt, res, tcp_close_nb(&smtp_pt, SOCKET_SMTP));
+    }
+    smtp_state = SMTP_IDLE;
+    PT_END(pt);
+}
+
+// ------------------------------------------------
+// Function:        smtp_new_nb()
+// ------------------------------------------------
+// Input:           Coroutine state
+//                  Server address
+//                  Network interface ID
+// Output:          PT_DONE if succesful
+// ------------------------------------------------
+// Description:     Non-blocking smtp_new()
+// ------------------------------------------------
+BYTE smtp_new_nb(PT *pt, IPV4 server, BYTE interface)
+{
+    BYTE res;
+
+    PT_BEGIN(pt);
+    if(smtp_state != SMTP_IDLE) PT_EXIT(pt, PT_ERROR);
+
+    // -----------------
+    // connect to server
+    // -----------------
+    smtp_port = tcp_get_port();
+    PT_INIT(&smtp_pt);
+    PT_CALL(pt, res, tcp_open_nb(&smtp_pt, SOCKET_SMTP, smtp_port, server, 25, interface));
+    if(res != PT_DONE) PT_EXIT(pt, PT_ERROR);
+
+    PT_INIT(&smtp_pt);
+    PT_CALL(pt, res, smtp_ok_nb(&smtp_pt));
+    if(res != PT_DONE) goto quit;
+
+    // -----------------
+    // send HELO command
+    // -----------------
+    PT_INIT(&smtp_pt);
+    PT_CALL(pt, res, smtp_cmd_nb(&smtp_pt, "HELO hermes\r\n", NULL, TRUE));
+    if(res != PT_DONE) goto quit;
+
+    smtp_state = SMTP_FROM;
+    PT_EXIT(pt, PT_DONE);
+
+quit:
+    PT_INIT(&smtp_pt);
+    PT_CALL(pt, res, tcp_close_nb(&smtp_pt, SOCKET_SMTP));
+    PT_EXIT(pt, PT_ERROR);
+    PT_END(pt);
+}
+
+// ------------------------------------------------
+// Function:        smtp_from_nb()
+// ------------------------------------------------
+// Input:           Coroutine state
+//                  Sender email address
+// Output:          PT_DONE if succesful
+// ------------------------------------------------
+// Description:     Non-blocking smtp_from()
+// ------------------------------------------------
+BYTE smtp_from_nb(PT *pt, char *s)
+{
+    BYTE res;
+
+    PT_BEGIN(pt);
+    if(smtp_state != SMTP_FROM) PT_EXIT(pt, PT_ERROR);
+    PT_INIT(&smtp_pt);
+    PT_CALL(pt, res, smtp_cmd_nb(&smtp_pt, "MAIL FROM:<", s, TRUE));
+    if(res != PT_DONE) PT_EXIT(pt, PT_ERROR);
+    smtp_state = SMTP_RCPT;
+    PT_END(pt);
+}
+
+// ------------------------------------------------
+// Function:        smtp_to_nb()
+// ------------------------------------------------
+// Input:           Coroutine state
+//                  Receipt email address
+// Output:          PT_DONE if succesful
+// ------------------------------------------------
+// Description:     Non-blocking smtp_to()
+// ------------------------------------------------
+BYTE smtp_to_nb(PT *pt, char *s)
+{
+    BYTE res;
+
+    PT_BEGIN(pt);
+    if(smtp_state != SMTP_RCPT) PT_EXIT(pt, PT_ERROR);
+    PT_INIT(&smtp_pt);
+    PT_CALL(pt, res, smtp_cmd_nb(&smtp_pt, "RCPT TO:<", s, TRUE));
+    PT_EXIT(pt, res);
+    PT_END(pt);
+}
+
+// ------------------------------------------------
+// Function:        smtp_data_nb()
+// ------------------------------------------------
+// Input:           Coroutine state
+//                  One line of data
+// Output:          PT_DONE if succesful
+// ------------------------------------------------
+// Description:     Non-blocking smtp_data()
+// ------------------------------------------------
+BYTE smtp_data_nb(PT *pt, char *s)
+{
+    BYTE res;
+
+    PT_BEGIN(pt);
+    if(smtp_state == SMTP_RCPT) {
+        // -----------------
+        // send DATA command
+        // -----------------
+        PT_INIT(&smtp_pt);
+        PT_CALL(pt, res, smtp_cmd_nb(&smtp_pt, "DATA\r\n", NULL, TRUE));
+        if(res != PT_DONE) PT_EXIT(pt, PT_ERROR);
+        smtp_state = SMTP_DATA;
+    }
+
+    if(smtp_state != SMTP_DATA) PT_EXIT(pt, PT_ERROR);
+    PT_INIT(&smtp_pt);
+    PT_CALL(pt, res, smtp_cmd_nb(&smtp_pt, s, NULL, FALSE));
+    PT_EXIT(pt, res);
+    PT_END(pt);
+}
+
+// ------------------------------------------------
+// Function:        smtp_send_nb()
+// ------------------------------------------------
+// Input:           Coroutine state
+// Output:          PT_DONE if succesful
+// ------------------------------------------------
+// Description:     Non-blocking smtp_send()
+// ------------------------------------------------
+BYTE smtp_send_nb(PT *pt)
+{
+    BYTE res;
+
+    PT_BEGIN(pt);
+    if(smtp_state != SMTP_DATA) PT_EXIT(pt, PT_ERROR);
+    PT_INIT(&smtp_pt);
+    PT_CALL(pt, res, smtp_cmd_nb(&smtp_pt, "\r\n.\r\n", NULL, TRUE));
+    if(res != PT_DONE) PT_EXIT(pt, PT_ERROR);
+    smtp_state = SMTP_FROM;
+    PT_END(pt);
+}
+#endif
+
 #endif
@@ -1,3 +1,20 @@
+typedef enum {
+    SMTP_IDLE,
+    SMTP_FROM,
+    SMTP_RCPT,
+    SMTP_DATA
+} SMTP_PHASE;
+
+typedef struct {
+    SMTP_PHASE phase;
+#ifdef _PT
+    PT pt;                                      // nested operation state
+    PT io;                                      // nested TCP operation state
+    PPBUF buf;                                  // command being sent
+    UInt16 port;                                // local port for the session
+#endif
+} SMTP_STATE;
+
 void smtp_quit(void);
 BOOL smtp_new(IPV4 server, BYTE interface);
 BOOL smtp_from(char *s);
@@ -5,3 +22,11 @@ BOOL smtp_to(char *s);
 BOOL smtp_data(char *s);
 BOOL smtp_send(void);
 void smtp_init(void);
+#ifdef _PT
+BYTE smtp_quit_nb(PT *pt);
+BYTE smtp_new_nb(PT *pt, IPV4 server, BYTE interface);
+BYTE smtp_from_nb(PT *pt, char *s);
+BYTE smtp_to_nb(PT *pt, char *s);
+BYTE smtp_data_nb(PT *pt, char *s);
+BYTE smtp_send_nb(PT *pt);
+#endif
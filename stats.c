@@ -0,0 +1,64 @@
+// -------------------------------------------------------
+// File:            STATS.C
+// Project:         Hermes
+// Description:     Protocol counters of the current
+//                  stack instance
+// Author:          Bruno Abrantes Basseto
+//                  bruno.basseto@uol.com.br
+// Target CPU:      PIC24 / PIC32
+// Compiler:        Microchip C30 v3.24
+//                  Microchip C32 v1.11a
+// -------------------------------------------------------
+// Functions:       stats_snapshot()
+//                  stats_clear()
+// -------------------------------------------------------
+
+#include <stdlib.h>
+#include "defs.h"
+#include "net.h"
+#include "cronos.h"
+#include "hermes.h"
+
+#ifdef _STATS
+
+// ------------------------------------------------
+// Function:        stats_snapshot()
+// ------------------------------------------------
+// Input:           Counters to fill in
+// Output:          -
+// ------------------------------------------------
+// Description:     Adds up the counters of every
+//                  worker. They keep counting
+//                  meanwhile, each field is read
+//                  once
+// ------------------------------------------------
+void stats_snapshot(STATS *s)
+{
+    UInt32 *src;
+    UInt32 *dst;
+    UInt16 i;
+    BYTE n;
+
+    os_set((BYTE *)s, 0, sizeof(STATS));
+    for(n=0; n<HERMES_SLOTS; n++) {
+        src = (UInt32 *)&hermes->stats[n];
+        dst = (UInt32 *)s;
+        for(i=0; i<sizeof(STATS)/sizeof(UInt32); i++)
+            *dst++ += *(volatile UInt32 *)src++;
+    }
+}
+
+// ------------------------------------------------
+// Function:        stats_clear()
+// ------------------------------------------------
+// Input:           -
+// Output:          -
+// ------------------------------------------------
+// Description:     Zeroes the counters
+// ------------------------------------------------
+void stats_clear(void)
+{
+    os_set((BYTE *)hermes->stats, 0, sizeof(hermes->stats));
+}
+
+#endif
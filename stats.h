@@ -0,0 +1,91 @@
+// ---------------------------------------------
+// Protocol counters, named after the MIB-II
+// groups (RFC 1213) plus the drop reasons of
+// this stack. Every field is an UInt32 counter
+// ---------------------------------------------
+typedef struct {
+    UInt32 allocs;
+    UInt32 no_descriptor;                       // pool exhausted
+    UInt32 no_memory;                           // storage allocation failed
+    UInt32 quota_denials;                       // left for other classes (QUOTA_...)
+    UInt32 socket_caps;                         // socket holding QUOTA_SOCKET_MAX
+} STATS_BUFFER;
+
+typedef struct {
+    UInt32 in_requests;
+    UInt32 in_replies;
+    UInt32 out_requests;
+    UInt32 out_replies;
+    UInt32 queue_drops;                         // waiting queue full
+    UInt32 resolve_fails;                       // unanswered, waiting packets dropped
+} STATS_ARP;
+
+typedef struct {
+    UInt32 in_receives;
+    UInt32 in_hdr_errors;                       // inconsistent size or interface
+    UInt32 in_csum_errors;
+    UInt32 in_addr_errors;                      // not a local address
+    UInt32 in_unknown_protos;
+    UInt32 in_delivers;
+    UInt32 out_requests;
+    UInt32 out_discards;                        // no buffer
+    UInt32 out_no_routes;
+    UInt32 reasm_reqds;                         // fragments received
+    UInt32 reasm_oks;
+    UInt32 reasm_fails;
+    UInt32 frag_oks;
+    UInt32 frag_fails;
+    UInt32 frag_creates;
+} STATS_IP;
+
+typedef struct {
+    UInt32 in_msgs;
+    UInt32 in_errors;                           // bad checksum
+    UInt32 in_dest_unreachs;
+    UInt32 in_echos;
+    UInt32 in_echo_reps;
+    UInt32 out_msgs;
+    UInt32 out_echos;
+    UInt32 out_echo_reps;
+} STATS_ICMP;
+
+typedef struct {
+    UInt32 active_opens;
+    UInt32 passive_opens;
+    UInt32 attempt_fails;
+    UInt32 estab_resets;                        // resets received
+    UInt32 in_segs;
+    UInt32 out_segs;
+    UInt32 retrans_segs;
+    UInt32 out_rsts;
+    UInt32 in_no_socket;                        // no socket for the ports
+    UInt32 in_busy;                             // socket still holding data
+    UInt32 in_bad_ack;
+    UInt32 in_bad_seq;
+} STATS_TCP;
+
+typedef struct {
+    UInt32 in_datagrams;
+    UInt32 no_ports;
+    UInt32 in_errors;                           // sockets still holding a datagram
+    UInt32 out_datagrams;
+} STATS_UDP;
+
+typedef struct {
+    STATS_BUFFER buffer;
+    STATS_ARP arp;
+    STATS_IP ip;
+    STATS_ICMP icmp;
+    STATS_TCP tcp;
+    STATS_UDP udp;
+} STATS;
+
+// ---------------------------------------------
+// Each worker has its own copy, so counting is
+// a plain increment with no lock nor shared
+// cache line; the snapshot adds them up
+// ---------------------------------------------
+#define STAT_INC(xxx)                   (hermes->stats[HERMES_SLOT].xxx++)
+
+void stats_snapshot(STATS *s);
+void stats_clear(void);
@@ -16,18 +16,35 @@
 // Functions:       tcp_checksum()
 //                  make_header()
 //                  ack_send()
+//                  tcp_signal()
+//                  tcp_block()
+//                  tcp_wait()
+//                  tcp_match()
 //                  parse_tcp()
 //                  tcp_listen()
 //                  tcp_open()
 //                  tcp_close()
+//                  tcp_mss()
+//                  tcp_alloc()
 //                  tcp_new()
 //                  tcp_send()
 //                  tcp_send_text()
+//                  tcp_send_const()
 //                  tcp_read()
 //                  tcp_get_port()
 //                  tcp_is_open()
 //                  tcp_has_data()
 //                  tcp_init()
+//                  tcp_abort()
+//                  listen_step()
+//                  tcp_listen_nb()
+//                  open_step()
+//                  tcp_open_nb()
+//                  close_step()
+//                  tcp_close_nb()
+//                  send_step()
+//                  tcp_send_nb()
+//                  tcp_read_nb()
 // -------------------------------------------------------
 
 #include <stdlib.h>
@@ -57,46 +74,35 @@
 #define SYN                     0x02
 #define FIN                     0x01
 
-// ------------------
-// TCP sockets status
-// ------------------
-typedef struct {
-    IPV4 peer;
-    UInt16 p_rem;
-    UInt16 p_loc;
-    PPBUF buf;                              // last TCP message
-    _UInt32 ack;                            // remote sequence number
-    _UInt32 seq;                            // local sequence number
-    _UInt32 next;                           // pending sequence number
-    union {
-        struct {
-            bit(f_enabled);
-            bit(f_listen);
-            bit(f_close);
-            bit(f_syn);
-            bit(f_fin);
-            bit(f_ack);
-            bit(f_rst);
-        };
-        BYTE flags;
-    };
-    BYTE interface;
-} SOCKET_TCP;
-SOCKET_TCP sockets_tcp[MAX_SOCKETS_TCP];
-
 #define MASK_FLAGS              0b01111000
 
 // --------------------
 // local port selection
 // --------------------
-static UInt16 next_p_loc;
 #define MIN_P_LOC               1024
 #define MAX_P_LOC               32767
 
-static BYTE *ptr;
-static UInt16 size;
-static BYTE ind;
-static SOCKET_TCP *sckt;
+// --------------------------
+// state of the current stack
+// --------------------------
+#define sockets_tcp             (hermes->tcp.sockets)
+#define next_p_loc              (hermes->tcp.next_p_loc)
+
+static HERMES_TLS SOCKET_TCP *sckt;         // socket being handled
+
+// ------------------------------------------------
+// Sharded, a socket is parsed by a worker while
+// the application calls run on their own threads:
+// both work on its state holding the socket lock,
+// which the application releases while it waits
+// ------------------------------------------------
+#ifdef _SHARDS
+#define TCP_LOCK(s)             pthread_mutex_lock(&(s)->lock)
+#define TCP_UNLOCK(s)           pthread_mutex_unlock(&(s)->lock)
+#else
+#define TCP_LOCK(s)
+#define TCP_UNLOCK(s)
+#endif
 
 #define IPH(xxx) ((IP_HDR *)xxx)
 #define TCPH(xxx) ((TCP_HDR *)xxx)
@@ -111,36 +117,33 @@ static SOCKET_TCP *sckt;
 // ------------------------------------------------
 void tcp_checksum(PPBUF pbuf)
 {
-    size = pbuf->size;
-    ptr = pbuf->data;
+    BYTE *ptr;
+    UInt16 size;
+    BYTE ind;
 
-    // -------------------
-    // Check for odd sizes
-    // -------------------
-    if(size & 0x01) {
-        ptr[size] = 0x00;                      // add a pad to make it even
-        size++;
+    // ---------------------------------------
+    // loopback: no checksum (header gets 0)
+    // ---------------------------------------
+    if(ip_is_local(&IPH(BUF_START(pbuf))->dest)) {
+        chk_H = 0xff;
+        chk_L = 0xff;
+        return;
     }
 
     // -------------------------
     // computes message checksum
     // -------------------------
-    check_init();
-    while(size) {
-        check_update(*ptr);
-        ptr++;
-        size--;
-    }
+    check_buffer(pbuf);
 
     // ---------------------------------
     // account for the TCP pseudo-header
     // ---------------------------------
-    size = pbuf->size;
-    ptr = (BYTE *)&IPH(pbuf->start)->source;
+    size = buffer_size(pbuf);
+    ptr = (BYTE *)&IPH(BUF_START(pbuf))->source;
     for(ind=0; ind<8; ind++)
         check_update(*ptr++);
     check_update(0);
-    check_update(IPH(pbuf->start)->prot);
+    check_update(IPH(BUF_START(pbuf))->prot);
     check_update(HIGH(size));
     check_update(LOW(size));
 }
@@ -158,26 +161,27 @@ void make_header(PPBUF pbuf)
 {
     pbuf->size += sizeof(TCP_HDR);
 
-    TCPH(pbuf->data)->src_port = HTONS(sckt->p_loc);
-    TCPH(pbuf->data)->dst_port = HTONS(sckt->p_rem);
-    TCPH(pbuf->data)->hlen = 0x05 << 4;
-    TCPH(pbuf->data)->flags = 0;
-    TCPH(pbuf->data)->window = HTONS((UInt16)MSS);
-    TCPH(pbuf->data)->checksum = 0;
-    TCPH(pbuf->data)->urgent = 0;
+    TCPH(BUF_DATA(pbuf))->src_port = HTONS(sckt->p_loc);
+    TCPH(BUF_DATA(pbuf))->dst_port = HTONS(sckt->p_rem);
+    TCPH(BUF_DATA(pbuf))->hlen = 0x05 << 4;
+    TCPH(BUF_DATA(pbuf))->flags = 0;
+    TCPH(BUF_DATA(pbuf))->window = HTONS((UInt16)MSS);
+    TCPH(BUF_DATA(pbuf))->checksum = 0;
+    TCPH(BUF_DATA(pbuf))->urgent = 0;
+    IPH(BUF_START(pbuf))->frag = HTONS(IP_DF);                  // path MTU discovery
 
     // ----------------
     // sequence numbers
     // ----------------
-    TCPH(pbuf->data)->n_seq.b[0] = sckt->seq.b[3];
-    TCPH(pbuf->data)->n_seq.b[1] = sckt->seq.b[2];
-    TCPH(pbuf->data)->n_seq.b[2] = sckt->seq.b[1];
-    TCPH(pbuf->data)->n_seq.b[3] = sckt->seq.b[0];
-
-    TCPH(pbuf->data)->n_ack.b[0] = sckt->ack.b[3];
-    TCPH(pbuf->data)->n_ack.b[1] = sckt->ack.b[2];
-    TCPH(pbuf->data)->n_ack.b[2] = sckt->ack.b[1];
-    TCPH(pbuf->data)->n_ack.b[3] = sckt->ack.b[0];
+    TCPH(BUF_DATA(pbuf))->n_seq.b[0] = sckt->seq.b[3];
+    TCPH(BUF_DATA(pbuf))->n_seq.b[1] = sckt->seq.b[2];
+    TCPH(BUF_DATA(pbuf))->n_seq.b[2] = sckt->seq.b[1];
+    TCPH(BUF_DATA(pbuf))->n_seq.b[3] = sckt->seq.b[0];
+
+    TCPH(BUF_DATA(pbuf))->n_ack.b[0] = sckt->ack.b[3];
+    TCPH(BUF_DATA(pbuf))->n_ack.b[1] = sckt->ack.b[2];
+    TCPH(BUF_DATA(pbuf))->n_ack.b[2] = sckt->ack.b[1];
+    TCPH(BUF_DATA(pbuf))->n_ack.b[3] = sckt->ack.b[0];
 }
 
 // ------------------------------------------------
@@ -193,21 +197,110 @@ BOOL ack_send(BYTE flags)
 {
     PPBUF buf;
 
-    buf = ip_new(sckt->peer, 64, sckt->interface);
+    buf = ip_new(sckt->peer, 64, sckt->interface, QUOTA_CONTROL);
     if(buf == NULL) return FALSE;
 
     make_header(buf);
-    TCPH(buf->data)->flags = flags;
+    TCPH(BUF_DATA(buf))->flags = flags;
     sckt->flags &= (~MASK_FLAGS);
 
     tcp_checksum(buf);
-    TCPH(buf->data)->checksum = HTONS(~WORDOF(chk_H, chk_L));
+    TCPH(BUF_DATA(buf))->checksum = HTONS(~WORDOF(chk_H, chk_L));
 
     ip_send(buf);
     release_buffer(buf);
+    STAT_INC(tcp.out_segs);
     return TRUE;
 }	
 
+// ------------------------------------------------
+// Function:        tcp_signal()
+// ------------------------------------------------
+// Input:           Socket ID
+// Output:          -
+// ------------------------------------------------
+// Description:     Notifies waiting threads and
+//                  coroutines of a socket event
+// ------------------------------------------------
+void tcp_signal(BYTE n)
+{
+    sockets_tcp[n].f_event = TRUE;
+    os_signal(SIG_TCP+n);
+#ifdef _PT
+    pt_wake();
+#endif
+}
+
+// ------------------------------------------------
+// Function:        tcp_block()
+// ------------------------------------------------
+// Input:           Socket ID
+// Output:          FALSE on timeout
+// ------------------------------------------------
+// Description:     Waits for the socket signal,
+//                  its lock released meanwhile
+// ------------------------------------------------
+static BOOL tcp_block(BYTE n)
+{
+    BOOL res;
+
+    TCP_UNLOCK(&sockets_tcp[n]);
+    res = os_wait(SIG_TCP+n);
+    TCP_LOCK(&sockets_tcp[n]);
+    return res;
+}
+
+// ------------------------------------------------
+// Function:        tcp_wait()
+// ------------------------------------------------
+// Input:           Socket ID
+// Output:          TRUE on a socket event, FALSE
+//                  on timeout
+// ------------------------------------------------
+// Description:     Waits for the socket, whose
+//                  f_event was cleared before
+//                  sending. A signal left pending
+//                  by an event already handled is
+//                  skipped, or it would pass for
+//                  the answer and trigger a
+//                  retransmission
+// ------------------------------------------------
+static BOOL tcp_wait(BYTE n)
+{
+    do {
+        os_set_timeout(TIMEOUT_TCP);
+        if(!tcp_block(n)) return FALSE;
+    } while(!sockets_tcp[n].f_event);
+    sockets_tcp[n].f_event = FALSE;
+    return TRUE;
+}
+
+// ------------------------------------------------
+// Function:        tcp_match()
+// ------------------------------------------------
+// Input:           Socket
+//                  Remote IP address
+//                  Remote port
+//                  Local port
+// Output:          TRUE if the segment is its own
+// ------------------------------------------------
+// Description:     Checks a received segment
+//                  against a socket, whose lock is
+//                  held
+// ------------------------------------------------
+static BOOL tcp_match(SOCKET_TCP *s, IPV4 *peer, UInt16 p_rem, UInt16 p_loc)
+{
+    if(!s->f_enabled) return FALSE;
+    if(p_loc != s->p_loc) return FALSE;                         // check service port
+    if(s->f_listen && !s->f_syn) return TRUE;                   // listening: on any worker, until a SYN takes it
+#ifdef _SHARDS
+    if(s->shard != shard_id) return FALSE;                      // another worker's flow
+#endif
+    if(p_rem != s->p_rem) return FALSE;                         // check active connection: port
+    if(peer->d != s->peer.d) return FALSE;                      // check active connection: IP address
+    return TRUE;
+}
+
 // ------------------------------------------------
 // Function:        parse_tcp()
 // ------------------------------------------------
@@ -219,24 +312,26 @@ BOOL ack_send(BYTE flags)
 void parse_tcp(PPBUF pbuf)
 {
     SOCKET_TCP *s;
+    UInt16 src_port;
+    UInt16 dst_port;
+    UInt16 size;
     BYTE flags;
     BYTE hdr;
     BYTE i;
 
-    TCPH(pbuf->data)->dst_port = NTOHS((TCPH(pbuf->data)->dst_port));
-    TCPH(pbuf->data)->src_port = NTOHS((TCPH(pbuf->data)->src_port));
+    STAT_INC(tcp.in_segs);
+    LAT_MARK(pbuf, LAT_RX_PARSE);
+    dst_port = NTOHS((TCPH(BUF_DATA(pbuf))->dst_port));         // the header is only read: on
+    src_port = NTOHS((TCPH(BUF_DATA(pbuf))->src_port));         // loopback it is the sender's
 
     // ---------------------
     // find an active socket
     // ---------------------
     s = sockets_tcp;
     for(i=0; i<MAX_SOCKETS_TCP; i++, s++) {
-        if(!s->f_enabled) continue;
-        if(TCPH(pbuf->data)->dst_port != s->p_loc) continue;    // check service port
-        if(s->f_listen) goto parse;                             // no more tests if socket is listening
-        if(TCPH(pbuf->data)->src_port != s->p_rem) continue;    // check active connection: port
-        if(IPH(pbuf->start)->source.d != s->peer.d) continue;   // check active connection: IP address
-        goto parse;
+        TCP_LOCK(s);
+        if(tcp_match(s, &IPH(BUF_START(pbuf))->source, src_port, dst_port)) goto parse;
+        TCP_UNLOCK(s);
     }
 
 #ifdef _NAT
@@ -244,44 +339,52 @@ void parse_tcp(PPBUF pbuf)
     // no socket for processing, try NAT routing
     // -----------------------------------------
     retain_buffer(pbuf);
-    pbuf->protocol = BUFFER_NAT_TCP;
+    BUF_PROTOCOL(pbuf) = BUFFER_NAT_TCP;
 #endif
 	
     // ----------------------------------
     // no socket for processing, dischard
     // ----------------------------------
+    STAT_INC(tcp.in_no_socket);
     return;
 
 parse:
     // ---------------------
     // calculate header size
     // ---------------------
-    hdr = TCPH(pbuf->data)->hlen;
+    hdr = TCPH(BUF_DATA(pbuf))->hlen;
     hdr = (hdr & 0xf0) >> 2;
+    size = buffer_size(pbuf);                                   // a reassembled segment is a chain
 
-    if((pbuf->size > hdr) && (s->buf))                          // do not overwrite previous data
-            return;
+    if((size > hdr) && (s->buf)) {                              // do not overwrite previous data
+        STAT_INC(tcp.in_busy);
+        goto done;
+    }
 
     // --------------------
     // update socket status
     // --------------------
-    s->peer = IPH(pbuf->start)->source;
-    s->p_rem = TCPH(pbuf->data)->src_port;
+    s->peer = IPH(BUF_START(pbuf))->source;
+    s->p_rem = src_port;
     s->interface = pbuf->interface;
+#ifdef _SHARDS
+    s->shard = shard_flow(s->peer.d, src_port, dst_port);      // an accepted flow stays on this worker
+#endif
 
     // ----------------
     // flags processing
     // ----------------
-    flags = TCPH(pbuf->data)->flags;
+    flags = TCPH(BUF_DATA(pbuf))->flags;
     if(flags & ACK) {
         // -----------------------------
         // check pending sequence number
         // -----------------------------
-        if((s->next.b[0] != TCPH(pbuf->data)->n_ack.b[3]) ||
-           (s->next.b[1] != TCPH(pbuf->data)->n_ack.b[2]) ||
-           (s->next.b[2] != TCPH(pbuf->data)->n_ack.b[1]) ||
-           (s->next.b[3] != TCPH(pbuf->data)->n_ack.b[0])) {
-            return;                                             // incorrect sequence: dischard packet
+        if((s->next.b[0] != TCPH(BUF_DATA(pbuf))->n_ack.b[3]) ||
+           (s->next.b[1] != TCPH(BUF_DATA(pbuf))->n_ack.b[2]) ||
+           (s->next.b[2] != TCPH(BUF_DATA(pbuf))->n_ack.b[1]) ||
+           (s->next.b[3] != TCPH(BUF_DATA(pbuf))->n_ack.b[0])) {
+            STAT_INC(tcp.in_bad_ack);
+            goto done;                                          // incorrect sequence: dischard packet
         }
 
         // -------------------------------------
@@ -295,31 +398,32 @@ parse:
         // -----------------------------------
         // update socket with sync information
         // -----------------------------------
-        s->ack.b[0] = TCPH(pbuf->data)->n_seq.b[3];
-        s->ack.b[1] = TCPH(pbuf->data)->n_seq.b[2];
-        s->ack.b[2] = TCPH(pbuf->data)->n_seq.b[1];
-        s->ack.b[3] = TCPH(pbuf->data)->n_seq.b[0];
+        s->ack.b[0] = TCPH(BUF_DATA(pbuf))->n_seq.b[3];
+        s->ack.b[1] = TCPH(BUF_DATA(pbuf))->n_seq.b[2];
+        s->ack.b[2] = TCPH(BUF_DATA(pbuf))->n_seq.b[1];
+        s->ack.b[3] = TCPH(BUF_DATA(pbuf))->n_seq.b[0];
         s->ack.d++;                                             // SYN flag takes one sequence number
         s->f_syn = TRUE;
     } else {
         // ----------------------------
         // check remote sequence number
         // ----------------------------
-        if((TCPH(pbuf->data)->n_seq.b[0] != s->ack.b[3]) ||
-           (TCPH(pbuf->data)->n_seq.b[1] != s->ack.b[2]) ||
-           (TCPH(pbuf->data)->n_seq.b[2] != s->ack.b[1]) ||
-           (TCPH(pbuf->data)->n_seq.b[3] != s->ack.b[0])) {
-            if(pbuf->size > hdr) {
+        if((TCPH(BUF_DATA(pbuf))->n_seq.b[0] != s->ack.b[3]) ||
+           (TCPH(BUF_DATA(pbuf))->n_seq.b[1] != s->ack.b[2]) ||
+           (TCPH(BUF_DATA(pbuf))->n_seq.b[2] != s->ack.b[1]) ||
+           (TCPH(BUF_DATA(pbuf))->n_seq.b[3] != s->ack.b[0])) {
+            STAT_INC(tcp.in_bad_seq);
+            if(size > hdr) {
                 sckt = s;
-                envia_ack(ACK);                                 // sends back the expected sequence number
+                ack_send(ACK);                                 // sends back the expected sequence number
             }
-            return;
+            goto done;
         }
 
         // -------------------------------------
         // sequence numbers match, accept packet
         // -------------------------------------
-        s->ack.d += (pbuf->size - hdr);
+        s->ack.d += (size - hdr);
         s->f_syn = FALSE;
     }
 
@@ -330,32 +434,39 @@ parse:
             // --------------------------------
             // disconnecttion initiated by peer
             // --------------------------------
+            flags = s->f_ack;                                   // may complete a tcp_send()
             sckt = s;
-            envia_ack(FIN | ACK);
+            ack_send(FIN | ACK);
             s->flags = 0;                                       // close socket
-            os_signal(SIG_TCP+i);
-            return;
+            s->f_ack = flags;
+            tcp_signal(i);
+            goto done;
         }
     } else s->f_fin = FALSE;
 
     if(flags & RST) {
+        STAT_INC(tcp.estab_resets);
         s->flags = 0;                                           // force disconnection
-        os_signal(SIG_TCP+i);
-        return;
+        tcp_signal(i);
+        goto done;
     }
 
-    if(pbuf->size > hdr) {
+    if(size > hdr) {
         // ------------------------------------
         // packet contains data for application
         // ------------------------------------
         retain_buffer(pbuf);
-        pbuf->data += hdr;
-        pbuf->ptr = pbuf->data;
+        pbuf->offset += hdr;
+        pbuf->pos = pbuf->offset;
         pbuf->size -= hdr;
+        QUOTA_OWN(pbuf, QUOTA_OWNER_TCP(i));
         s->buf = pbuf;
     }
 
-    os_signal(SIG_TCP+i);                                       // send signal to waiting threads
+    tcp_signal(i);                                              // send signal to waiting threads
+
+done:
+    TCP_UNLOCK(s);
 }
 
 // ------------------------------------------------
@@ -376,7 +487,11 @@ BOOL tcp_listen(BYTE n, UInt16 p_loc)
 
     if(n > MAX_SOCKETS_TCP) return FALSE;
     s = &sockets_tcp[n];
-    if(s->f_enabled || s->f_listen) return FALSE;
+    TCP_LOCK(s);
+    if(s->f_enabled || s->f_listen) {
+        TCP_UNLOCK(s);
+        return FALSE;
+    }
 
     // -----------------------------
     // socket in the listening state
@@ -385,29 +500,41 @@ BOOL tcp_listen(BYTE n, UInt16 p_loc)
     s->f_enabled = TRUE;
     s->f_listen = TRUE;
     s->p_loc = p_loc;
+#ifdef _SHARDS
+    s->shard = SHARD_NONE;                                      // listens on every worker
+#endif
 
     // ----------------------------
     // wait for a remote connection
     // ----------------------------
-    if(!os_wait(SIG_TCP+n)) goto error;
+    do {
+        if(!tcp_block(n)) goto error;
+    } while(!s->f_event);                                       // left over from a previous use
+    s->f_event = FALSE;
     if(!s->f_syn) goto error;
     if(s->f_rst || s->f_fin) goto error;
 
     s->next.d = s->seq.d + 1;
     s->f_listen = FALSE;
+    STAT_INC(tcp.passive_opens);
 
     // ---------------------------
     // proceed with the connection
     // ---------------------------
     retry = 0;
     while(retry < MAX_RETRIES) {
+        if(retry) STAT_INC(tcp.retrans_segs);
+        s->f_event = FALSE;
         sckt = s;
         ack_send(SYN | ACK);
-        os_set_timeout(TIMEOUT_TCP);
-        os_wait(SIG_TCP+n);
-        if(s->f_ack) return TRUE;                               // ack received, connection stablished
+        tcp_wait(n);
+        if(s->f_ack) {
+            TCP_UNLOCK(s);
+            return TRUE;                                        // ack received, connection stablished
+        }
         retry++;
     }
+    STAT_INC(tcp.attempt_fails);
 
 error:
     // -----------------
@@ -418,6 +545,7 @@ error:
         s->buf = NULL;
     }
     s->flags = 0;
+    TCP_UNLOCK(s);
     return FALSE;
 }
 
@@ -441,7 +569,11 @@ BOOL tcp_open(BYTE n, UInt16 p_loc, IPV4 ip_rem, UInt16 p_rem, BYTE interface)
 
     if(n > MAX_SOCKETS_TCP) return FALSE;
     s = &sockets_tcp[n];
-    if(s->f_enabled || s->f_listen) return FALSE;
+    TCP_LOCK(s);
+    if(s->f_enabled || s->f_listen) {
+        TCP_UNLOCK(s);
+        return FALSE;
+    }
 
     // ------------------------
     // prepare socket structure
@@ -453,17 +585,22 @@ BOOL tcp_open(BYTE n, UInt16 p_loc, IPV4 ip_rem, UInt16 p_rem, BYTE interface)
     s->p_rem = p_rem;
     s->peer.d = ip_rem.d;
     s->next.d = s->seq.d + 1;
+#ifdef _SHARDS
+    s->shard = shard_flow(ip_rem.d, p_rem, p_loc);
+#endif
 
     // --------------------
     // connection procedure
     // --------------------
+    STAT_INC(tcp.active_opens);
     retry = 0;
     while(retry < MAX_RETRIES) {
+        if(retry) STAT_INC(tcp.retrans_segs);
+        s->f_event = FALSE;
         sckt = s;
         ack_send(SYN);
 
-        os_set_timeout(TIMEOUT_TCP);
-        if(os_wait(SIG_TCP+n)) {
+        if(tcp_wait(n)) {
             if(s->f_rst) goto error;
             if(s->f_ack && s->f_syn) goto done;
             if(s->f_ack) goto syn_wait;
@@ -476,11 +613,13 @@ error:
     // -----------------
     // connection failed
     // -----------------
+    STAT_INC(tcp.attempt_fails);
     if(s->buf) {
         release_buffer(s->buf);
         s->buf = NULL;
     }
     s->flags = 0;
+    TCP_UNLOCK(s);
     return FALSE;
 
 syn_wait:
@@ -489,8 +628,7 @@ syn_wait:
     // -------------------------
     retry = 0;
     while(retry < MAX_RETRIES) {
-        os_set_timeout(TIMEOUT_TCP);
-        if(os_wait(SIG_TCP+n)) {
+        if(tcp_wait(n)) {
             if(s->f_rst) goto error;
             if(s->f_syn) goto done;
         }
@@ -504,11 +642,11 @@ ack_wait:
     // -------------------------
     retry = 0;
     while(retry < MAX_RETRIES) {
+        s->f_event = FALSE;
         sckt = s;
         ack_send(ACK);
 
-        os_set_timeout(TIMEOUT_TCP);
-        if(os_wait(SIG_TCP+n)) {
+        if(tcp_wait(n)) {
             if(s->f_rst) goto error;
             if(s->f_ack) goto done;
         }
@@ -522,6 +660,7 @@ done:
     // ---------------------
     sckt = s;
     ack_send(ACK);
+    TCP_UNLOCK(s);
     return TRUE;
 }
 
@@ -540,7 +679,11 @@ void tcp_close(BYTE n)
 
     if(n > MAX_SOCKETS_TCP) return;
     s = &sockets_tcp[n];
-    if(!s->f_enabled) return;
+    TCP_LOCK(s);
+    if(!s->f_enabled) {
+        TCP_UNLOCK(s);
+        return;
+    }
 
     if(s->buf) {
         release_buffer(s->buf);
@@ -555,11 +698,12 @@ void tcp_close(BYTE n)
     // -----------------------
     retry = 0;
     while(retry < MAX_RETRIES) {
+        if(retry) STAT_INC(tcp.retrans_segs);
+        s->f_event = FALSE;
         sckt = s;
         ack_send(ACK | FIN);
 
-        os_set_timeout(TIMEOUT_TCP);
-        if(os_wait(SIG_TCP+n)) {
+        if(tcp_wait(n)) {
             if(s->f_rst) goto error;
             if(s->f_ack && s->f_fin) goto done;
             if(s->f_ack) goto fin_wait;
@@ -577,6 +721,7 @@ error:
         s->buf = NULL;
     }
     s->flags = 0;
+    TCP_UNLOCK(s);
     return;
 
 fin_wait:
@@ -585,8 +730,7 @@ fin_wait:
     // -------------------------
     retry = 0;
     while(retry < MAX_RETRIES) {
-        os_set_timeout(TIMEOUT_TCP);
-        if(os_wait(SIG_TCP+n)) {
+        if(tcp_wait(n)) {
             if(s->f_rst) goto error;
             if(s->f_fin) goto done;
         }
@@ -600,11 +744,11 @@ ack_wait:
     // -------------------------
     retry = 0;
     while(retry < MAX_RETRIES) {
+        s->f_event = FALSE;
         sckt = s;
         ack_send(ACK);
 
-        os_set_timeout(TIMEOUT_TCP);
-        if(os_wait(SIG_TCP+n)) {
+        if(tcp_wait(n)) {
             if(s->f_rst) goto error;
             if(s->f_ack) goto done;
         }
@@ -623,6 +767,7 @@ done:
         s->buf = NULL;
     }
     s->flags = 0;
+    TCP_UNLOCK(s);
 }
 
 // ------------------------------------------------
@@ -639,6 +784,7 @@ void tcp_reset(BYTE n)
 
     if(n > MAX_SOCKETS_TCP) return;
     s = &sockets_tcp[n];
+    TCP_LOCK(s);
     if(s->buf) {
         release_buffer(s->buf);
         s->buf = NULL;
@@ -650,39 +796,82 @@ void tcp_reset(BYTE n)
     if(s->f_enabled) {
         sckt = s;
         ack_send(ACK | RST);
+        STAT_INC(tcp.out_rsts);
     }
     s->flags = 0;
+    TCP_UNLOCK(s);
 }
 
 // ------------------------------------------------
-// Function:        tcp_new()
+// Function:        tcp_mss()
 // ------------------------------------------------
 // Input:           Socket ID
+// Output:          Segment payload size
+// ------------------------------------------------
+// Description:     Largest payload a segment may
+//                  carry without fragmentation,
+//                  following the path MTU
+// ------------------------------------------------
+UInt16 tcp_mss(BYTE s)
+{
+    UInt16 mtu;
+
+    if(s >= MAX_SOCKETS_TCP) return 0;
+    TCP_LOCK(&sockets_tcp[s]);
+    mtu = route_mtu(&sockets_tcp[s].peer, sockets_tcp[s].interface);
+    TCP_UNLOCK(&sockets_tcp[s]);
+    if(mtu > MSS) mtu = MSS;
+    return mtu - sizeof(IP_HDR) - sizeof(TCP_HDR);
+}
+
+// ------------------------------------------------
+// Function:        tcp_alloc()
+// ------------------------------------------------
+// Input:           Socket ID
+//                  Room for data
 // Output:          buffer to fill-in
 // ------------------------------------------------
 // Description:     Prepares a buffer for sending
-//                  TCP data
+//                  TCP data, headers in place
 // ------------------------------------------------
-PPBUF tcp_new(BYTE s)
+static PPBUF tcp_alloc(BYTE s, UInt16 size)
 {
     PPBUF new;
 
-    if(s > MAX_SOCKETS_TCP) return NULL;
+    if(s >= MAX_SOCKETS_TCP) return NULL;
     sckt = &sockets_tcp[s];
+    if(QUOTA_FULL(QUOTA_OWNER_TCP(s))) return NULL;         // leave buffers to the other sockets
 
-    new = ip_new(sckt->peer, MSS, sckt->interface);
+    TCP_LOCK(sckt);
+    new = ip_new(sckt->peer, size + sizeof(IP_HDR) + sizeof(TCP_HDR), sckt->interface, QUOTA_TX);
+    if(new != NULL) make_header(new);
+    TCP_UNLOCK(sckt);
     if(new == NULL) return NULL;
+    QUOTA_OWN(new, QUOTA_OWNER_TCP(s));
 
-    make_header(new);
-    TCPH(new->data)->flags = ACK | PSH;
+    TCPH(BUF_DATA(new))->flags = ACK | PSH;
 
-    new->data += sizeof(TCP_HDR);
-    new->ptr = new->data;
+    new->offset += sizeof(TCP_HDR);
+    new->pos = new->offset;
     new->size = 0;
-    IPH(new->start)->prot = IP_PROT_TCP;
+    IPH(BUF_START(new))->prot = IP_PROT_TCP;
     return new;
 }
 
+// ------------------------------------------------
+// Function:        tcp_new()
+// ------------------------------------------------
+// Input:           Socket ID
+// Output:          buffer to fill-in
+// ------------------------------------------------
+// Description:     Prepares a buffer for sending
+//                  TCP data, room for one MSS
+// ------------------------------------------------
+PPBUF tcp_new(BYTE s)
+{
+    return tcp_alloc(s, tcp_mss(s));
+}
+
 // ------------------------------------------------
 // Function:        tcp_send()
 // ------------------------------------------------
@@ -699,34 +888,42 @@ BOOL tcp_send(BYTE id, PPBUF pbuf)
 
     if(id > MAX_SOCKETS_TCP) return FALSE;
     s = &sockets_tcp[id];
-    if(!s->f_enabled) return FALSE;
-    if(s->f_listen) return FALSE;
-    if(s->buf) return FALSE;
+    TCP_LOCK(s);
+    if(!s->f_enabled || s->f_listen || s->buf) {
+        TCP_UNLOCK(s);
+        return FALSE;
+    }
 
     // -------------------------------
     // update sequence and packet size
     // -------------------------------
-    s->next.d = s->seq.d + pbuf->size;
-    pbuf->data -= sizeof(TCP_HDR);
+    s->next.d = s->seq.d + buffer_size(pbuf);
+    pbuf->offset -= sizeof(TCP_HDR);
     pbuf->size += sizeof(TCP_HDR);
 
     // --------
     // checksum
     // --------
     tcp_checksum(pbuf);
-    TCPH(pbuf->data)->checksum = HTONS(~WORDOF(chk_H, chk_L));
+    TCPH(BUF_DATA(pbuf))->checksum = HTONS(~WORDOF(chk_H, chk_L));
 
     // ----------------------
     // send data and wait ack
     // ----------------------
     retry = 0;
     while(retry < MAX_RETRIES) {
+        if(retry) STAT_INC(tcp.retrans_segs);
         s->flags &= (~MASK_FLAGS);
+        s->f_event = FALSE;
+        LAT_STAMP(pbuf);
         ip_send(pbuf);
-        os_set_timeout(TIMEOUT_TCP);
-        if(os_wait(SIG_TCP+id)) {
-            if(s->f_rst) break;
-            if(s->f_ack) return TRUE;
+        STAT_INC(tcp.out_segs);
+        if(tcp_wait(id)) {
+            if(s->f_rst || !s->f_enabled) break;               // reset or closed by the peer
+            if(s->f_ack) {
+                TCP_UNLOCK(s);
+                return TRUE;
+            }
         }
         retry++;
     }
@@ -739,6 +936,7 @@ BOOL tcp_send(BYTE id, PPBUF pbuf)
         s->buf = NULL;
     }
     s->flags = 0;
+    TCP_UNLOCK(s);
     return FALSE;
 }
 
@@ -766,6 +964,52 @@ BOOL tcp_send_text(BYTE id, char *texto)
     return res;
 }
 
+// ------------------------------------------------
+// Function:        tcp_send_const()
+// ------------------------------------------------
+// Input:           Socket ID
+//                  Immutable data (flash, static)
+//                  Data size
+//                  Checksum (check_block()), 0 to
+//                  sum it from the data
+// Output:          TRUE if succesful
+// ------------------------------------------------
+// Description:     Sends data that outlives the
+//                  connection without copying it,
+//                  one segment per MSS. Only the
+//                  headers take RAM while waiting
+//                  for the ACK
+// ------------------------------------------------
+BOOL tcp_send_const(BYTE id, const BYTE *p, UInt16 size, UInt16 sum)
+{
+    PPBUF buf;
+    PPBUF seg;
+    UInt16 n;
+    BYTE res;
+
+    do {
+        n = tcp_mss(id);
+        if(n >= size) n = size;
+        else sum = 0;                                       // it covers the whole block only
+
+        buf = tcp_alloc(id, 0);
+        if(buf == NULL) return FALSE;
+        seg = const_buffer(p, n, sum);
+        if(seg == NULL) {
+            release_buffer(buf);
+            return FALSE;
+        }
+        chain_buffer(buf, seg);
+
+        res = tcp_send(id, buf);
+        release_buffer(buf);
+        if(!res) return FALSE;
+        p += n;
+        size -= n;
+    } while(size);
+    return TRUE;
+}
+
 // ------------------------------------------------
 // Function:        tcp_read()
 // ------------------------------------------------
@@ -782,22 +1026,34 @@ PPBUF tcp_read(BYTE n)
 
     if(n > MAX_SOCKETS_TCP) return NULL;
     s = &sockets_tcp[n];
-    if(!s->f_enabled) return NULL;
+    TCP_LOCK(s);
+    if(!s->f_enabled) goto none;
 
-    if(s->buf == NULL)                                      // check for pending data
-        os_wait(SIG_TCP+n);                                 // wait for TCP data
+    if(s->buf == NULL) {                                    // check for pending data
+        do {
+            if(!tcp_block(n)) goto none;                    // wait for TCP data
+        } while(!s->f_event);
+    }
+    s->f_event = FALSE;
 
-    if(s->buf == NULL) return NULL;
+    if(s->buf == NULL) goto none;
 
     // ---------------------
     // acknowledges the data
     // ---------------------
     sckt = s;
-    envia_ack(ACK);
+    ack_send(ACK);
 
     res = s->buf;
     s->buf = NULL;
+    TCP_UNLOCK(s);
+    LAT_MARK(res, LAT_RX_APP);
+    LAT_SPAN(res, LAT_RX_TOTAL);
     return res;
+
+none:
+    TCP_UNLOCK(s);
+    return NULL;
 }	
 
 // ------------------------------------------------
@@ -851,8 +1107,13 @@ search:
 // ------------------------------------------------
 BOOL tcp_is_open(BYTE s)
 {
+    BOOL res;
+
     if(s > MAX_SOCKETS_TCP) return FALSE;
-    return sockets_tcp[s].f_enabled;
+    TCP_LOCK(&sockets_tcp[s]);
+    res = sockets_tcp[s].f_enabled;
+    TCP_UNLOCK(&sockets_tcp[s]);
+    return res;
 }	
 
 // ------------------------------------------------
@@ -866,9 +1127,13 @@ BOOL tcp_is_open(BYTE s)
 // ------------------------------------------------
 BOOL tcp_has_data(BYTE s)
 {
+    BOOL res;
+
     if(s > MAX_SOCKETS_TCP) return FALSE;
-    if(sockets_tcp[s].buf == NULL) return FALSE;
-    return TRUE;
+    TCP_LOCK(&sockets_tcp[s]);
+    res = (sockets_tcp[s].buf != NULL);
+    TCP_UNLOCK(&sockets_tcp[s]);
+    return res;
 }	
 
 // ------------------------------------------------
@@ -881,8 +1146,471 @@ BOOL tcp_has_data(BYTE s)
 // ------------------------------------------------
 void tcp_init(void)
 {
+#ifdef _SHARDS
+    BYTE i;
+#endif
+
     os_set((BYTE *)sockets_tcp, 0, sizeof(sockets_tcp));
+#ifdef _SHARDS
+    for(i=0; i<MAX_SOCKETS_TCP; i++)
+        pthread_mutex_init(&sockets_tcp[i].lock, NULL);
+#endif
     next_p_loc = MIN_P_LOC;
 }
 
+#ifdef _PT
+// ------------------------------------------------
+// Non-blocking (coroutine) interface
+// ------------------------------------------------
+// Each call resumes the operation started by the
+// first call with the same PT and returns
+// PT_WAITING until it completes with PT_DONE or
+// PT_ERROR. The same arguments must be passed on
+// every call until then: the socket is looked up
+// from them at each resume, and tcp_send_nb()
+// sends the buffer again on every retry.
+// ------------------------------------------------
+
+// ------------------------------------------------
+// Function:        tcp_abort()
+// ------------------------------------------------
+// Input:           Socket
+// Output:          -
+// ------------------------------------------------
+// Description:     Drops a socket after a failed
+//                  non-blocking operation
+// ------------------------------------------------
+static void tcp_abort(SOCKET_TCP *s)
+{
+    if(s->buf) {
+        release_buffer(s->buf);
+        s->buf = NULL;
+    }
+    s->flags = 0;
+}
+
+// ------------------------------------------------
+// Function:        listen_step()
+// ------------------------------------------------
+// Input:           As tcp_listen_nb()
+// Output:          As tcp_listen_nb()
+// ------------------------------------------------
+// Description:     Runs tcp_listen_nb() up to
+//                  its next wait
+// ------------------------------------------------
+static BYTE listen_step(PT *pt, BYTE n, UInt16 p_loc)
+{
+    SOCKET_TCP *s;
+
+    s = &sockets_tcp[n];
+
+    PT_BEGIN(pt);
+    if(s->f_enabled || s->f_listen) PT_EXIT(pt, PT_ERROR);
+
+    // -----------------------------
+    // socket in the listening state
+    // -----------------------------
+    s->flags = 0;
+    s->f_enabled = TRUE;
+    s->f_listen = TRUE;
+    s->p_loc = p_loc;
+#ifdef _SHARDS
+    s->shard = SHARD_NONE;                                      // listens on every worker
+#endif
+
+    // ----------------------------
+    // wait for a remote connection
+    // ----------------------------
+    PT_WAIT_UNTIL(pt, s->f_event || !s->f_enabled);
+    s->f_event = FALSE;
+    if(!s->f_syn) goto error;
+    if(s->f_rst || s->f_fin) goto error;
+
+    s->next.d = s->seq.d + 1;
+    s->f_listen = FALSE;
+    STAT_INC(tcp.passive_opens);
+
+    // ---------------------------
+    // proceed with the connection
+    // ---------------------------
+    for(pt->retry=0; pt->retry<MAX_RETRIES; pt->retry++) {
+        if(pt->retry) STAT_INC(tcp.retrans_segs);
+        sckt = s;
+        ack_send(SYN | ACK);
+        PT_TIMEOUT(pt, TIMEOUT_TCP);
+        PT_WAIT_UNTIL(pt, s->f_event || PT_EXPIRED(pt));
+        s->f_event = FALSE;
+        if(s->f_ack) PT_EXIT(pt, PT_DONE);              // ack received, connection stablished
+    }
+    STAT_INC(tcp.attempt_fails);
+
+error:
+    tcp_abort(s);
+    PT_EXIT(pt, PT_ERROR);
+    PT_END(pt);
+}
+
+// ------------------------------------------------
+// Function:        tcp_listen_nb()
+// ------------------------------------------------
+// Input:           Coroutine state
+//                  Socket ID
+//                  Service TCP port
+// Output:          PT_DONE when client connected
+// ------------------------------------------------
+// Description:     Non-blocking tcp_listen()
+// ------------------------------------------------
+BYTE tcp_listen_nb(PT *pt, BYTE n, UInt16 p_loc)
+{
+    BYTE res;
+
+    if(n >= MAX_SOCKETS_TCP) return PT_ERROR;
+    TCP_LOCK(&sockets_tcp[n]);
+    res = listen_step(pt, n, p_loc);
+    TCP_UNLOCK(&sockets_tcp[n]);
+    return res;
+}
+
+// ------------------------------------------------
+// Function:        open_step()
+// ------------------------------------------------
+// Input:           As tcp_open_nb()
+// Output:          As tcp_open_nb()
+// ------------------------------------------------
+// Description:     Runs tcp_open_nb() up to
+//                  its next wait
+// ------------------------------------------------
+static BYTE open_step(PT *pt, BYTE n, UInt16 p_loc, IPV4 ip_rem, UInt16 p_rem, BYTE interface)
+{
+    SOCKET_TCP *s;
+
+    s = &sockets_tcp[n];
+
+    PT_BEGIN(pt);
+    if(s->f_enabled || s->f_listen) PT_EXIT(pt, PT_ERROR);
+
+    // ------------------------
+    // prepare socket structure
+    // ------------------------
+    s->flags = 0;
+    s->f_enabled = TRUE;
+    s->interface = interface;
+    s->p_loc = p_loc;
+    s->p_rem = p_rem;
+    s->peer.d = ip_rem.d;
+    s->next.d = s->seq.d + 1;
+#ifdef _SHARDS
+    s->shard = shard_flow(ip_rem.d, p_rem, p_loc);
+#endif
+
+    // --------------------
+    // connection procedure
+    // --------------------
+    STAT_INC(tcp.active_opens);
+    for(pt->retry=0; pt->retry<MAX_RETRIES; pt->retry++) {
+        if(pt->retry) STAT_INC(tcp.retrans_segs);
+        sckt = s;
+        ack_send(SYN);
+        PT_TIMEOUT(pt, TIMEOUT_TCP);
+        PT_WAIT_UNTIL(pt, s->f_event || PT_EXPIRED(pt));
+        if(s->f_event) {
+            s->f_event = FALSE;
+            if(s->f_rst || !s->f_enabled) goto error;
+            if(s->f_ack && s->f_syn) goto done;
+            if(s->f_ack) goto syn_wait;
+            if(s->f_syn) goto ack_wait;
+        }
+    }
+    goto error;
+
+syn_wait:
+    // -------------------------
+    // ack received, waiting syn
+    // -------------------------
+    for(pt->retry=0; pt->retry<MAX_RETRIES; pt->retry++) {
+        PT_TIMEOUT(pt, TIMEOUT_TCP);
+        PT_WAIT_UNTIL(pt, s->f_event || PT_EXPIRED(pt));
+        if(s->f_event) {
+            s->f_event = FALSE;
+            if(s->f_rst || !s->f_enabled) goto error;
+            if(s->f_syn) goto done;
+        }
+    }
+    goto error;
+
+ack_wait:
+    // -------------------------
+    // syn received, waiting ack
+    // -------------------------
+    for(pt->retry=0; pt->retry<MAX_RETRIES; pt->retry++) {
+        sckt = s;
+        ack_send(ACK);
+        PT_TIMEOUT(pt, TIMEOUT_TCP);
+        PT_WAIT_UNTIL(pt, s->f_event || PT_EXPIRED(pt));
+        if(s->f_event) {
+            s->f_event = FALSE;
+            if(s->f_rst || !s->f_enabled) goto error;
+            if(s->f_ack) goto done;
+        }
+    }
+
+error:
+    STAT_INC(tcp.attempt_fails);
+    tcp_abort(s);
+    PT_EXIT(pt, PT_ERROR);
+
+done:
+    sckt = s;
+    ack_send(ACK);
+    PT_END(pt);
+}
+
+// ------------------------------------------------
+// Function:        tcp_open_nb()
+// ------------------------------------------------
+// Input:           Coroutine state
+//                  Socket ID
+//                  Local TCP port
+//                  Server IP address
+//                  Destination service TCP port
+//                  Network interface ID
+// Output:          PT_DONE when connected
+// ------------------------------------------------
+// Description:     Non-blocking tcp_open()
+// ------------------------------------------------
+BYTE tcp_open_nb(PT *pt, BYTE n, UInt16 p_loc, IPV4 ip_rem, UInt16 p_rem, BYTE interface)
+{
+    BYTE res;
+
+    if(n >= MAX_SOCKETS_TCP) return PT_ERROR;
+    TCP_LOCK(&sockets_tcp[n]);
+    res = open_step(pt, n, p_loc, ip_rem, p_rem, interface);
+    TCP_UNLOCK(&sockets_tcp[n]);
+    return res;
+}
+
+// ------------------------------------------------
+// Function:        close_step()
+// ------------------------------------------------
+// Input:           As tcp_close_nb()
+// Output:          As tcp_close_nb()
+// ------------------------------------------------
+// Description:     Runs tcp_close_nb() up to
+//                  its next wait
+// ------------------------------------------------
+static BYTE close_step(PT *pt, BYTE n)
+{
+    SOCKET_TCP *s;
+
+    s = &sockets_tcp[n];
+
+    PT_BEGIN(pt);
+    if(!s->f_enabled) PT_EXIT(pt, PT_DONE);
+
+    if(s->buf) {
+        release_buffer(s->buf);
+        s->buf = NULL;
+    }
+
+    s->f_close = TRUE;
+    s->f_event = FALSE;
+    s->next.d = s->seq.d + 1;                       // FIN flag takes one sequence number
+
+    // -----------------------
+    // disconnection procedure
+    // -----------------------
+    for(pt->retry=0; pt->retry<MAX_RETRIES; pt->retry++) {
+        if(pt->retry) STAT_INC(tcp.retrans_segs);
+        sckt = s;
+        ack_send(ACK | FIN);
+        PT_TIMEOUT(pt, TIMEOUT_TCP);
+        PT_WAIT_UNTIL(pt, s->f_event || PT_EXPIRED(pt));
+        if(s->f_event) {
+            s->f_event = FALSE;
+            if(s->f_rst || !s->f_enabled) goto error;
+            if(s->f_ack && s->f_fin) goto done;
+            if(s->f_ack) goto fin_wait;
+            if(s->f_fin) goto ack_wait;
+        }
+    }
+    goto error;
+
+fin_wait:
+    // -------------------------
+    // ack received, waiting fin
+    // -------------------------
+    for(pt->retry=0; pt->retry<MAX_RETRIES; pt->retry++) {
+        PT_TIMEOUT(pt, TIMEOUT_TCP);
+        PT_WAIT_UNTIL(pt, s->f_event || PT_EXPIRED(pt));
+        if(s->f_event) {
+            s->f_event = FALSE;
+            if(s->f_rst || !s->f_enabled) goto error;
+            if(s->f_fin) goto done;
+        }
+    }
+    goto error;
+
+ack_wait:
+    // -------------------------
+    // fin received, waiting ack
+    // -------------------------
+    for(pt->retry=0; pt->retry<MAX_RETRIES; pt->retry++) {
+        sckt = s;
+        ack_send(ACK);
+        PT_TIMEOUT(pt, TIMEOUT_TCP);
+        PT_WAIT_UNTIL(pt, s->f_event || PT_EXPIRED(pt));
+        if(s->f_event) {
+            s->f_event = FALSE;
+            if(s->f_rst || !s->f_enabled) goto error;
+            if(s->f_ack) goto done;
+        }
+    }
+
+error:
+    tcp_abort(s);
+    PT_EXIT(pt, PT_ERROR);
+
+done:
+    sckt = s;
+    ack_send(ACK);
+    tcp_abort(s);
+    PT_END(pt);
+}
+
+// ------------------------------------------------
+// Function:        tcp_close_nb()
+// ------------------------------------------------
+// Input:           Coroutine state
+//                  Socket ID
+// Output:          PT_DONE when disconnected
+// ------------------------------------------------
+// Description:     Non-blocking tcp_close()
+// ------------------------------------------------
+BYTE tcp_close_nb(PT *pt, BYTE n)
+{
+    BYTE res;
+
+    if(n >= MAX_SOCKETS_TCP) return PT_ERROR;
+    TCP_LOCK(&sockets_tcp[n]);
+    res = close_step(pt, n);
+    TCP_UNLOCK(&sockets_tcp[n]);
+    return res;
+}
+
+// ------------------------------------------------
+// Function:        send_step()
+// ------------------------------------------------
+// Input:           As tcp_send_nb()
+// Output:          As tcp_send_nb()
+// ------------------------------------------------
+// Description:     Runs tcp_send_nb() up to
+//                  its next wait
+// ------------------------------------------------
+static BYTE send_step(PT *pt, BYTE id, PPBUF pbuf)
+{
+    SOCKET_TCP *s;
+
+    s = &sockets_tcp[id];
+
+    PT_BEGIN(pt);
+    if(!s->f_enabled) PT_EXIT(pt, PT_ERROR);
+    if(s->f_listen) PT_EXIT(pt, PT_ERROR);
+    if(s->buf) PT_EXIT(pt, PT_ERROR);
+
+    // -------------------------------
+    // update sequence and packet size
+    // -------------------------------
+    s->next.d = s->seq.d + buffer_size(pbuf);
+    pbuf->offset -= sizeof(TCP_HDR);
+    pbuf->size += sizeof(TCP_HDR);
+
+    tcp_checksum(pbuf);
+    TCPH(BUF_DATA(pbuf))->checksum = HTONS(~WORDOF(chk_H, chk_L));
+
+    // ----------------------
+    // send data and wait ack
+    // ----------------------
+    for(pt->retry=0; pt->retry<MAX_RETRIES; pt->retry++) {
+        if(pt->retry) STAT_INC(tcp.retrans_segs);
+        s->flags &= (~MASK_FLAGS);
+        s->f_event = FALSE;
+        LAT_STAMP(pbuf);
+        ip_send(pbuf);
+        STAT_INC(tcp.out_segs);
+        PT_TIMEOUT(pt, TIMEOUT_TCP);
+        PT_WAIT_UNTIL(pt, s->f_event || PT_EXPIRED(pt));
+        if(s->f_event) {
+            if(s->f_rst || !s->f_enabled) break;
+            if(s->f_ack) PT_EXIT(pt, PT_DONE);
+        }
+    }
+
+    // --------------------------------
+    // socket error, half disconnection
+    // --------------------------------
+    tcp_abort(s);
+    PT_EXIT(pt, PT_ERROR);
+    PT_END(pt);
+}
+
+// ------------------------------------------------
+// Function:        tcp_send_nb()
+// ------------------------------------------------
+// Input:           Coroutine state
+//                  Socket ID
+//                  Packet to send
+// Output:          PT_DONE when acknowledged
+// ------------------------------------------------
+// Description:     Non-blocking tcp_send(). The
+//                  packet must be kept by the
+//                  caller until completion
+// ------------------------------------------------
+BYTE tcp_send_nb(PT *pt, BYTE id, PPBUF pbuf)
+{
+    BYTE res;
+
+    if(id >= MAX_SOCKETS_TCP) return PT_ERROR;
+    TCP_LOCK(&sockets_tcp[id]);
+    res = send_step(pt, id, pbuf);
+    TCP_UNLOCK(&sockets_tcp[id]);
+    return res;
+}
+
+// ------------------------------------------------
+// Function:        tcp_read_nb()
+// ------------------------------------------------
+// Input:           Socket ID
+// Output:          Last packet or NULL
+// ------------------------------------------------
+// Description:     Returns the received TCP
+//                  packet without waiting for it
+// ------------------------------------------------
+PPBUF tcp_read_nb(BYTE n)
+{
+    SOCKET_TCP *s;
+    PPBUF res;
+
+    if(n >= MAX_SOCKETS_TCP) return NULL;
+    s = &sockets_tcp[n];
+    TCP_LOCK(s);
+    if(!s->f_enabled || (s->buf == NULL)) {
+        TCP_UNLOCK(s);
+        return NULL;
+    }
+
+    // ---------------------
+    // acknowledges the data
+    // ---------------------
+    sckt = s;
+    ack_send(ACK);
+
+    res = s->buf;
+    s->buf = NULL;
+    TCP_UNLOCK(s);
+    LAT_MARK(res, LAT_RX_APP);
+    LAT_SPAN(res, LAT_RX_TOTAL);
+    return res;
+}
+#endif
+
 #endif
@@ -1,13 +1,59 @@
+// ------------------
+// TCP sockets status
+// ------------------
+typedef struct {
+    IPV4 peer;
+    UInt16 p_rem;
+    UInt16 p_loc;
+    PPBUF buf;                              // last TCP message
+    _UInt32 ack;                            // remote sequence number
+    _UInt32 seq;                            // local sequence number
+    _UInt32 next;                           // pending sequence number
+    union {
+        struct {
+            bit(f_enabled);
+            bit(f_listen);
+            bit(f_close);
+            bit(f_syn);
+            bit(f_fin);
+            bit(f_ack);
+            bit(f_rst);
+            bit(f_event);                   // socket event not yet handled
+        };
+        BYTE flags;
+    };
+    BYTE interface;
+#ifdef _SHARDS
+    BYTE shard;                             // worker parsing its flow
+    pthread_mutex_t lock;                   // state shared with that worker
+#endif
+} SOCKET_TCP;
+
+typedef struct {
+    SOCKET_TCP sockets[MAX_SOCKETS_TCP];
+    UInt16 next_p_loc;                      // local port selection
+} TCP_STATE;
+
 void parse_tcp(PPBUF pbuf);
 BOOL tcp_listen(BYTE n, UInt16 p_loc);
 BOOL tcp_open(BYTE n, UInt16 p_loc, IPV4 ip_rem, UInt16 p_rem, BYTE interface);
 void tcp_close(BYTE n);
 void tcp_reset(BYTE n);
+UInt16 tcp_mss(BYTE s);
 PPBUF tcp_new(BYTE s);
 BOOL tcp_send(BYTE id, PPBUF pbuf);
 BOOL tcp_send_text(BYTE id, char *text);
+BOOL tcp_send_const(BYTE id, const BYTE *p, UInt16 size, UInt16 sum);
+#define tcp_send_rom(id, s)             tcp_send_const(id, (const BYTE *)(s), sizeof(s) - 1, 0)    // string literal or _rom text
 PPBUF tcp_read(BYTE n);
 UInt16 tcp_get_port();
 BOOL tcp_is_open(BYTE s);
 BOOL tcp_has_data(BYTE s);
 void tcp_init(void);
+#ifdef _PT
+BYTE tcp_listen_nb(PT *pt, BYTE n, UInt16 p_loc);
+BYTE tcp_open_nb(PT *pt, BYTE n, UInt16 p_loc, IPV4 ip_rem, UInt16 p_rem, BYTE interface);
+BYTE tcp_close_nb(PT *pt, BYTE n);
+BYTE tcp_send_nb(PT *pt, BYTE id, PPBUF pbuf);
+PPBUF tcp_read_nb(BYTE n);
+#endif
@@ -14,6 +14,7 @@
 // Revision ID:     3
 // -------------------------------------------------------
 // Functions:       udp_checksum()
+//                  udp_match()
 //                  parse_udp()
 //                  udp_listen()
 //                  udp_read()
@@ -24,6 +25,7 @@
 //                  udp_get_port()
 //                  udp_has_data()
 //                  udp_init()
+//                  udp_listen_nb()
 // -------------------------------------------------------
 
 #include <stdlib.h>
@@ -35,32 +37,33 @@
 
 #ifdef _UDP
 
-// ------------------
-// UDP sockets status
-// ------------------
-typedef struct {
-    IPV4 peer;
-    UInt16 p_rem;
-    UInt16 p_loc;
-    PPBUF buf;										// last UDP message
-    struct {
-        bit(f_enabled);
-    };
-    BYTE interface;
-} SOCKET_UDP;
-SOCKET_UDP sockets_udp[MAX_SOCKETS_UDP];
-
 // --------------------
 // local port selection
 // --------------------
-static UInt16 next_p_loc;
 #define MIN_P_LOC			1024
 #define MAX_P_LOC			32767
 
-static BYTE *ptr;
-static UInt16 size;
-static BYTE ind;
-static SOCKET_UDP *sckt;
+// --------------------------
+// state of the current stack
+// --------------------------
+#define sockets_udp			(hermes->udp.sockets)
+#define next_p_loc			(hermes->udp.next_p_loc)
+
+static HERMES_TLS SOCKET_UDP *sckt;				// socket being handled
+
+// ------------------------------------------------
+// Sharded, a socket is parsed by a worker while
+// the application calls run on their own threads:
+// both take its buffer and state holding the
+// socket lock, never while waiting
+// ------------------------------------------------
+#ifdef _SHARDS
+#define UDP_LOCK(s)			pthread_mutex_lock(&(s)->lock)
+#define UDP_UNLOCK(s)		pthread_mutex_unlock(&(s)->lock)
+#else
+#define UDP_LOCK(s)
+#define UDP_UNLOCK(s)
+#endif
 
 #define IPH(xxx) ((IP_HDR *)xxx)
 #define UDPH(xxx) ((UDP_HDR *)xxx)
@@ -75,40 +78,58 @@ static SOCKET_UDP *sckt;
 // ------------------------------------------------
 void udp_checksum(PPBUF pbuf)
 {
-    size = pbuf->size;
-    ptr = pbuf->data;
-
-    // -------------------
-    // Check for odd sizes
-    // -------------------
-    if(size & 0x01) {
-        ptr[size] = 0x00;                           // add a pad to make it even
-        size++;
+    BYTE *ptr;
+    UInt16 size;
+    BYTE ind;
+
+    // ---------------------------------------
+    // loopback: no checksum (header gets 0)
+    // ---------------------------------------
+    if(ip_is_local(&IPH(BUF_START(pbuf))->dest)) {
+        chk_H = 0xff;
+        chk_L = 0xff;
+        return;
     }
 
     // -------------------------
     // computes message checksum
     // -------------------------
-    check_init();
-    while(size) {
-        check_update(*ptr);
-        ptr++;
-        size--;
-    }
+    check_buffer(pbuf);
 
     // ---------------------------------
     // account for the UDP pseudo-header
     // ---------------------------------
-    size = pbuf->size;
-    ptr = (BYTE *)&IPH(pbuf->start)->source;
+    size = buffer_size(pbuf);
+    ptr = (BYTE *)&IPH(BUF_START(pbuf))->source;
     for(ind=0; ind<8; ind++)
         check_update(*ptr++);
     check_update(0);
-    check_update(IPH(pbuf->start)->prot);
+    check_update(IPH(BUF_START(pbuf))->prot);
     check_update(HIGH(size));
     check_update(LOW(size));
 }
 
+// ------------------------------------------------
+// Function:        udp_match()
+// ------------------------------------------------
+// Input:           Socket
+//                  Destination port
+// Output:          TRUE if the datagram is its own
+// ------------------------------------------------
+// Description:     Checks a received datagram
+//                  against a socket, whose lock is
+//                  held
+// ------------------------------------------------
+static BOOL udp_match(SOCKET_UDP *s, UInt16 p_loc)
+{
+    if(!s->f_enabled) return FALSE;
+#ifdef _SHARDS
+    if(s->shard != shard_id) return FALSE;          // another worker's port
+#endif
+    if(p_loc != s->p_loc) return FALSE;
+    return TRUE;
+}
+
 // ------------------------------------------------
 // Function:        parse_udp()
 // ------------------------------------------------
@@ -119,40 +140,76 @@ void udp_checksum(PPBUF pbuf)
 // ------------------------------------------------
 void parse_udp(PPBUF pbuf)
 {
-    UDPH(pbuf->data)->dst_port = NTOHS((UDPH(pbuf->data)->dst_port));
-    UDPH(pbuf->data)->src_port = NTOHS((UDPH(pbuf->data)->src_port));
+    PPBUF b;
+    UInt16 src_port;
+    UInt16 dst_port;
+    BOOL broadcast;
+    BOOL bound;
+    BYTE ind;
+
+    LAT_MARK(pbuf, LAT_RX_PARSE);
+    dst_port = NTOHS((UDPH(BUF_DATA(pbuf))->dst_port));
+    src_port = NTOHS((UDPH(BUF_DATA(pbuf))->src_port));
+    broadcast = (IPH(BUF_START(pbuf))->dest.d == 0xffffffff);
 
-    // ---------------------
-    // find an active socket
-    // ---------------------
-    sckt = sockets_udp;
-    for(ind=0; ind<MAX_SOCKETS_UDP; ind++) {
-        if(sckt->f_enabled && (UDPH(pbuf->data)->dst_port == sckt->p_loc))
-            goto parse;
-        sckt++;
-    }
+    // -------------
+    // remove header
+    // -------------
+    pbuf->offset += sizeof(UDP_HDR);
+    pbuf->pos = pbuf->offset;
+    pbuf->size -= sizeof(UDP_HDR);
 
-    // ----------------------------------
-    // no socket for processing, dischard
-    // ----------------------------------
-    return;
+    // ------------------------------------------
+    // find active sockets: the first one gets the
+    // buffer, broadcasts are also shared (without
+    // copying) with the other sockets on the port
+    // ------------------------------------------
+    b = NULL;
+    bound = FALSE;
+    sckt = sockets_udp;
+    for(ind=0; ind<MAX_SOCKETS_UDP; ind++, sckt++) {
+        UDP_LOCK(sckt);
+        if(!udp_match(sckt, dst_port)) {
+            UDP_UNLOCK(sckt);
+            continue;
+        }
+        bound = TRUE;
+        if(sckt->buf) {                             // do not overwrite previous data
+            UDP_UNLOCK(sckt);
+            continue;
+        }
 
-parse:
-    if(sckt->buf) return;                           // do not overwrite previous data
+        if(b == NULL) {
+            retain_buffer(pbuf);
+            b = pbuf;
+        } else {
+            b = clone_buffer(pbuf);
+            if(b == NULL) {
+                UDP_UNLOCK(sckt);
+                return;
+            }
+        }
 
-    // --------------------
-    // update socket status
-    // --------------------
-    retain_buffer(pbuf);
-    sckt->peer = IPH(pbuf->start)->source;
-    sckt->p_rem = UDPH(pbuf->data)->src_port;
-    sckt->buf = pbuf;
-    sckt->interface = pbuf->interface;
-    pbuf->data += sizeof(UDP_HDR);
-    pbuf->ptr = pbuf->data;
-    pbuf->size -= sizeof(UDP_HDR);
+        // --------------------
+        // update socket status
+        // --------------------
+        sckt->peer = IPH(BUF_START(pbuf))->source;
+        sckt->p_rem = src_port;
+        QUOTA_OWN(b, QUOTA_OWNER_UDP(ind));
+        sckt->buf = b;
+        sckt->interface = pbuf->interface;
+        UDP_UNLOCK(sckt);
+
+        os_signal(SIG_UDP+ind);                     // send signal to waiting threads
+#ifdef _PT
+        pt_wake();
+#endif
+        if(!broadcast) break;
+    }
 
-    os_signal(SIG_UDP+ind);                         // send signal to waiting threads
+    if(b != NULL) STAT_INC(udp.in_datagrams);
+    else if(bound) STAT_INC(udp.in_errors);
+    else STAT_INC(udp.no_ports);
 }
 
 // ------------------------------------------------
@@ -171,14 +228,21 @@ BOOL udp_listen(BYTE n, UInt16 p_loc)
     if(n > MAX_SOCKETS_UDP) return FALSE;
     sckt = &sockets_udp[n];
 
-    if(sckt->f_enabled && (sckt->buf != NULL))      // data already available
-            return TRUE;
+    UDP_LOCK(sckt);
+    if(sckt->f_enabled && (sckt->buf != NULL)) {    // data already available
+        UDP_UNLOCK(sckt);
+        return TRUE;
+    }
 
     // -----------------------------------
     // enables socket for packet reception
     // -----------------------------------
     sckt->p_loc = p_loc;
+#ifdef _SHARDS
+    sckt->shard = shard_flow(0, 0, p_loc);
+#endif
     sckt->f_enabled = TRUE;
+    UDP_UNLOCK(sckt);
 
     // -----------------
     // wait for a signal
@@ -202,13 +266,22 @@ PPBUF udp_read(BYTE n)
     if(n > MAX_SOCKETS_UDP) return NULL;
     sckt = &sockets_udp[n];
 
-    if(!sckt->f_enabled) return NULL;               // socket is not enabled
+    UDP_LOCK(sckt);
+    if(!sckt->f_enabled) {                          // socket is not enabled
+        UDP_UNLOCK(sckt);
+        return NULL;
+    }
 
     // ----------------------------------------------
     // returns last message for the application layer
     // ----------------------------------------------
     res = sckt->buf;
     sckt->buf = NULL;
+    UDP_UNLOCK(sckt);
+    if(res != NULL) {
+        LAT_MARK(res, LAT_RX_APP);
+        LAT_SPAN(res, LAT_RX_TOTAL);
+    }
     return res;
 }	
 
@@ -229,18 +302,26 @@ BOOL udp_open(BYTE n, UInt16 p_loc, IPV4 ip_rem, UInt16 p_rem, BYTE interface)
 {
     if(n > MAX_SOCKETS_UDP) return FALSE;
     sckt = &sockets_udp[n];
-    if(sckt->f_enabled) return FALSE;					// socket already in use
+    UDP_LOCK(sckt);
+    if(sckt->f_enabled) {								// socket already in use
+        UDP_UNLOCK(sckt);
+        return FALSE;
+    }
 
     // ---------------------------------------
     // update socket information and enable it
     // ---------------------------------------
     sckt->p_loc = p_loc;
+#ifdef _SHARDS
+    sckt->shard = shard_flow(0, 0, p_loc);
+#endif
     sckt->p_rem = p_rem;
     sckt->peer.d = ip_rem.d;
     sckt->interface = interface;
     sckt->f_enabled = TRUE;
     if(sckt->buf) release_buffer(sckt->buf);
     sckt->buf = NULL;
+    UDP_UNLOCK(sckt);
     return TRUE;
 }
 
@@ -260,10 +341,12 @@ void udp_close(BYTE n)
     // -------------------------
     // update socket information
     // -------------------------
+    UDP_LOCK(sckt);
     sckt->p_loc = 0;
     sckt->f_enabled = FALSE;
     if(sckt->buf) release_buffer(sckt->buf);
     sckt->buf = NULL;
+    UDP_UNLOCK(sckt);
 }
 
 // ------------------------------------------------
@@ -281,24 +364,31 @@ PPBUF udp_new(BYTE s)
 
     if(s > MAX_SOCKETS_UDP) return NULL;
     sckt = &sockets_udp[s];
+    if(QUOTA_FULL(QUOTA_OWNER_UDP(s))) return NULL;         // leave buffers to the other sockets
 
-    new = ip_new(sckt->peer, MSS, sckt->interface);
-    if(new == NULL) return NULL;
+    UDP_LOCK(sckt);
+    new = ip_new(sckt->peer, MSS, sckt->interface, QUOTA_TX);
+    if(new == NULL) {
+        UDP_UNLOCK(sckt);
+        return NULL;
+    }
+    QUOTA_OWN(new, QUOTA_OWNER_UDP(s));
 
     // -------------
     // update header
     // -------------
-    UDPH(new->data)->checksum = 0;
-    UDPH(new->data)->src_port = HTONS(sckt->p_loc);
-    UDPH(new->data)->dst_port = HTONS(sckt->p_rem);
+    UDPH(BUF_DATA(new))->checksum = 0;
+    UDPH(BUF_DATA(new))->src_port = HTONS(sckt->p_loc);
+    UDPH(BUF_DATA(new))->dst_port = HTONS(sckt->p_rem);
+    UDP_UNLOCK(sckt);
 
     // --------------
     // prepare buffer
     // --------------
-    new->data += sizeof(UDP_HDR);
-    new->ptr = new->data;
+    new->offset += sizeof(UDP_HDR);
+    new->pos = new->offset;
     new->size = 0;
-    IPH(new->start)->prot = IP_PROT_UDP;
+    IPH(BUF_START(new))->prot = IP_PROT_UDP;
     return new;
 }
 
@@ -313,20 +403,25 @@ PPBUF udp_new(BYTE s)
 // ------------------------------------------------
 void udp_send(PPBUF pbuf)
 {
+    UInt16 size;
+
     // ------------------
     // update packet size
     // ------------------
-    pbuf->data -= sizeof(UDP_HDR);
+    pbuf->offset -= sizeof(UDP_HDR);
     pbuf->size += sizeof(UDP_HDR);
-    UDPH(pbuf->data)->length = HTONS(pbuf->size);
+    size = buffer_size(pbuf);
+    UDPH(BUF_DATA(pbuf))->length = HTONS(size);
 
     // ----------------
     // compute checksum
     // ----------------
     udp_checksum(pbuf);
-    UDPH(pbuf->data)->checksum = HTONS(~WORDOF(chk_H, chk_L));
+    UDPH(BUF_DATA(pbuf))->checksum = HTONS(~WORDOF(chk_H, chk_L));
 
+    LAT_STAMP(pbuf);
     ip_send(pbuf);
+    STAT_INC(udp.out_datagrams);
 }
 
 // ------------------------------------------------
@@ -379,9 +474,13 @@ search:
 // ------------------------------------------------
 BOOL udp_has_data(BYTE s)
 {
+    BOOL res;
+
     if(s > MAX_SOCKETS_UDP) return FALSE;
-    if(sockets_udp[s].buf == NULL) return FALSE;
-    return TRUE;
+    UDP_LOCK(&sockets_udp[s]);
+    res = (sockets_udp[s].buf != NULL);
+    UDP_UNLOCK(&sockets_udp[s]);
+    return res;
 }	
 
 // ------------------------------------------------
@@ -394,8 +493,49 @@ BOOL udp_has_data(BYTE s)
 // ------------------------------------------------
 void udp_init(void)
 {
+#ifdef _SHARDS
+    BYTE i;
+#endif
+
     os_set((BYTE *)sockets_udp, 0, sizeof(sockets_udp));
+#ifdef _SHARDS
+    for(i=0; i<MAX_SOCKETS_UDP; i++)
+        pthread_mutex_init(&sockets_udp[i].lock, NULL);
+#endif
     next_p_loc = MIN_P_LOC;
 }
 
+#ifdef _PT
+// ------------------------------------------------
+// Function:        udp_listen_nb()
+// ------------------------------------------------
+// Input:           Socket ID
+//                  Service UDP port
+// Output:          TRUE if a packet is available
+// ------------------------------------------------
+// Description:     Non-blocking udp_listen():
+//                  enables the socket and returns
+//                  immediately
+// ------------------------------------------------
+BOOL udp_listen_nb(BYTE n, UInt16 p_loc)
+{
+    if(n >= MAX_SOCKETS_UDP) return FALSE;
+    sckt = &sockets_udp[n];
+
+    UDP_LOCK(sckt);
+    if(sckt->f_enabled && (sckt->buf != NULL)) {    // data already available
+        UDP_UNLOCK(sckt);
+        return TRUE;
+    }
+
+    sckt->p_loc = p_loc;
+#ifdef _SHARDS
+    sckt->shard = shard_flow(0, 0, p_loc);
+#endif
+    sckt->f_enabled = TRUE;
+    UDP_UNLOCK(sckt);
+    return FALSE;
+}
+#endif
+
 #endif
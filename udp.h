@@ -1,4 +1,27 @@
-void trata_mens_udp(PPBUF pbuf);
+// ------------------
+// UDP sockets status
+// ------------------
+typedef struct {
+    IPV4 peer;
+    UInt16 p_rem;
+    UInt16 p_loc;
+    PPBUF buf;										// last UDP message
+    struct {
+        bit(f_enabled);
+    };
+    BYTE interface;
+#ifdef _SHARDS
+    BYTE shard;										// worker parsing its port
+    pthread_mutex_t lock;							// state shared with that worker
+#endif
+} SOCKET_UDP;
+
+typedef struct {
+    SOCKET_UDP sockets[MAX_SOCKETS_UDP];
+    UInt16 next_p_loc;								// local port selection
+} UDP_STATE;
+
+void parse_udp(PPBUF pbuf);
 BOOL udp_listen(BYTE n, UInt16 p_loc);
 PPBUF udp_read(BYTE n);
 BOOL udp_open(BYTE n, UInt16 p_loc, IPV4 ip_rem, UInt16 p_rem, BYTE interface);
@@ -7,4 +30,7 @@ PPBUF udp_new(BYTE s);
 void udp_send(PPBUF pbuf);
 UInt16 udp_get_port();
 BOOL udp_has_data(BYTE s);
-void udp_inicia(void);
+void udp_init(void);
+#ifdef _PT
+BOOL udp_listen_nb(BYTE n, UInt16 p_loc);
+#endif